@@ -26,7 +26,17 @@
 
 #include "SimplexNoise.h"
 
-#include <cstdint>  // int32_t/uint8_t
+#include <cstdint>  // int32_t/uint32_t
+
+/**
+ * Forces the inlining of the noise kernels inside the SIMD loops,
+ * otherwise the compiler can give up on vectorizing them.
+ */
+#if defined(__GNUC__)
+#define SIMPLEX_FORCE_INLINE inline __attribute__((always_inline))
+#else
+#define SIMPLEX_FORCE_INLINE inline
+#endif
 
 /**
  * Computes the largest integer value not greater than the float one
@@ -44,71 +54,50 @@
  */
 static inline int32_t fastfloor(float fp) {
     int32_t i = static_cast<int32_t>(fp);
-    return (fp < i) ? (i - 1) : (i);
+    return i - static_cast<int32_t>(fp < i);  // Branchless, to stay vectorizable
 }
 
 /**
- * Permutation table. This is just a random jumble of all numbers 0-255.
- *
- * This produce a repeatable pattern of 256, but Ken Perlin stated
- * that it is not a problem for graphic texture as the noise features disappear
- * at a distance far enough to be able to see a repeatable pattern of 256.
- *
- * This needs to be exactly the same for all instances on all platforms,
- * so it's easiest to just keep it as static explicit data.
- * This also removes the need for any initialisation of this class.
- *
- * Note that making this an uint32_t[] instead of a uint8_t[] might make the
- * code run faster on platforms with a high penalty for unaligned single
- * byte addressing. Intel x86 is generally single-byte-friendly, but
- * some other CPUs are faster with 4-aligned reads.
- * However, a char[] is smaller, which avoids cache trashing, and that
- * is probably the most important aspect on most architectures.
- * This array is accessed a *lot* by the noise functions.
- * A vector-valued noise over 3D accesses it 96 times, and a
- * float-valued 4D noise 64 times. We want this to fit in the cache!
- */
-static const uint8_t perm[256] = {
-    151, 160, 137, 91, 90, 15,
-    131, 13, 201, 95, 96, 53, 194, 233, 7, 225, 140, 36, 103, 30, 69, 142, 8, 99, 37, 240, 21, 10, 23,
-    190, 6, 148, 247, 120, 234, 75, 0, 26, 197, 62, 94, 252, 219, 203, 117, 35, 11, 32, 57, 177, 33,
-    88, 237, 149, 56, 87, 174, 20, 125, 136, 171, 168, 68, 175, 74, 165, 71, 134, 139, 48, 27, 166,
-    77, 146, 158, 231, 83, 111, 229, 122, 60, 211, 133, 230, 220, 105, 92, 41, 55, 46, 245, 40, 244,
-    102, 143, 54, 65, 25, 63, 161, 1, 216, 80, 73, 209, 76, 132, 187, 208, 89, 18, 169, 200, 196,
-    135, 130, 116, 188, 159, 86, 164, 100, 109, 198, 173, 186, 3, 64, 52, 217, 226, 250, 124, 123,
-    5, 202, 38, 147, 118, 126, 255, 82, 85, 212, 207, 206, 59, 227, 47, 16, 58, 17, 182, 189, 28, 42,
-    223, 183, 170, 213, 119, 248, 152, 2, 44, 154, 163, 70, 221, 153, 101, 155, 167, 43, 172, 9,
-    129, 22, 39, 253, 19, 98, 108, 110, 79, 113, 224, 232, 178, 185, 112, 104, 218, 246, 97, 228,
-    251, 34, 242, 193, 238, 210, 144, 12, 191, 179, 162, 241, 81, 51, 145, 235, 249, 14, 239, 107,
-    49, 192, 214, 31, 181, 199, 106, 157, 184, 84, 204, 176, 115, 121, 50, 45, 127, 4, 150, 254,
-    138, 236, 205, 93, 222, 114, 67, 29, 24, 72, 243, 141, 128, 195, 78, 66, 215, 61, 156, 180
-};
-
-/**
- * Helper function to hash an integer using the above permutation table
- *
- *  This inline function costs around 1ns, and is called N+1 times for a noise of N dimension.
+ * Helper functions to hash integer lattice coordinates (1D, 2D, 3D)
  *
- *  Using a real hash function would be better to improve the "repeatability of 256" of the above permutation table,
- * but fast integer Hash functions uses more time and have bad random properties.
+ * Replaces the classic 256 entries permutation table: the lattice coordinates
+ * are combined with large odd constants and finalized by an integer mixing
+ * function (lowbias32 by Chris Wellons). This costs a few integer multiplies
+ * and shifts, without any table gather, so it vectorizes cleanly,
+ * and it doesn't repeat every 256 units like the permutation table.
+ * All the bits of the result are well distributed, the gradient functions
+ * only use the lowest ones.
  *
- * @param[in] i Integer value to hash
+ * @param[in] i,j,k Integer lattice coordinates to hash
  *
- * @return 8-bits hashed value
+ * @return 32-bits hashed value
  */
-static inline uint8_t hash(int32_t i) {
-    return perm[static_cast<uint8_t>(i)];
+static inline uint32_t hash(int32_t i) {
+    uint32_t h = static_cast<uint32_t>(i);
+    h ^= h >> 16;
+    h *= 0x7feb352dU;
+    h ^= h >> 15;
+    h *= 0x846ca68bU;
+    h ^= h >> 16;
+    return h;
+}
+static inline uint32_t hash(int32_t i, int32_t j) {
+    return hash(static_cast<int32_t>(static_cast<uint32_t>(i) * 0x8da6b343U ^
+                                     static_cast<uint32_t>(j) * 0xd8163841U));
+}
+static inline uint32_t hash(int32_t i, int32_t j, int32_t k) {
+    return hash(static_cast<int32_t>(static_cast<uint32_t>(i) * 0x8da6b343U ^
+                                     static_cast<uint32_t>(j) * 0xd8163841U ^
+                                     static_cast<uint32_t>(k) * 0xcb1ab31fU));
 }
-
-/* NOTE Gradient table to test if lookup-table are more efficient than calculs
-static const float gradients1D[16] = {
-        -8.f, -7.f, -6.f, -5.f, -4.f, -3.f, -2.f, -1.f,
-         1.f,  2.f,  3.f,  4.f,  5.f,  6.f,  7.f,  8.f
-};
-*/
 
 /**
- * Helper function to compute gradients-dot-residual vectors (1D)
+ * Gradient look-up tables, generated at compile time
+ *
+ * Each entry stores the coefficients that the original branchy gradient
+ * functions apply to the distance to the corner, so the gradients-dot-residual
+ * becomes a plain multiply-add. Generating them from the very same rules keeps
+ * the exact same set and distribution of gradients.
  *
  * @note that these generate gradients of more than unit length. To make
  * a close match with the value range of classic Perlin noise, the final
@@ -116,18 +105,75 @@ static const float gradients1D[16] = {
  * (The simplex noise functions as such also have different scaling.)
  * Note also that these noise functions are the most practical and useful
  * signed version of Perlin noise.
+ */
+struct Gradients1D {
+    float x[16];
+};
+struct Gradients2D {
+    float x[64];
+    float y[64];
+};
+struct Gradients3D {
+    float x[16];
+    float y[16];
+    float z[16];
+};
+
+static constexpr Gradients1D make_gradients1D() {
+    Gradients1D g{};
+    for (int h = 0; h < 16; h++) {
+        const float grad = 1.0f + (h & 7);      // Gradient value 1.0, 2.0, ..., 8.0
+        g.x[h] = (h & 8) ? -grad : grad;        // with a random sign
+    }
+    return g;
+}
+
+static constexpr Gradients2D make_gradients2D() {
+    Gradients2D g{};
+    for (int h = 0; h < 64; h++) {
+        const float u = (h & 1) ? -1.0f : 1.0f; // Coefficient of the first coordinate
+        const float v = (h & 2) ? -2.0f : 2.0f; // Coefficient of the second coordinate
+        g.x[h] = (h < 4) ? u : v;               // first is x for h < 4, y otherwise
+        g.y[h] = (h < 4) ? v : u;
+    }
+    return g;
+}
+
+static constexpr Gradients3D make_gradients3D() {
+    Gradients3D g{};
+    for (int h = 0; h < 16; h++) {
+        const float u = (h & 1) ? -1.0f : 1.0f;
+        const float v = (h & 2) ? -1.0f : 1.0f;
+        // 12 gradient directions, the midpoints of the edges of a cube
+        if (h < 8)
+            g.x[h] += u;
+        else
+            g.y[h] += u;
+        if (h < 4)
+            g.y[h] += v;
+        else if (h == 12 || h == 14) // Fix repeats at h = 12 to 15
+            g.x[h] += v;
+        else
+            g.z[h] += v;
+    }
+    return g;
+}
+
+alignas(64) static constexpr Gradients1D gradients1D = make_gradients1D();
+alignas(64) static constexpr Gradients2D gradients2D = make_gradients2D();
+alignas(64) static constexpr Gradients3D gradients3D = make_gradients3D();
+
+/**
+ * Helper function to compute gradients-dot-residual vectors (1D)
  *
  * @param[in] hash  hash value
  * @param[in] x     distance to the corner
  *
  * @return gradient value
  */
-static float grad(int32_t hash, float x) {
-    const int32_t h = hash & 0x0F;  // Convert low 4 bits of hash code
-    float grad = 1.0f + (h & 7);    // Gradient value 1.0, 2.0, ..., 8.0
-    if ((h & 8) != 0) grad = -grad; // Set a random sign for the gradient
-//  float grad = gradients1D[h];    // NOTE : Test of Gradient look-up table instead of the above
-    return (grad * x);              // Multiply the gradient with the distance
+static inline float grad(uint32_t hash, float x) {
+    const uint32_t h = hash & 0x0F;  // Low 4 bits of hash code
+    return gradients1D.x[h] * x;
 }
 
 /**
@@ -139,11 +185,9 @@ static float grad(int32_t hash, float x) {
  *
  * @return gradient value
  */
-static float grad(int32_t hash, float x, float y) {
-    const int32_t h = hash & 0x3F;  // Convert low 3 bits of hash code
-    const float u = h < 4 ? x : y;  // into 8 simple gradient directions,
-    const float v = h < 4 ? y : x;
-    return ((h & 1) ? -u : u) + ((h & 2) ? -2.0f * v : 2.0f * v); // and compute the dot product with (x,y).
+static inline float grad(uint32_t hash, float x, float y) {
+    const uint32_t h = hash & 0x3F;  // Low 6 bits of hash code
+    return gradients2D.x[h] * x + gradients2D.y[h] * y;
 }
 
 /**
@@ -156,11 +200,9 @@ static float grad(int32_t hash, float x, float y) {
  *
  * @return gradient value
  */
-static float grad(int32_t hash, float x, float y, float z) {
-    int h = hash & 15;     // Convert low 4 bits of hash code into 12 simple
-    float u = h < 8 ? x : y; // gradient directions, and compute dot product.
-    float v = h < 4 ? y : h == 12 || h == 14 ? x : z; // Fix repeats at h = 12 to 15
-    return ((h & 1) ? -u : u) + ((h & 2) ? -v : v);
+static inline float grad(uint32_t hash, float x, float y, float z) {
+    const uint32_t h = hash & 0x0F;  // Low 4 bits of hash code
+    return gradients3D.x[h] * x + gradients3D.y[h] * y + gradients3D.z[h] * z;
 }
 
 /**
@@ -253,9 +295,9 @@ float SimplexNoise::noise(float x, float y) {
     const float y2 = y0 - 1.0f + 2.0f * G2;
 
     // Work out the hashed gradient indices of the three simplex corners
-    const int gi0 = hash(i + hash(j));
-    const int gi1 = hash(i + i1 + hash(j + j1));
-    const int gi2 = hash(i + 1 + hash(j + 1));
+    const uint32_t gi0 = hash(i, j);
+    const uint32_t gi1 = hash(i + i1, j + j1);
+    const uint32_t gi2 = hash(i + 1, j + 1);
 
     // Calculate the contribution from the first corner
     float t0 = 0.5f - x0*x0 - y0*y0;
@@ -291,7 +333,32 @@ float SimplexNoise::noise(float x, float y) {
 
 
 /**
- * 3D Perlin simplex noise
+ * Helper function to compute the contribution of a simplex corner (3D)
+ *
+ * Branchless fall-off: negative radial attenuations are clamped to zero
+ * instead of being skipped.
+ *
+ * @param[in] gi    hashed gradient index of the corner
+ * @param[in] x     x coord of the distance to the corner
+ * @param[in] y     y coord of the distance to the corner
+ * @param[in] z     z coord of the distance to the corner
+ *
+ * @return corner contribution
+ */
+static inline float corner(uint32_t gi, float x, float y, float z) {
+    const float g = grad(gi, x, y, z);
+    float t = 0.6f - x*x - y*y - z*z;
+    t = (t > 0.0f) ? t : 0.0f;
+    t *= t;
+    return t * t * g;
+}
+
+/**
+ * 3D Perlin simplex noise kernel, shared by the scalar and SIMD entry points
+ *
+ * The simplex traversal order, the hashes and the corner fall-off are all
+ * computed without branches nor table gathers, so that the compiler can keep
+ * every lane of a SIMD loop in registers.
  *
  * @param[in] x float coordinate
  * @param[in] y float coordinate
@@ -299,100 +366,84 @@ float SimplexNoise::noise(float x, float y) {
  *
  * @return Noise value in the range[-1; 1], value of 0 on all integer coordinates.
  */
-float SimplexNoise::noise(float x, float y, float z) {
-    float n0, n1, n2, n3; // Noise contributions from the four corners
-
+static SIMPLEX_FORCE_INLINE float simplex3D(float x, float y, float z) {
     // Skewing/Unskewing factors for 3D
-    static const float F3 = 1.0f / 3.0f;
-    static const float G3 = 1.0f / 6.0f;
+    const float F3 = 1.0f / 3.0f;
+    const float G3 = 1.0f / 6.0f;
 
     // Skew the input space to determine which simplex cell we're in
-    float s = (x + y + z) * F3; // Very nice and simple skew factor for 3D
-    int i = fastfloor(x + s);
-    int j = fastfloor(y + s);
-    int k = fastfloor(z + s);
-    float t = (i + j + k) * G3;
-    float X0 = i - t; // Unskew the cell origin back to (x,y,z) space
-    float Y0 = j - t;
-    float Z0 = k - t;
-    float x0 = x - X0; // The x,y,z distances from the cell origin
-    float y0 = y - Y0;
-    float z0 = z - Z0;
+    const float s = (x + y + z) * F3; // Very nice and simple skew factor for 3D
+    const int32_t i = fastfloor(x + s);
+    const int32_t j = fastfloor(y + s);
+    const int32_t k = fastfloor(z + s);
+    const float t = (i + j + k) * G3;
+    const float x0 = x - (i - t); // The x,y,z distances from the unskewed cell origin
+    const float y0 = y - (j - t);
+    const float z0 = z - (k - t);
 
     // For the 3D case, the simplex shape is a slightly irregular tetrahedron.
-    // Determine which simplex we are in.
-    int i1, j1, k1; // Offsets for second corner of simplex in (i,j,k) coords
-    int i2, j2, k2; // Offsets for third corner of simplex in (i,j,k) coords
-    if (x0 >= y0) {
-        if (y0 >= z0) {
-            i1 = 1; j1 = 0; k1 = 0; i2 = 1; j2 = 1; k2 = 0; // X Y Z order
-        } else if (x0 >= z0) {
-            i1 = 1; j1 = 0; k1 = 0; i2 = 1; j2 = 0; k2 = 1; // X Z Y order
-        } else {
-            i1 = 0; j1 = 0; k1 = 1; i2 = 1; j2 = 0; k2 = 1; // Z X Y order
-        }
-    } else { // x0<y0
-        if (y0 < z0) {
-            i1 = 0; j1 = 0; k1 = 1; i2 = 0; j2 = 1; k2 = 1; // Z Y X order
-        } else if (x0 < z0) {
-            i1 = 0; j1 = 1; k1 = 0; i2 = 0; j2 = 1; k2 = 1; // Y Z X order
-        } else {
-            i1 = 0; j1 = 1; k1 = 0; i2 = 1; j2 = 1; k2 = 0; // Y X Z order
-        }
-    }
+    // The rank ordering of the distances gives the offsets of its corners.
+    const int32_t xy = x0 >= y0;
+    const int32_t yz = y0 >= z0;
+    const int32_t xz = x0 >= z0;
+    const int32_t i1 = xy & xz;             // Offsets for second corner of simplex in (i,j,k) coords
+    const int32_t j1 = (1 - xy) & yz;
+    const int32_t k1 = (1 - xz) & (1 - yz);
+    const int32_t i2 = xy | xz;             // Offsets for third corner of simplex in (i,j,k) coords
+    const int32_t j2 = (1 - xy) | yz;
+    const int32_t k2 = 1 - (xz & yz);
 
     // A step of (1,0,0) in (i,j,k) means a step of (1-c,-c,-c) in (x,y,z),
     // a step of (0,1,0) in (i,j,k) means a step of (-c,1-c,-c) in (x,y,z), and
     // a step of (0,0,1) in (i,j,k) means a step of (-c,-c,1-c) in (x,y,z), where
     // c = 1/6.
-    float x1 = x0 - i1 + G3; // Offsets for second corner in (x,y,z) coords
-    float y1 = y0 - j1 + G3;
-    float z1 = z0 - k1 + G3;
-    float x2 = x0 - i2 + 2.0f * G3; // Offsets for third corner in (x,y,z) coords
-    float y2 = y0 - j2 + 2.0f * G3;
-    float z2 = z0 - k2 + 2.0f * G3;
-    float x3 = x0 - 1.0f + 3.0f * G3; // Offsets for last corner in (x,y,z) coords
-    float y3 = y0 - 1.0f + 3.0f * G3;
-    float z3 = z0 - 1.0f + 3.0f * G3;
+    const float x1 = x0 - i1 + G3; // Offsets for second corner in (x,y,z) coords
+    const float y1 = y0 - j1 + G3;
+    const float z1 = z0 - k1 + G3;
+    const float x2 = x0 - i2 + 2.0f * G3; // Offsets for third corner in (x,y,z) coords
+    const float y2 = y0 - j2 + 2.0f * G3;
+    const float z2 = z0 - k2 + 2.0f * G3;
+    const float x3 = x0 - 1.0f + 3.0f * G3; // Offsets for last corner in (x,y,z) coords
+    const float y3 = y0 - 1.0f + 3.0f * G3;
+    const float z3 = z0 - 1.0f + 3.0f * G3;
 
     // Work out the hashed gradient indices of the four simplex corners
-    int gi0 = hash(i + hash(j + hash(k)));
-    int gi1 = hash(i + i1 + hash(j + j1 + hash(k + k1)));
-    int gi2 = hash(i + i2 + hash(j + j2 + hash(k + k2)));
-    int gi3 = hash(i + 1 + hash(j + 1 + hash(k + 1)));
-
-    // Calculate the contribution from the four corners
-    float t0 = 0.6f - x0*x0 - y0*y0 - z0*z0;
-    if (t0 < 0) {
-        n0 = 0.0;
-    } else {
-        t0 *= t0;
-        n0 = t0 * t0 * grad(gi0, x0, y0, z0);
-    }
-    float t1 = 0.6f - x1*x1 - y1*y1 - z1*z1;
-    if (t1 < 0) {
-        n1 = 0.0;
-    } else {
-        t1 *= t1;
-        n1 = t1 * t1 * grad(gi1, x1, y1, z1);
-    }
-    float t2 = 0.6f - x2*x2 - y2*y2 - z2*z2;
-    if (t2 < 0) {
-        n2 = 0.0;
-    } else {
-        t2 *= t2;
-        n2 = t2 * t2 * grad(gi2, x2, y2, z2);
-    }
-    float t3 = 0.6f - x3*x3 - y3*y3 - z3*z3;
-    if (t3 < 0) {
-        n3 = 0.0;
-    } else {
-        t3 *= t3;
-        n3 = t3 * t3 * grad(gi3, x3, y3, z3);
-    }
+    const uint32_t gi0 = hash(i, j, k);
+    const uint32_t gi1 = hash(i + i1, j + j1, k + k1);
+    const uint32_t gi2 = hash(i + i2, j + j2, k + k2);
+    const uint32_t gi3 = hash(i + 1, j + 1, k + 1);
+
     // Add contributions from each corner to get the final noise value.
     // The result is scaled to stay just inside [-1,1]
-    return 32.0f*(n0 + n1 + n2 + n3);
+    return 32.0f * (corner(gi0, x0, y0, z0) + corner(gi1, x1, y1, z1) +
+                    corner(gi2, x2, y2, z2) + corner(gi3, x3, y3, z3));
+}
+
+/**
+ * 3D Perlin simplex noise
+ *
+ * @param[in] x float coordinate
+ * @param[in] y float coordinate
+ * @param[in] z float coordinate
+ *
+ * @return Noise value in the range[-1; 1], value of 0 on all integer coordinates.
+ */
+float SimplexNoise::noise(float x, float y, float z) {
+    return simplex3D(x, y, z);
+}
+
+/**
+ * 3D Perlin simplex noise of SimplexNoise::LANES points at once
+ *
+ * @param[in]  x    LANES x float coordinates
+ * @param[in]  y    LANES y float coordinates
+ * @param[in]  z    LANES z float coordinates
+ * @param[out] out  LANES noise values in the range[-1; 1]
+ */
+void SimplexNoise::noise(const float* x, const float* y, const float* z, float* out) {
+#pragma omp simd
+    for (size_t l = 0; l < LANES; l++)
+        out[l] = simplex3D(x[l], y[l], z[l]);
 }
 
 
@@ -463,13 +514,74 @@ float SimplexNoise::fractal(size_t octaves, float x, float y, float z) const {
     float frequency = mFrequency;
     float amplitude = mAmplitude;
 
-    for (size_t i = 0; i < octaves; i++) {
-        output += (amplitude * noise(x * frequency, y * frequency, z * frequency));
-        denom += amplitude;
-
-        frequency *= mLacunarity;
-        amplitude *= mPersistence;
+    // Octaves are independent: evaluate up to LANES of them in a single SIMD noise call
+    float xs[LANES], ys[LANES], zs[LANES], amplitudes[LANES], values[LANES];
+    for (size_t first = 0; first < octaves; first += LANES) {
+        const size_t n = (octaves - first < LANES) ? (octaves - first) : LANES;
+        for (size_t l = 0; l < LANES; l++) {
+            xs[l] = x * frequency;
+            ys[l] = y * frequency;
+            zs[l] = z * frequency;
+            amplitudes[l] = amplitude;
+
+            frequency *= mLacunarity;
+            amplitude *= mPersistence;
+        }
+        noise(xs, ys, zs, values);
+        for (size_t l = 0; l < n; l++) {
+            output += (amplitudes[l] * values[l]);
+            denom += amplitudes[l];
+        }
     }
 
     return (output / denom);
-}
\ No newline at end of file
+}
+
+/**
+ * Batched Fractal/Fractional Brownian Motion (fBm) summation of 3D Perlin Simplex noise
+ *
+ * Points are packed LANES at a time in the SIMD noise, every octave being a
+ * pass over the same packed points. Gives the same values as calling the
+ * single point fractal() on each point.
+ *
+ * @param[in]  octaves  number of fraction of noise to sum
+ * @param[in]  count    number of points
+ * @param[in]  x        count x float coordinates
+ * @param[in]  y        count y float coordinates
+ * @param[in]  z        count z float coordinates
+ * @param[out] out      count noise values in the range[-1; 1]
+ */
+void SimplexNoise::fractal(size_t octaves, size_t count,
+                           const float* x, const float* y, const float* z, float* out) const {
+    float xs[LANES], ys[LANES], zs[LANES], values[LANES], output[LANES];
+
+    for (size_t first = 0; first < count; first += LANES) {
+        const size_t n = (count - first < LANES) ? (count - first) : LANES;
+        float denom = 0.f;
+        float frequency = mFrequency;
+        float amplitude = mAmplitude;
+
+        for (size_t l = 0; l < LANES; l++)
+            output[l] = 0.f;
+
+        for (size_t i = 0; i < octaves; i++) {
+            // Tail lanes past the last point just repeat it
+            for (size_t l = 0; l < LANES; l++) {
+                const size_t p = first + ((l < n) ? l : (n - 1));
+                xs[l] = x[p] * frequency;
+                ys[l] = y[p] * frequency;
+                zs[l] = z[p] * frequency;
+            }
+            noise(xs, ys, zs, values);
+            for (size_t l = 0; l < LANES; l++)
+                output[l] += (amplitude * values[l]);
+            denom += amplitude;
+
+            frequency *= mLacunarity;
+            amplitude *= mPersistence;
+        }
+
+        for (size_t l = 0; l < n; l++)
+            out[first + l] = (output[l] / denom);
+    }
+}
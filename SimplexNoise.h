@@ -23,10 +23,18 @@ public:
     // 3D Perlin simplex noise
     static float noise(float x, float y, float z);
 
+    /// Number of 3D noise evaluations packed together by the SIMD paths
+    static const size_t LANES = 8;
+    // 3D Perlin simplex noise of LANES points at once (SIMD)
+    static void noise(const float* x, const float* y, const float* z, float* out);
+
     // Fractal/Fractional Brownian Motion (fBm) noise summation
     float fractal(size_t octaves, float x) const;
     float fractal(size_t octaves, float x, float y) const;
     float fractal(size_t octaves, float x, float y, float z) const;
+    // Batched 3D fBm of count points: out[i] = fractal(octaves, x[i], y[i], z[i])
+    void fractal(size_t octaves, size_t count,
+                 const float* x, const float* y, const float* z, float* out) const;
 
     /**
      * Constructor of to initialize a fractal noise summation
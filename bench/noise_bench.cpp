@@ -0,0 +1,255 @@
+/**
+ * Microbenchmark of the 3D noise used by the wind field.
+ *
+ * Compares the current SimplexNoise core (integer hash, gradient tables,
+ * SIMD lanes) with the previous permutation-table implementation, which is
+ * kept here verbatim as a reference, both in timing and in the statistical
+ * properties of the generated values.
+ *
+ * Build and run with `make noise_bench && ./noise_bench`
+ */
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+#include "../SimplexNoise.h"
+
+namespace legacy {
+
+static inline int32_t fastfloor(float fp) {
+    int32_t i = static_cast<int32_t>(fp);
+    return (fp < i) ? (i - 1) : (i);
+}
+
+// Permutation table of the previous implementation
+const uint8_t perm[256] = {
+    151, 160, 137, 91, 90, 15,
+    131, 13, 201, 95, 96, 53, 194, 233, 7, 225, 140, 36, 103, 30, 69, 142, 8, 99, 37, 240, 21, 10, 23,
+    190, 6, 148, 247, 120, 234, 75, 0, 26, 197, 62, 94, 252, 219, 203, 117, 35, 11, 32, 57, 177, 33,
+    88, 237, 149, 56, 87, 174, 20, 125, 136, 171, 168, 68, 175, 74, 165, 71, 134, 139, 48, 27, 166,
+    77, 146, 158, 231, 83, 111, 229, 122, 60, 211, 133, 230, 220, 105, 92, 41, 55, 46, 245, 40, 244,
+    102, 143, 54, 65, 25, 63, 161, 1, 216, 80, 73, 209, 76, 132, 187, 208, 89, 18, 169, 200, 196,
+    135, 130, 116, 188, 159, 86, 164, 100, 109, 198, 173, 186, 3, 64, 52, 217, 226, 250, 124, 123,
+    5, 202, 38, 147, 118, 126, 255, 82, 85, 212, 207, 206, 59, 227, 47, 16, 58, 17, 182, 189, 28, 42,
+    223, 183, 170, 213, 119, 248, 152, 2, 44, 154, 163, 70, 221, 153, 101, 155, 167, 43, 172, 9,
+    129, 22, 39, 253, 19, 98, 108, 110, 79, 113, 224, 232, 178, 185, 112, 104, 218, 246, 97, 228,
+    251, 34, 242, 193, 238, 210, 144, 12, 191, 179, 162, 241, 81, 51, 145, 235, 249, 14, 239, 107,
+    49, 192, 214, 31, 181, 199, 106, 157, 184, 84, 204, 176, 115, 121, 50, 45, 127, 4, 150, 254,
+    138, 236, 205, 93, 222, 114, 67, 29, 24, 72, 243, 141, 128, 195, 78, 66, 215, 61, 156, 180
+};
+
+static inline uint8_t hash(int32_t i) {
+    return perm[static_cast<uint8_t>(i)];
+}
+
+static float grad(int32_t hash, float x, float y, float z) {
+    int h = hash & 15;
+    float u = h < 8 ? x : y;
+    float v = h < 4 ? y : h == 12 || h == 14 ? x : z;
+    return ((h & 1) ? -u : u) + ((h & 2) ? -v : v);
+}
+
+// Previous 3D Perlin simplex noise, hashing through the permutation table
+static float noise(float x, float y, float z) {
+    float n0, n1, n2, n3;
+    static const float F3 = 1.0f / 3.0f;
+    static const float G3 = 1.0f / 6.0f;
+
+    float s = (x + y + z) * F3;
+    int i = fastfloor(x + s);
+    int j = fastfloor(y + s);
+    int k = fastfloor(z + s);
+    float t = (i + j + k) * G3;
+    float x0 = x - (i - t);
+    float y0 = y - (j - t);
+    float z0 = z - (k - t);
+
+    int i1, j1, k1;
+    int i2, j2, k2;
+    if (x0 >= y0) {
+        if (y0 >= z0) {
+            i1 = 1; j1 = 0; k1 = 0; i2 = 1; j2 = 1; k2 = 0;
+        } else if (x0 >= z0) {
+            i1 = 1; j1 = 0; k1 = 0; i2 = 1; j2 = 0; k2 = 1;
+        } else {
+            i1 = 0; j1 = 0; k1 = 1; i2 = 1; j2 = 0; k2 = 1;
+        }
+    } else {
+        if (y0 < z0) {
+            i1 = 0; j1 = 0; k1 = 1; i2 = 0; j2 = 1; k2 = 1;
+        } else if (x0 < z0) {
+            i1 = 0; j1 = 1; k1 = 0; i2 = 0; j2 = 1; k2 = 1;
+        } else {
+            i1 = 0; j1 = 1; k1 = 0; i2 = 1; j2 = 1; k2 = 0;
+        }
+    }
+
+    float x1 = x0 - i1 + G3;
+    float y1 = y0 - j1 + G3;
+    float z1 = z0 - k1 + G3;
+    float x2 = x0 - i2 + 2.0f * G3;
+    float y2 = y0 - j2 + 2.0f * G3;
+    float z2 = z0 - k2 + 2.0f * G3;
+    float x3 = x0 - 1.0f + 3.0f * G3;
+    float y3 = y0 - 1.0f + 3.0f * G3;
+    float z3 = z0 - 1.0f + 3.0f * G3;
+
+    int gi0 = hash(i + hash(j + hash(k)));
+    int gi1 = hash(i + i1 + hash(j + j1 + hash(k + k1)));
+    int gi2 = hash(i + i2 + hash(j + j2 + hash(k + k2)));
+    int gi3 = hash(i + 1 + hash(j + 1 + hash(k + 1)));
+
+    float t0 = 0.6f - x0*x0 - y0*y0 - z0*z0;
+    if (t0 < 0) {
+        n0 = 0.0;
+    } else {
+        t0 *= t0;
+        n0 = t0 * t0 * grad(gi0, x0, y0, z0);
+    }
+    float t1 = 0.6f - x1*x1 - y1*y1 - z1*z1;
+    if (t1 < 0) {
+        n1 = 0.0;
+    } else {
+        t1 *= t1;
+        n1 = t1 * t1 * grad(gi1, x1, y1, z1);
+    }
+    float t2 = 0.6f - x2*x2 - y2*y2 - z2*z2;
+    if (t2 < 0) {
+        n2 = 0.0;
+    } else {
+        t2 *= t2;
+        n2 = t2 * t2 * grad(gi2, x2, y2, z2);
+    }
+    float t3 = 0.6f - x3*x3 - y3*y3 - z3*z3;
+    if (t3 < 0) {
+        n3 = 0.0;
+    } else {
+        t3 *= t3;
+        n3 = t3 * t3 * grad(gi3, x3, y3, z3);
+    }
+    return 32.0f*(n0 + n1 + n2 + n3);
+}
+
+// Previous fBm summation, one octave after the other
+static float fractal(size_t octaves, float x, float y, float z) {
+    float output = 0.f;
+    float denom  = 0.f;
+    float frequency = 1.0f;
+    float amplitude = 1.0f;
+
+    for (size_t i = 0; i < octaves; i++) {
+        output += (amplitude * noise(x * frequency, y * frequency, z * frequency));
+        denom += amplitude;
+
+        frequency *= 2.0f;
+        amplitude *= 0.5f;
+    }
+
+    return (output / denom);
+}
+
+} // namespace legacy
+
+const size_t N_SAMPLES = 1 << 20;
+const int N_REPEATS = 5;
+
+// Summary statistics of a set of noise values
+struct Stats {
+    double mean = 0;
+    double stddev = 0;
+    double min = INFINITY;
+    double max = -INFINITY;
+    double lag_correlation = 0; // Correlation between neighboring samples
+};
+
+Stats compute_stats(const std::vector<float>& values) {
+    Stats stats;
+    for (float v : values) {
+        stats.mean += v;
+        stats.min = std::fmin(stats.min, v);
+        stats.max = std::fmax(stats.max, v);
+    }
+    stats.mean /= values.size();
+    double covariance = 0;
+    for (size_t i = 0; i < values.size(); i++) {
+        stats.stddev += (values[i] - stats.mean) * (values[i] - stats.mean);
+        if (i > 0)
+            covariance += (values[i] - stats.mean) * (values[i - 1] - stats.mean);
+    }
+    stats.lag_correlation = covariance / stats.stddev;
+    stats.stddev = std::sqrt(stats.stddev / values.size());
+    return stats;
+}
+
+// Returns the best time in nanoseconds per sample of the given function
+template <typename F>
+double time_per_sample(F f) {
+    double best = INFINITY;
+    for (int r = 0; r < N_REPEATS; r++) {
+        auto start = std::chrono::steady_clock::now();
+        f();
+        auto stop = std::chrono::steady_clock::now();
+        best = std::fmin(best, std::chrono::duration<double, std::nano>(stop - start).count());
+    }
+    return best / N_SAMPLES;
+}
+
+void print_stats(const char* name, const Stats& stats) {
+    printf("%-10s mean % .4f  stddev %.4f  range [% .4f, % .4f]  lag-1 corr %.4f\n",
+        name, stats.mean, stats.stddev, stats.min, stats.max, stats.lag_correlation);
+}
+
+int main() {
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<float> coordinate(-1000.0f, 1000.0f);
+
+    // Random points, and a regularly spaced line of points like the wind field rows
+    std::vector<float> x(N_SAMPLES), y(N_SAMPLES), z(N_SAMPLES);
+    std::vector<float> line_x(N_SAMPLES), line_y(N_SAMPLES, 0.5f), line_z(N_SAMPLES, 7.25f);
+    for (size_t i = 0; i < N_SAMPLES; i++) {
+        x[i] = coordinate(rng);
+        y[i] = coordinate(rng);
+        z[i] = coordinate(rng);
+        line_x[i] = i * 0.03f;
+    }
+    std::vector<float> legacy_values(N_SAMPLES), values(N_SAMPLES);
+    SimplexNoise noise;
+    volatile float sink = 0;
+
+    printf("3D noise, %zu samples (best of %d runs)\n", N_SAMPLES, N_REPEATS);
+    for (size_t octaves : { 1, 3, 5 }) {
+        double legacy_ns = time_per_sample([&] {
+            for (size_t i = 0; i < N_SAMPLES; i++)
+                legacy_values[i] = legacy::fractal(octaves, x[i], y[i], z[i]);
+        });
+        double scalar_ns = time_per_sample([&] {
+            for (size_t i = 0; i < N_SAMPLES; i++)
+                values[i] = noise.fractal(octaves, x[i], y[i], z[i]);
+        });
+        double batched_ns = time_per_sample([&] {
+            noise.fractal(octaves, N_SAMPLES, x.data(), y.data(), z.data(), values.data());
+        });
+        sink = sink + values[0] + legacy_values[0];
+        printf("%zu octave(s): legacy %6.2f ns  scalar %6.2f ns  batched %6.2f ns  (x%.1f)\n",
+            octaves, legacy_ns, scalar_ns, batched_ns, legacy_ns / batched_ns);
+    }
+
+    printf("\nRandom points statistics\n");
+    for (size_t i = 0; i < N_SAMPLES; i++)
+        legacy_values[i] = legacy::noise(x[i], y[i], z[i]);
+    noise.fractal(1, N_SAMPLES, x.data(), y.data(), z.data(), values.data());
+    print_stats("legacy", compute_stats(legacy_values));
+    print_stats("current", compute_stats(values));
+
+    printf("\nLine of points statistics\n");
+    for (size_t i = 0; i < N_SAMPLES; i++)
+        legacy_values[i] = legacy::noise(line_x[i], line_y[i], line_z[i]);
+    noise.fractal(1, N_SAMPLES, line_x.data(), line_y.data(), line_z.data(), values.data());
+    print_stats("legacy", compute_stats(legacy_values));
+    print_stats("current", compute_stats(values));
+
+    return 0;
+}
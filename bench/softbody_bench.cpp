@@ -0,0 +1,76 @@
+/**
+ * Benchmark of the colored parallel constraint solver on soft body lattices.
+ *
+ * For lattices of growing size, the distance constraints are swept serially
+ * (Cloth::constrain()), then by the colored solver, whose colors are projected
+ * by the threads of the pool, and the whole soft body solve (distance and
+ * volume constraints) is timed. The colored sweeps and the soft body solve are
+ * timed with pools of 1, 2 and as many threads as cores: how their time drops
+ * with the threads is how the solver scales, the serial sweep being the cost
+ * of the plain Gauss-Seidel order it replaces.
+ *
+ * Build and run with `make softbody_bench && ./softbody_bench`
+ */
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <thread>
+#include <vector>
+
+#include "../softbody.h"
+
+float Camera::fovy = 45.0f;
+bool Camera::is_cursor_in_window = false;
+
+const int N_SWEEPS = 5;
+
+// Returns the milliseconds taken by a sweep, averaged over N_SWEEPS after a first untimed one
+double time_sweeps(const std::function<void()>& sweep) {
+    sweep();
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < N_SWEEPS; i++)
+        sweep();
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / N_SWEEPS;
+}
+
+int main() {
+    // Sizes of the pool the colored solves are timed with
+    const int n_cores = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<int> pool_sizes = { 1 };
+    for (int n_threads : { 2, n_cores })
+        if (n_threads > pool_sizes.back())
+            pool_sizes.push_back(n_threads);
+
+    printf("%d cores, ms per sweep, colored sweeps and soft body solves with T threads\n", n_cores);
+    printf("%-10s %10s %12s %10s", "lattice", "points", "constraints", "serial");
+    for (int n_threads : pool_sizes) {
+        char column[32];
+        snprintf(column, sizeof(column), "colored T=%d", n_threads);
+        printf(" %14s", column);
+        snprintf(column, sizeof(column), "soft body T=%d", n_threads);
+        printf(" %16s", column);
+    }
+    printf("\n");
+
+    for (int size : { 10, 20, 40, 60 }) {
+        SoftBody body;
+        body.build_lattice(size, size, size, RESTING_DISTANCE, Vec3d{ 0, 0, 0 });
+        // Moving the points off their resting positions, so that every projection does some work
+        for (int i = 0; i < body.points.get_n_points(); i++)
+            body.points.y[i] += 0.1 * RESTING_DISTANCE * sin(i * 0.1);
+
+        char name[32];
+        snprintf(name, sizeof(name), "%dx%dx%d", size, size, size);
+        printf("%-10s %10d %12d %10.2f", name, body.points.get_n_points(), body.get_n_constraints(),
+            time_sweeps([&] { body.points.constrain(); }));
+        ColoredSolver solver;
+        for (int n_threads : pool_sizes) {
+            get_thread_pool().set_n_threads(n_threads);
+            printf(" %14.2f", time_sweeps([&] { solver.constrain(&body.points, 1); }));
+            printf(" %16.2f", time_sweeps([&] { body.constrain(1); }));
+        }
+        printf("\n");
+        get_thread_pool().set_n_threads(n_cores);
+    }
+    return 0;
+}
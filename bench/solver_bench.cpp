@@ -0,0 +1,227 @@
+/**
+ * Benchmark of the small steps solver and of the tethers against the
+ * default verlet scheme.
+ *
+ * The cloth is let hang in the wind and its stretch (how far the constraints
+ * are from their resting distance) is measured: the stiffer the solve, the
+ * lower the stretch. The default scheme runs N_PHYSICS_UPDATE steps per
+ * frame with N_CONSTRAIN_SOLVE constraint sweeps each, and is also run with
+ * the grid specialized (plain and tiled) constraint sweeps, and with tethers
+ * and fewer sweeps.
+ *
+ * The small steps solver runs many substeps with a single fused sweep each.
+ * Its stiffnesses stand for compliances, which the verlet ones don't, so both
+ * schemes are compared on a material they simulate alike: inextensible
+ * structural constraints (stiffness 1, zero compliance) and no shear or
+ * bending ones. For each budget of a verlet scheme with fewer or more sweeps,
+ * the number of substeps is calibrated so that both take the same wall-clock
+ * time per frame, and the stretch each reaches is reported.
+ *
+ * Last, the constraint sweeps of the tiled solver are timed against the plain
+ * grid ones on the default flag and on larger grids, split in many tiles,
+ * with pools of 1, 2 and as many threads as cores.
+ *
+ * Build and run with `make solver_bench && ./solver_bench`
+ */
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <thread>
+#include <vector>
+
+#include "../physics.h"
+
+float Camera::fovy = 45.0f;
+bool Camera::is_cursor_in_window = false;
+
+const int ROWS = 30;
+const int COLS = 40;
+const int N_PHYSICS_UPDATE = 3;
+const int N_CONSTRAIN_SOLVE = 10;
+const double SECONDSPERFRAME = 1.0 / 60;
+const int N_SETTLE_FRAMES = 300;  // Frames before measuring, the cloth starts flat
+const int N_MEASURE_FRAMES = 300;
+
+// Builds the same flag as main() with rows * cols points, hanging from its top row
+void build_flag(Cloth* cloth, int rows=ROWS, int cols=COLS) {
+    for (int i = 0; i < rows; i++)
+        for (int j = 0; j < cols; j++) {
+            int k = cloth->add_point((j - (cols - 1) / 2.0) * RESTING_DISTANCE, i * -RESTING_DISTANCE + 160, 0, false);
+            if (i > 0)
+                cloth->add_constraint(k, to1d_index(i - 1, j, cols));
+            if (j > 0)
+                cloth->add_constraint(k, to1d_index(i, j - 1, cols));
+        }
+    for (int i = 1; i < rows; i++)
+        for (int j = 0; j < cols; j++) {
+            int k = to1d_index(i, j, cols);
+            if (j > 0)
+                cloth->add_constraint(k, to1d_index(i - 1, j - 1, cols), SHEAR, RESTING_DISTANCE * M_SQRT2);
+            if (j < cols - 1)
+                cloth->add_constraint(k, to1d_index(i - 1, j + 1, cols), SHEAR, RESTING_DISTANCE * M_SQRT2);
+        }
+    for (int i = 0; i < rows; i++)
+        for (int j = 0; j < cols; j++) {
+            int k = to1d_index(i, j, cols);
+            if (i > 1)
+                cloth->add_constraint(k, to1d_index(i - 2, j, cols), BENDING, RESTING_DISTANCE * 2);
+            if (j > 1)
+                cloth->add_constraint(k, to1d_index(i, j - 2, cols), BENDING, RESTING_DISTANCE * 2);
+        }
+    for (int j = 0; j < cols; j++)
+        cloth->fix_position(j);
+}
+
+// Returns the mean and the maximum relative stretch of the structural constraints
+void measure_stretch(const Cloth& cloth, double* mean, double* maximum) {
+    *mean = *maximum = 0;
+    const int n_structural = cloth.constraint_start[STRUCTURAL + 1];
+    for (int c = 0; c < n_structural; c++) {
+        Vec3d d = cloth.get_pos(cloth.constraint_a[c]) - cloth.get_pos(cloth.constraint_b[c]);
+        double stretch = max(0, d.magnitude() / cloth.constraint_rest[c] - 1);
+        *mean += stretch;
+        *maximum = max(*maximum, stretch);
+    }
+    *mean /= n_structural;
+}
+
+struct Result {
+    double ms_per_frame;
+    double mean_stretch;
+    double max_stretch;
+};
+
+typedef std::function<void(Cloth*, ForceField*, Tethers*, float)> Frame;
+
+// Stiffnesses of the default material, and of the inextensible one the small steps are compared on
+const float DEFAULT_STIFFNESS[N_CONSTRAINT_TYPES] = { STIFFNESS, SHEAR_STIFFNESS, BENDING_STIFFNESS, STIFFNESS, SHEAR_STIFFNESS };
+const float INEXTENSIBLE_STIFFNESS[N_CONSTRAINT_TYPES] = { 1, 0, 0, 1, 0 };
+
+// Simulates the flag with the given per frame update, returns its cost and stretch
+Result run(const Frame& frame, bool use_tethers, const float* stiffness) {
+    srand(1);
+    Cloth cloth;
+    build_flag(&cloth);
+    std::copy_n(stiffness, N_CONSTRAINT_TYPES, cloth.stiffness);
+    ForceField forces;
+    forces.add_gravity(Vec3d{ 0, -10, 0 });
+    forces.add_wind(1, 1);
+    Tethers tethers;
+    tethers.enabled = use_tethers;
+
+    float time = 0;
+    for (int f = 0; f < N_SETTLE_FRAMES; f++, time += SECONDSPERFRAME)
+        frame(&cloth, &forces, &tethers, time);
+
+    Result result{ 0, 0, 0 };
+    double elapsed = 0;
+    for (int f = 0; f < N_MEASURE_FRAMES; f++, time += SECONDSPERFRAME) {
+        auto start = std::chrono::steady_clock::now();
+        frame(&cloth, &forces, &tethers, time);
+        elapsed += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+        double mean, maximum;
+        measure_stretch(cloth, &mean, &maximum);
+        result.mean_stretch += mean / N_MEASURE_FRAMES;
+        result.max_stretch = max(result.max_stretch, maximum);
+    }
+    result.ms_per_frame = elapsed / N_MEASURE_FRAMES;
+    return result;
+}
+
+Result run_verlet(int iterations, bool use_tethers=false, SolverMode mode=SOLVER_VERLET,
+                  const float* stiffness=DEFAULT_STIFFNESS) {
+    return run([=](Cloth* cloth, ForceField* forces, Tethers* tethers, float time) {
+        for (int i = 0; i < N_PHYSICS_UPDATE; i++)
+            simulate(cloth, forces, tethers, nullptr, nullptr, nullptr, mode, COLS, iterations,
+                SECONDSPERFRAME / N_PHYSICS_UPDATE, time);
+    }, use_tethers, stiffness);
+}
+
+// A single step per frame, split in n_substeps
+Result run_substeps(int n_substeps, const float* stiffness) {
+    return run([=](Cloth* cloth, ForceField* forces, Tethers* tethers, float time) {
+        simulate(cloth, forces, tethers, nullptr, nullptr, nullptr, SOLVER_SUBSTEP, COLS, n_substeps, SECONDSPERFRAME, time);
+    }, false, stiffness);
+}
+
+void print_result(const char* name, const Result& result) {
+    printf("%-28s %8.3f ms/frame  stretch mean %.4f%%  max %.4f%%\n",
+        name, result.ms_per_frame, 100 * result.mean_stretch, 100 * result.max_stretch);
+}
+
+int main() {
+    printf("%dx%d flag, %d frames\n", COLS, ROWS, N_MEASURE_FRAMES);
+    char name[64];
+    snprintf(name, sizeof(name), "verlet %dx%d", N_PHYSICS_UPDATE, N_CONSTRAIN_SOLVE);
+    print_result(name, run_verlet(N_CONSTRAIN_SOLVE));
+    snprintf(name, sizeof(name), "grid %dx%d", N_PHYSICS_UPDATE, N_CONSTRAIN_SOLVE);
+    print_result(name, run_verlet(N_CONSTRAIN_SOLVE, false, SOLVER_GRID));
+    snprintf(name, sizeof(name), "tiled %dx%d", N_PHYSICS_UPDATE, N_CONSTRAIN_SOLVE);
+    print_result(name, run_verlet(N_CONSTRAIN_SOLVE, false, SOLVER_TILED));
+    for (int iterations : { N_CONSTRAIN_SOLVE, 3, 1 }) {
+        snprintf(name, sizeof(name), "verlet %dx%d + tethers", N_PHYSICS_UPDATE, iterations);
+        print_result(name, run_verlet(iterations, true));
+    }
+
+    printf("\ninextensible structural constraints, same cost per frame\n");
+    // The cost of a substep, from a first run with as many substeps as the default sweeps
+    const int n_sweeps = N_PHYSICS_UPDATE * N_CONSTRAIN_SOLVE;
+    const double substep_ms = run_substeps(n_sweeps, INEXTENSIBLE_STIFFNESS).ms_per_frame / n_sweeps;
+    for (int iterations : { 2, 5, N_CONSTRAIN_SOLVE, 2 * N_CONSTRAIN_SOLVE }) {
+        Result verlet = run_verlet(iterations, false, SOLVER_VERLET, INEXTENSIBLE_STIFFNESS);
+        snprintf(name, sizeof(name), "verlet %dx%d", N_PHYSICS_UPDATE, iterations);
+        print_result(name, verlet);
+        // Correcting the estimate once with the measured cost
+        int n_substeps = max(1, verlet.ms_per_frame / substep_ms);
+        Result small_steps = run_substeps(n_substeps, INEXTENSIBLE_STIFFNESS);
+        n_substeps = max(1, n_substeps * verlet.ms_per_frame / small_steps.ms_per_frame);
+        small_steps = run_substeps(n_substeps, INEXTENSIBLE_STIFFNESS);
+        snprintf(name, sizeof(name), "small steps %d", n_substeps);
+        print_result(name, small_steps);
+    }
+
+    // Sizes of the pool the tiled sweeps are timed with
+    const int n_cores = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<int> pool_sizes = { 1 };
+    for (int n_threads : { 2, n_cores })
+        if (n_threads > pool_sizes.back())
+            pool_sizes.push_back(n_threads);
+    printf("\n%d cores, ms per %d sweeps, grid ones and tiled ones with T threads (tiles)\n", n_cores, N_CONSTRAIN_SOLVE);
+    for (int size : { 0, 200, 400, 800 }) {
+        const int rows = size ? size : ROWS, cols = size ? size : COLS;
+        Cloth cloth;
+        build_flag(&cloth, rows, cols);
+        // Moving the points off their resting positions, so that every projection does some work
+        for (int i = 0; i < cloth.get_n_points(); i++)
+            cloth.y[i] += 0.1 * RESTING_DISTANCE * sin(i * 0.1);
+        const GridView<double> grid = get_grid_view(&cloth, cols);
+        // The best of 3 runs after a first untimed one
+        auto time_sweeps = [&](const std::function<void()>& sweeps) {
+            sweeps();
+            double best = INFINITY;
+            for (int run = 0; run < 3; run++) {
+                auto start = std::chrono::steady_clock::now();
+                sweeps();
+                best = min(best, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+            }
+            return best;
+        };
+        snprintf(name, sizeof(name), "%dx%d", cols, rows);
+        printf("%-10s grid %9.3f", name, time_sweeps([&]() {
+            for (int i = 0; i < N_CONSTRAIN_SOLVE; i++)
+                ClothGridSolver::constrain(grid, cloth.stiffness);
+        }));
+        for (int n_threads : pool_sizes) {
+            get_thread_pool().set_n_threads(n_threads);
+            TiledGridSolver tiled;
+            const double ms = time_sweeps([&]() {
+                tiled.constrain(&cloth, cols, N_CONSTRAIN_SOLVE);
+            });
+            printf("  T=%d %9.3f (%d)", n_threads, ms, tiled.get_n_tiles());
+        }
+        printf("\n");
+    }
+
+    return 0;
+}
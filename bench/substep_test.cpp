@@ -0,0 +1,74 @@
+/**
+ * Test of the small steps solver: the stretch of a hanging flag must not
+ * depend on how many substeps each frame is split in.
+ *
+ * The flag hangs under gravity from its top row, simulated with a growing
+ * number of substeps per frame. Once settled, the mean relative stretch of
+ * its structural constraints is measured for each, and the test fails if any
+ * of them is off the one of the most substeps by more than
+ * MAX_STRETCH_DIFFERENCE.
+ *
+ * Build and run with `make substep_test && ./substep_test`
+ */
+#include <cmath>
+#include <cstdio>
+
+#include "../physics.h"
+
+float Camera::fovy = 45.0f;
+bool Camera::is_cursor_in_window = false;
+
+const int ROWS = 30;
+const int COLS = 40;
+const double SECONDSPERFRAME = 1.0 / 60;
+const int N_SETTLE_FRAMES = 300;
+const int N_MEASURE_FRAMES = 60;
+const double MAX_STRETCH_DIFFERENCE = 0.1;  // Relative to the stretch with the most substeps
+
+// Returns the mean relative stretch of the structural constraints of the
+// flag, over N_MEASURE_FRAMES after settling, with n_substeps per frame
+double get_stretch(int n_substeps) {
+    Cloth cloth;
+    for (int i = 0; i < ROWS; i++)
+        for (int j = 0; j < COLS; j++) {
+            int k = cloth.add_point(j * RESTING_DISTANCE, -i * RESTING_DISTANCE, 0, i == 0);
+            if (i > 0)
+                cloth.add_constraint(k, to1d_index(i - 1, j, COLS));
+            if (j > 0)
+                cloth.add_constraint(k, to1d_index(i, j - 1, COLS));
+        }
+    ForceField forces;
+    forces.add_gravity(Vec3d{ 0, -10, 0 });
+
+    double stretch = 0;
+    float time = 0;
+    for (int f = 0; f < N_SETTLE_FRAMES + N_MEASURE_FRAMES; f++, time += SECONDSPERFRAME) {
+        simulate(&cloth, &forces, nullptr, nullptr, nullptr, nullptr, SOLVER_SUBSTEP, COLS, n_substeps,
+            SECONDSPERFRAME, time);
+        if (f < N_SETTLE_FRAMES)
+            continue;
+        const int n_structural = cloth.constraint_start[STRUCTURAL + 1];
+        for (int c = 0; c < n_structural; c++) {
+            Vec3d d = cloth.get_pos(cloth.constraint_a[c]) - cloth.get_pos(cloth.constraint_b[c]);
+            stretch += max(0, d.magnitude() / cloth.constraint_rest[c] - 1) / n_structural / N_MEASURE_FRAMES;
+        }
+    }
+    return stretch;
+}
+
+int main() {
+    const int N_SUBSTEPS[] = { 15, 30, 60, 120 };
+    const int n_runs = sizeof(N_SUBSTEPS) / sizeof(N_SUBSTEPS[0]);
+    double stretch[n_runs];
+    for (int r = 0; r < n_runs; r++) {
+        stretch[r] = get_stretch(N_SUBSTEPS[r]);
+        printf("%4d substeps  stretch mean %.4f%%\n", N_SUBSTEPS[r], 100 * stretch[r]);
+    }
+
+    const double reference = stretch[n_runs - 1];
+    bool passed = true;
+    for (int r = 0; r < n_runs - 1; r++)
+        passed &= fabs(stretch[r] - reference) <= MAX_STRETCH_DIFFERENCE * reference;
+    printf("%s\n", passed ? "PASSED" : "FAILED: the stretch depends on the number of substeps");
+    return passed ? 0 : 1;
+}
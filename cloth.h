@@ -0,0 +1,360 @@
+#pragma once
+
+#include <algorithm>
+#include <vector>
+
+#include "parallel.h"
+#include "utils.h"
+
+const float DAMPING = .03;
+const float RESTING_DISTANCE = 12;
+const float STIFFNESS = 0.8; // from 0 to 1
+const float SHEAR_STIFFNESS = 0.5;
+const float BENDING_STIFFNESS = 0.1;
+const double MASS = 3.5;
+
+// Kinds of distance constraints, each solved with its own stiffness
+enum ConstraintType {
+    STRUCTURAL,  // Between neighbouring points, only resists stretching
+    SHEAR,       // Between diagonal neighbours, only resists stretching
+    BENDING,     // Between points two apart, resists both stretching and compression
+    SOLID,       // Along the edges of a volumetric lattice, resists both stretching and compression
+    SOLID_SHEAR, // Along the face diagonals of a volumetric lattice, resists both stretching and compression
+    N_CONSTRAINT_TYPES
+};
+
+// Returns wether the constraints of the given type only act when stretched
+constexpr bool is_tension_only(int type) {
+    return type == STRUCTURAL || type == SHEAR;
+}
+
+// Point masses of a cloth and the distance constraints linking them.
+// Every quantity is stored in its own contiguous array (structure of arrays)
+// so that the physics kernels stream over memory and vectorize.
+struct Cloth {
+    // Point positions
+    std::vector<double> x, y, z;
+    // Point positions at the previous timestep
+    std::vector<double> old_x, old_y, old_z;
+    // 1 for free points, 0 for pinned ones (all the free points share MASS)
+    std::vector<double> inv_mass;
+    // Per point external forces, filled by a ForceField and applied by integrate()
+    std::vector<double> force_x, force_y, force_z;
+    // Indices of the two points linked by each distance constraint and their resting distance.
+    // Constraints are stored by type, in contiguous homogeneous batches:
+    // the ones of type t are in [constraint_start[t], constraint_start[t + 1])
+    std::vector<int> constraint_a, constraint_b;
+    std::vector<double> constraint_rest;
+    int constraint_start[N_CONSTRAINT_TYPES + 1]{};
+    // Indices of the three points of each triangle of the cloth surface, counterclockwise
+    std::vector<int> triangles;
+    // Stiffness of each constraint type, from 0 to 1
+    float stiffness[N_CONSTRAINT_TYPES] = { STIFFNESS, SHEAR_STIFFNESS, BENDING_STIFFNESS, STIFFNESS, SHEAR_STIFFNESS };
+    // Incremented whenever the constraints or the triangles change, so that solvers can rebuild their data
+    int topology_version = 0;
+    // Incremented whenever a point is pinned or unpinned
+    int pin_version = 0;
+    // Set once constraints were removed or points split, the cloth then no longer matches a grid
+    bool torn = false;
+    // Current index of each point, in the order they were added.
+    // Empty until the points are reordered by permute()
+    std::vector<int> order;
+
+    // Adds a point to the cloth, returns its index
+    int add_point(double x, double y, double z, bool fixed) {
+        this->x.push_back(x);
+        this->y.push_back(y);
+        this->z.push_back(z);
+        old_x.push_back(x);
+        old_y.push_back(y);
+        old_z.push_back(z);
+        inv_mass.push_back(fixed ? 0 : 1);
+        force_x.push_back(0);
+        force_y.push_back(0);
+        force_z.push_back(0);
+        return get_n_points() - 1;
+    }
+    // Links two points with a distance constraint. Adding the constraints
+    // grouped by type in the ConstraintType order only appends to the arrays.
+    void add_constraint(int a, int b, ConstraintType type=STRUCTURAL, double rest=RESTING_DISTANCE) {
+        int c = constraint_start[type + 1];
+        constraint_a.insert(constraint_a.begin() + c, a);
+        constraint_b.insert(constraint_b.begin() + c, b);
+        constraint_rest.insert(constraint_rest.begin() + c, rest);
+        for (int t = type + 1; t <= N_CONSTRAINT_TYPES; t++)
+            constraint_start[t]++;
+        topology_version++;
+    }
+    // Removes constraint c. The hole is filled with the last constraint of its batch, and the one
+    // this leaves with the last constraint of the next batch and so on, so that removing takes
+    // one move per type. moved(from, to) is called for each constraint moved.
+    template <typename Moved>
+    void remove_constraint(int c, Moved moved) {
+        int type = get_constraint_type(c);
+        for (int t = type; t < N_CONSTRAINT_TYPES; t++) {
+            int last = constraint_start[t + 1] - 1;
+            if (last != c) {
+                constraint_a[c] = constraint_a[last];
+                constraint_b[c] = constraint_b[last];
+                constraint_rest[c] = constraint_rest[last];
+                moved(last, c);
+            }
+            // The hole is now the first slot of the next batch
+            constraint_start[t + 1]--;
+            c = last;
+        }
+        constraint_a.pop_back();
+        constraint_b.pop_back();
+        constraint_rest.pop_back();
+        topology_version++;
+        torn = true;
+    }
+    void remove_constraint(int c) {
+        remove_constraint(c, [](int, int) {});
+    }
+    // Adds a triangle of the cloth surface
+    void add_triangle(int a, int b, int c) {
+        triangles.insert(triangles.end(), { a, b, c });
+        topology_version++;
+    }
+    // Adds a copy of point i, linked to nothing, returns its index
+    int split_point(int i) {
+        int k = add_point(x[i], y[i], z[i], inv_mass[i] == 0);
+        old_x[k] = old_x[i];
+        old_y[k] = old_y[i];
+        old_z[k] = old_z[i];
+        if (!order.empty())
+            order.push_back(k);
+        torn = true;
+        return k;
+    }
+    // Reserves room for n points, so that adding them doesn't reallocate the arrays
+    void reserve_points(int n) {
+        for (std::vector<double>* array : { &x, &y, &z, &old_x, &old_y, &old_z,
+                                            &inv_mass, &force_x, &force_y, &force_z })
+            array->reserve(n);
+        if (!order.empty())
+            order.reserve(n);
+    }
+    // Returns the number of points
+    int get_n_points() const {
+        return (int)x.size();
+    }
+    // Returns the number of distance constraints
+    int get_n_constraints() const {
+        return (int)constraint_a.size();
+    }
+    // Returns the number of triangles
+    int get_n_triangles() const {
+        return (int)triangles.size() / 3;
+    }
+    // Returns the current index of the k-th added point
+    int find_point(int k) const {
+        return order.empty() ? k : order[k];
+    }
+    // Returns wether the points are still in the order they were added
+    bool is_in_added_order() const {
+        return order.empty();
+    }
+    // Moves the points to new indices, new_index[i] being the new index of
+    // point i, and updates the constraints and triangles. The constraints of each type are
+    // sorted by their points so that sweeps follow the new order too.
+    void permute(const std::vector<int>& new_index) {
+        const int n = get_n_points();
+        // One task per array
+        const std::vector<std::vector<double>*> arrays = { &x, &y, &z, &old_x, &old_y, &old_z,
+                                                           &inv_mass, &force_x, &force_y, &force_z };
+        get_thread_pool().run(arrays.size(), [&](int k) {
+            std::vector<double> permuted(n);
+            for (int i = 0; i < n; i++)
+                permuted[new_index[i]] = (*arrays[k])[i];
+            arrays[k]->swap(permuted);
+        });
+
+        if (order.empty())
+            order = new_index;
+        else
+            parallel_for(order.size(), [&](int begin, int end) {
+                for (int k = begin; k < end; k++)
+                    order[k] = new_index[order[k]];
+            });
+
+        // Constraints of each type sorted by their lowest point, with a (stable) counting sort per task
+        std::vector<int> a(constraint_a.size()), b(constraint_b.size());
+        std::vector<double> rest(constraint_rest);
+        parallel_for(get_n_constraints(), [&](int begin, int end) {
+            for (int c = begin; c < end; c++) {
+                a[c] = new_index[constraint_a[c]];
+                b[c] = new_index[constraint_b[c]];
+            }
+        });
+        get_thread_pool().run(N_CONSTRAINT_TYPES, [&](int type) {
+            if (constraint_start[type] == constraint_start[type + 1])
+                return;
+            std::vector<int> slot(n + 1, 0);
+            for (int c = constraint_start[type]; c < constraint_start[type + 1]; c++)
+                slot[std::min(a[c], b[c]) + 1]++;
+            slot[0] = constraint_start[type];
+            for (int i = 0; i < n; i++)
+                slot[i + 1] += slot[i];
+            for (int c = constraint_start[type]; c < constraint_start[type + 1]; c++) {
+                int k = slot[std::min(a[c], b[c])]++;
+                constraint_a[k] = a[c];
+                constraint_b[k] = b[c];
+                constraint_rest[k] = rest[c];
+            }
+        });
+        parallel_for(triangles.size(), [&](int begin, int end) {
+            for (int k = begin; k < end; k++)
+                triangles[k] = new_index[triangles[k]];
+        });
+        topology_version++;
+        pin_version++;
+    }
+    // Returns the type of a constraint
+    ConstraintType get_constraint_type(int c) const {
+        int type = STRUCTURAL;
+        while (c >= constraint_start[type + 1])
+            type++;
+        return (ConstraintType)type;
+    }
+    // Returns point pos
+    Vec3d get_pos(int i) const {
+        return Vec3d{ x[i], y[i], z[i] };
+    }
+    // Returns the x position coordinate casted to float
+    float get_pos_x(int i) const {
+        return (float)x[i];
+    }
+    // Returns the y position coordinate casted to float
+    float get_pos_y(int i) const {
+        return (float)y[i];
+    }
+    // Returns the z position coordinate casted to float
+    float get_pos_z(int i) const {
+        return (float)z[i];
+    }
+    // Returns wether the point is pinned
+    bool is_fixed(int i) const {
+        return inv_mass[i] == 0;
+    }
+    // Fix the point on its current position
+    void fix_position(int i) {
+        if (inv_mass[i] != 0)
+            pin_version++;
+        inv_mass[i] = 0;
+    }
+    // Unfix the point
+    void unfix_position(int i) {
+        if (inv_mass[i] != 1)
+            pin_version++;
+        inv_mass[i] = 1;
+    }
+    // Fixes or unfixes all the given points at once, as a single change of the pinned points
+    void set_fixed(const std::vector<int>& points, bool fixed) {
+        const double mass = fixed ? 0 : 1;
+        bool changed = false;
+        for (int i : points) {
+            changed |= inv_mass[i] != mass;
+            inv_mass[i] = mass;
+        }
+        if (changed)
+            pin_version++;
+    }
+    // Moves the point to the given pos
+    void drag_to(int i, Vec3d pos) {
+        x[i] = old_x[i] = pos.get_x();
+        y[i] = old_y[i] = pos.get_y();
+        z[i] = old_z[i] = pos.get_z();
+    }
+    // Moves the two points of a constraint towards its resting distance
+    void project(int c, double stiffness, bool tension_only) {
+        int a = constraint_a[c];
+        int b = constraint_b[c];
+        double dx = x[a] - x[b];
+        double dy = y[a] - y[b];
+        double dz = z[a] - z[b];
+        double d = sqrt(dx * dx + dy * dy + dz * dz);
+        if (d <= 0)
+            d = 0.00001;
+        double target = tension_only ? min(d, constraint_rest[c]) : constraint_rest[c];
+        double difference = (target - d) / d;
+        double translate = 0.5 * stiffness * difference;
+        x[a] += dx * translate * inv_mass[a];
+        y[a] += dy * translate * inv_mass[a];
+        z[a] += dz * translate * inv_mass[a];
+        x[b] -= dx * translate * inv_mass[b];
+        y[b] -= dy * translate * inv_mass[b];
+        z[b] -= dz * translate * inv_mass[b];
+    }
+    // Handles constrain solving, a Gauss-Seidel sweep over all the constraints,
+    // one homogeneous batch after the other
+    void constrain() {
+        for (int type = 0; type < N_CONSTRAINT_TYPES; type++) {
+            double k = stiffness[type];
+            bool tension_only = is_tension_only(type);
+            for (int c = constraint_start[type]; c < constraint_start[type + 1]; c++)
+                project(c, k, tension_only);
+        }
+    }
+    // Applies the external forces and updates the point positions using
+    // verlet integration, in a single pass over the arrays.
+    // Pinned points are masked out by their zero inverse mass.
+    void integrate(double dt) {
+        const int n = get_n_points();
+        double* __restrict px = x.data();
+        double* __restrict py = y.data();
+        double* __restrict pz = z.data();
+        double* __restrict ox = old_x.data();
+        double* __restrict oy = old_y.data();
+        double* __restrict oz = old_z.data();
+        const double* __restrict w = inv_mass.data();
+        const double* __restrict fx = force_x.data();
+        const double* __restrict fy = force_y.data();
+        const double* __restrict fz = force_z.data();
+
+#pragma omp simd
+        for (int i = 0; i < n; i++) {
+            double vx = px[i] - ox[i];
+            double vy = py[i] - oy[i];
+            double vz = pz[i] - oz[i];
+            ox[i] = px[i];
+            oy[i] = py[i];
+            oz[i] = pz[i];
+            px[i] += (vx * (1 - DAMPING) + fx[i] * dt) * w[i];
+            py[i] += (vy * (1 - DAMPING) + fy[i] * dt) * w[i];
+            pz[i] += (vz * (1 - DAMPING) + fz[i] * dt) * w[i];
+        }
+    }
+};
+
+// For each point of a cloth, the constraints attached to it and the points
+// at their other end, stored contiguously (compressed sparse rows)
+struct Adjacency {
+    std::vector<int> row_start, row_constraint, row_other;
+
+    // Rebuilds the lists from the cloth constraints with a counting sort
+    void build(const Cloth* cloth) {
+        const int n = cloth->get_n_points();
+        const int m = cloth->get_n_constraints();
+        row_start.assign(n + 1, 0);
+        for (int c = 0; c < m; c++) {
+            row_start[cloth->constraint_a[c] + 1]++;
+            row_start[cloth->constraint_b[c] + 1]++;
+        }
+        for (int i = 0; i < n; i++)
+            row_start[i + 1] += row_start[i];
+
+        std::vector<int> fill(row_start.begin(), row_start.end() - 1);
+        row_constraint.resize(2 * m);
+        row_other.resize(2 * m);
+        for (int c = 0; c < m; c++) {
+            int a = cloth->constraint_a[c];
+            int b = cloth->constraint_b[c];
+            row_constraint[fill[a]] = c;
+            row_other[fill[a]++] = b;
+            row_constraint[fill[b]] = c;
+            row_other[fill[b]++] = a;
+        }
+    }
+};
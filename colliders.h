@@ -0,0 +1,503 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "cloth.h"
+#include "sdf.h"
+
+const float COLLISION_MARGIN = 2;       // Distance kept between the points and the colliders surface
+const float COLLISION_PADDING = 10;     // Culling boxes extra size, covering how far points move between two culls
+const float COLLISION_FAST_MOTION = 4;  // Motion in a step beyond which points are swept against the colliders
+const float COLLISION_SWEEP_RADIUS = 1; // Radius of the spheres swept along the motion of the fast points
+const int COLLISION_SWEEP_STEPS = 16;   // Sphere tracing steps of a sweep, grazing motions taking more are let through
+
+struct SphereCollider {
+    Vec3d center;
+    float radius;
+    bool enabled = true;
+};
+
+// The points closer than radius to the segment from a to b
+struct CapsuleCollider {
+    Vec3d a, b;
+    float radius;
+    bool enabled = true;
+};
+
+// Axis aligned box
+struct BoxCollider {
+    Vec3d center;
+    Vec3d half_size;
+    bool enabled = true;
+};
+
+// Half space of the points p with dot(normal, p) < offset
+struct PlaneCollider {
+    Vec3d normal; // Normalized, pointing out of the collider
+    float offset;
+    bool enabled = true;
+};
+
+// Static triangle mesh, through its signed distance field
+struct MeshCollider {
+    const MeshSDF* sdf;
+    Vec3d position; // Where the origin of the mesh is placed
+    bool enabled = true;
+};
+
+// Static colliders the cloth points are kept out of. Collisions are
+// solved as projections, like the distance constraints, and points in
+// contact lose part of their tangential motion (friction).
+// Each collider only processes the points inside its bounding box, which
+// are gathered by cull() once per step, so the cost of a collider depends
+// on how many points are near it and not on the size of the cloth.
+// Points moving fast enough to jump over a thin collider within a step are
+// caught by sweep(), which traces their motion through the colliders.
+struct Colliders {
+    std::vector<SphereCollider> spheres;
+    std::vector<CapsuleCollider> capsules;
+    std::vector<BoxCollider> boxes;
+    std::vector<PlaneCollider> planes;
+    std::vector<MeshCollider> meshes;
+    float friction = 0.3f; // Fraction of the tangential motion removed by a contact, from 0 to 1
+
+    // Registering colliders, the returned index allows to move them later on
+    int add_sphere(Vec3d center, float radius) {
+        spheres.push_back(SphereCollider{ center, radius });
+        return spheres.size() - 1;
+    }
+    int add_capsule(Vec3d a, Vec3d b, float radius) {
+        capsules.push_back(CapsuleCollider{ a, b, radius });
+        return capsules.size() - 1;
+    }
+    int add_box(Vec3d center, Vec3d half_size) {
+        boxes.push_back(BoxCollider{ center, half_size });
+        return boxes.size() - 1;
+    }
+    int add_plane(Vec3d normal, float offset) {
+        planes.push_back(PlaneCollider{ normal / normal.magnitude(), offset });
+        return planes.size() - 1;
+    }
+    // The field must outlive the collider
+    int add_mesh(const MeshSDF* sdf, Vec3d position) {
+        meshes.push_back(MeshCollider{ sdf, position });
+        return meshes.size() - 1;
+    }
+
+    // Takes the colliders of another set, keeping the collision state of this one,
+    // so that bodies other than the cloth can collide with the same colliders
+    void copy_colliders(const Colliders& other) {
+        spheres = other.spheres;
+        capsules = other.capsules;
+        boxes = other.boxes;
+        planes = other.planes;
+        meshes = other.meshes;
+        friction = other.friction;
+    }
+
+    int get_n_colliders() const {
+        return spheres.size() + capsules.size() + boxes.size() + planes.size() + meshes.size();
+    }
+
+    // Gathers the points near each collider
+    void cull(const Cloth* cloth) {
+        const double reach = COLLISION_MARGIN + COLLISION_PADDING;
+        near_spheres.resize(spheres.size());
+        near_capsules.resize(capsules.size());
+        near_boxes.resize(boxes.size());
+        near_planes.resize(planes.size());
+        near_meshes.resize(meshes.size());
+
+        collect_boxes();
+        int c = 0;
+        for (size_t s = 0; s < spheres.size(); s++)
+            gather_box(cloth, collider_boxes[c++], reach, near_spheres[s]);
+        for (size_t k = 0; k < capsules.size(); k++)
+            gather_box(cloth, collider_boxes[c++], reach, near_capsules[k]);
+        for (size_t b = 0; b < boxes.size(); b++)
+            gather_box(cloth, collider_boxes[c++], reach, near_boxes[b]);
+        for (size_t p = 0; p < planes.size(); p++) {
+            const PlaneCollider& plane = planes[p];
+            near_planes[p].clear();
+            for (int i = 0; i < cloth->get_n_points(); i++)
+                if (plane.normal.get_x() * cloth->x[i] + plane.normal.get_y() * cloth->y[i] +
+                    plane.normal.get_z() * cloth->z[i] < plane.offset + reach)
+                    near_planes[p].push_back(i);
+        }
+        c += planes.size();
+        for (size_t m = 0; m < meshes.size(); m++)
+            gather_box(cloth, collider_boxes[c++], reach, near_meshes[m]);
+    }
+
+    // Moves the culled points out of the colliders, applying friction to
+    // their motion since the last step if requested
+    void project(Cloth* cloth, bool apply_friction) {
+        const double mu = apply_friction ? friction : 0;
+        // Colliders added since the last cull
+        if (near_spheres.size() != spheres.size() || near_capsules.size() != capsules.size() ||
+            near_boxes.size() != boxes.size() || near_planes.size() != planes.size() || near_meshes.size() != meshes.size())
+            cull(cloth);
+
+        visit_colliders([&](int, const std::vector<int>& near, auto distance) {
+            project_points(cloth, near, mu, distance);
+        });
+    }
+
+    // Stops the points that moved fast since the last sweep where their motion
+    // first meets a collider, so that they can't go through thin colliders
+    // within a step. The fast points are paired with the colliders by sweep
+    // and prune, and only these pairs are traced.
+    void sweep(Cloth* cloth) {
+        const int n = cloth->get_n_points();
+        if ((int)start_x.size() != n || start_version != cloth->topology_version) {
+            save_positions(cloth);
+            return;
+        }
+
+        fast_points.clear();
+        for (int i = 0; i < n; i++) {
+            double dx = cloth->x[i] - start_x[i];
+            double dy = cloth->y[i] - start_y[i];
+            double dz = cloth->z[i] - start_z[i];
+            if (dx * dx + dy * dy + dz * dz > COLLISION_FAST_MOTION * COLLISION_FAST_MOTION)
+                fast_points.push_back(i);
+        }
+        if (!fast_points.empty()) {
+            collect_boxes();
+            sweep_and_prune(cloth);
+            visit_colliders([&](int c, const std::vector<int>&, auto distance) {
+                sweep_points(cloth, swept[c], distance);
+            });
+        }
+        save_positions(cloth);
+    }
+
+    private:
+        // Points inside the bounding box of each collider
+        std::vector<std::vector<int>> near_spheres, near_capsules, near_boxes, near_planes, near_meshes;
+
+        struct Box {
+            double low[3], high[3];
+        };
+        // Bounding boxes of the colliders, planes are unbounded
+        std::vector<Box> collider_boxes;
+        // Positions at the end of the last sweep, where the motions swept start from
+        std::vector<double> start_x, start_y, start_z;
+        int start_version = -1;
+        // Points that moved farther than COLLISION_FAST_MOTION, their motion boxes,
+        // and the fast points whose motion box overlaps the box of each collider
+        std::vector<int> fast_points;
+        std::vector<Box> motion_boxes;
+        std::vector<std::vector<int>> swept;
+        // Sweep and prune buffers, reused between steps
+        struct Endpoint {
+            double low;
+            int id; // Collider index, or number of colliders + index in fast_points
+        };
+        std::vector<Endpoint> endpoints;
+        std::vector<int> open_colliders, open_motions;
+
+        void collect_boxes() {
+            collider_boxes.clear();
+            for (SphereCollider& sphere : spheres) {
+                Vec3d extent{ sphere.radius, sphere.radius, sphere.radius };
+                collider_boxes.push_back(make_box(sphere.center - extent, sphere.center + extent));
+            }
+            for (const CapsuleCollider& capsule : capsules) {
+                Vec3d extent{ capsule.radius, capsule.radius, capsule.radius };
+                Vec3d low{ min(capsule.a.get_x(), capsule.b.get_x()),
+                           min(capsule.a.get_y(), capsule.b.get_y()),
+                           min(capsule.a.get_z(), capsule.b.get_z()) };
+                Vec3d high{ max(capsule.a.get_x(), capsule.b.get_x()),
+                            max(capsule.a.get_y(), capsule.b.get_y()),
+                            max(capsule.a.get_z(), capsule.b.get_z()) };
+                collider_boxes.push_back(make_box(low - extent, high + extent));
+            }
+            for (BoxCollider& box : boxes)
+                collider_boxes.push_back(make_box(box.center - box.half_size, box.center + box.half_size));
+            for (size_t p = 0; p < planes.size(); p++)
+                collider_boxes.push_back(Box{ { -INFINITY, -INFINITY, -INFINITY }, { INFINITY, INFINITY, INFINITY } });
+            for (MeshCollider& mesh : meshes)
+                collider_boxes.push_back(make_box(mesh.position + Vec3d(mesh.sdf->get_low()),
+                                                  mesh.position + Vec3d(mesh.sdf->get_high())));
+        }
+
+        static Box make_box(Vec3d low, Vec3d high) {
+            return Box{ { low.get_x(), low.get_y(), low.get_z() }, { high.get_x(), high.get_y(), high.get_z() } };
+        }
+
+        // Whether two boxes overlap along y and z, x being handled by the sweep
+        static inline bool overlap_yz(const Box& a, const Box& b) {
+            return a.low[1] <= b.high[1] && b.low[1] <= a.high[1] &&
+                   a.low[2] <= b.high[2] && b.low[2] <= a.high[2];
+        }
+
+        // Pairs the fast points with the colliders their motion may reach. The boxes
+        // are sorted by their low end along x and visited in order, each one being
+        // tested against the still open boxes of the other kind.
+        void sweep_and_prune(const Cloth* cloth) {
+            const int n_colliders = get_n_colliders();
+            const double reach = COLLISION_SWEEP_RADIUS;
+            motion_boxes.resize(fast_points.size());
+            endpoints.clear();
+            for (int c = 0; c < n_colliders; c++)
+                endpoints.push_back(Endpoint{ collider_boxes[c].low[0], c });
+            for (size_t k = 0; k < fast_points.size(); k++) {
+                const int i = fast_points[k];
+                const double start[3] = { start_x[i], start_y[i], start_z[i] };
+                const double end[3] = { cloth->x[i], cloth->y[i], cloth->z[i] };
+                for (int a = 0; a < 3; a++) {
+                    motion_boxes[k].low[a] = min(start[a], end[a]) - reach;
+                    motion_boxes[k].high[a] = max(start[a], end[a]) + reach;
+                }
+                endpoints.push_back(Endpoint{ motion_boxes[k].low[0], n_colliders + (int)k });
+            }
+            std::sort(endpoints.begin(), endpoints.end(), [](const Endpoint& a, const Endpoint& b) {
+                return a.low < b.low || (a.low == b.low && a.id < b.id);
+            });
+
+            swept.resize(n_colliders);
+            for (std::vector<int>& points : swept)
+                points.clear();
+            open_colliders.clear();
+            open_motions.clear();
+            // Drops the open boxes ending before low
+            auto close = [](std::vector<int>& open, const std::vector<Box>& boxes, double low) {
+                for (size_t o = 0; o < open.size();)
+                    if (boxes[open[o]].high[0] < low) {
+                        open[o] = open.back();
+                        open.pop_back();
+                    } else {
+                        o++;
+                    }
+            };
+            for (const Endpoint& endpoint : endpoints) {
+                if (endpoint.id < n_colliders) {
+                    const int c = endpoint.id;
+                    close(open_motions, motion_boxes, endpoint.low);
+                    for (int k : open_motions)
+                        if (overlap_yz(collider_boxes[c], motion_boxes[k]))
+                            swept[c].push_back(fast_points[k]);
+                    open_colliders.push_back(c);
+                } else {
+                    const int k = endpoint.id - n_colliders;
+                    close(open_colliders, collider_boxes, endpoint.low);
+                    for (int c : open_colliders)
+                        if (overlap_yz(collider_boxes[c], motion_boxes[k]))
+                            swept[c].push_back(fast_points[k]);
+                    open_motions.push_back(k);
+                }
+            }
+        }
+
+        // Traces the motion of the given points from their start positions through
+        // the collider whose signed distance and normal are returned by distance(),
+        // stopping the points where a sphere of COLLISION_SWEEP_RADIUS meets it.
+        // Pinned points stay where they are, like in the projection
+        template <typename Distance>
+        void sweep_points(Cloth* cloth, const std::vector<int>& points, Distance distance) {
+            for (int i : points) {
+                if (cloth->inv_mass[i] == 0)
+                    continue;
+                const double sx = start_x[i], sy = start_y[i], sz = start_z[i];
+                const double mx = cloth->x[i] - sx, my = cloth->y[i] - sy, mz = cloth->z[i] - sz;
+                const double length = sqrt(mx * mx + my * my + mz * mz);
+                double nx, ny, nz;
+                // Points starting inside are left to the projection
+                if (length == 0 || distance(sx, sy, sz, nx, ny, nz) < 0)
+                    continue;
+                // Sphere tracing: nothing is closer to a point than its distance, so the
+                // motion can safely advance by it. Steps aim at half the radius, so the
+                // sphere meets the surface in a few steps instead of only approaching it.
+                double t = 0;
+                for (int step = 0; step < COLLISION_SWEEP_STEPS; step++) {
+                    const double px = sx + mx * t, py = sy + my * t, pz = sz + mz * t;
+                    const double d = distance(px, py, pz, nx, ny, nz);
+                    // Touching the collider and moving into it
+                    if (d < COLLISION_SWEEP_RADIUS && mx * nx + my * ny + mz * nz < 0) {
+                        cloth->x[i] = px;
+                        cloth->y[i] = py;
+                        cloth->z[i] = pz;
+                        // Removing the motion into the collider
+                        double along = (px - cloth->old_x[i]) * nx + (py - cloth->old_y[i]) * ny + (pz - cloth->old_z[i]) * nz;
+                        if (along < 0) {
+                            cloth->old_x[i] += nx * along;
+                            cloth->old_y[i] += ny * along;
+                            cloth->old_z[i] += nz * along;
+                        }
+                        break;
+                    }
+                    t += max(d - 0.5 * COLLISION_SWEEP_RADIUS, 0.5 * COLLISION_SWEEP_RADIUS) / length;
+                    if (t >= 1)
+                        break;
+                }
+            }
+        }
+
+        void save_positions(const Cloth* cloth) {
+            start_x = cloth->x;
+            start_y = cloth->y;
+            start_z = cloth->z;
+            start_version = cloth->topology_version;
+        }
+
+        // Calls visit(c, near, distance) for each enabled collider c, numbered in the order
+        // spheres, capsules, boxes, planes and meshes, with the points near it and the
+        // function distance(px, py, pz, nx, ny, nz) returning the signed distance of a
+        // point from its surface and setting the outward normal
+        template <typename Visit>
+        void visit_colliders(Visit visit) const {
+            int c = 0;
+            for (size_t s = 0; s < spheres.size(); s++, c++) {
+                if (!spheres[s].enabled)
+                    continue;
+                const double cx = spheres[s].center.get_x();
+                const double cy = spheres[s].center.get_y();
+                const double cz = spheres[s].center.get_z();
+                const double r = spheres[s].radius;
+                visit(c, near_spheres[s],
+                    [=](double px, double py, double pz, double& nx, double& ny, double& nz) {
+                        return sphere_distance(px - cx, py - cy, pz - cz, r, nx, ny, nz);
+                    });
+            }
+
+            for (size_t k = 0; k < capsules.size(); k++, c++) {
+                if (!capsules[k].enabled)
+                    continue;
+                const double ax = capsules[k].a.get_x();
+                const double ay = capsules[k].a.get_y();
+                const double az = capsules[k].a.get_z();
+                const double abx = capsules[k].b.get_x() - ax;
+                const double aby = capsules[k].b.get_y() - ay;
+                const double abz = capsules[k].b.get_z() - az;
+                const double inv_length2 = 1 / max(abx * abx + aby * aby + abz * abz, 0.00001);
+                const double r = capsules[k].radius;
+                visit(c, near_capsules[k],
+                    [=](double px, double py, double pz, double& nx, double& ny, double& nz) {
+                        // Closest point of the segment
+                        double t = ((px - ax) * abx + (py - ay) * aby + (pz - az) * abz) * inv_length2;
+                        t = t < 0 ? 0 : t > 1 ? 1 : t;
+                        return sphere_distance(px - ax - t * abx, py - ay - t * aby, pz - az - t * abz, r, nx, ny, nz);
+                    });
+            }
+
+            for (size_t b = 0; b < boxes.size(); b++, c++) {
+                if (!boxes[b].enabled)
+                    continue;
+                const double cx = boxes[b].center.get_x();
+                const double cy = boxes[b].center.get_y();
+                const double cz = boxes[b].center.get_z();
+                const double hx = boxes[b].half_size.get_x();
+                const double hy = boxes[b].half_size.get_y();
+                const double hz = boxes[b].half_size.get_z();
+                visit(c, near_boxes[b],
+                    [=](double px, double py, double pz, double& nx, double& ny, double& nz) {
+                        double dx = px - cx, dy = py - cy, dz = pz - cz;
+                        double sx = dx < 0 ? -1 : 1, sy = dy < 0 ? -1 : 1, sz = dz < 0 ? -1 : 1;
+                        // Distances from the faces, positive outside
+                        double qx = dx * sx - hx, qy = dy * sy - hy, qz = dz * sz - hz;
+                        double ox = qx > 0 ? qx : 0, oy = qy > 0 ? qy : 0, oz = qz > 0 ? qz : 0;
+                        double outside = sqrt(ox * ox + oy * oy + oz * oz);
+                        // Inside, the nearest face is the one of the largest q
+                        bool inside_x = qx >= qy && qx >= qz;
+                        bool inside_y = !inside_x && qy >= qz;
+                        bool inside_z = !inside_x && !inside_y;
+                        double inside = inside_x ? qx : inside_y ? qy : qz;
+                        bool is_outside = outside > 0;
+                        double inv_outside = 1 / (outside + 0.00001);
+                        nx = sx * (is_outside ? ox * inv_outside : inside_x);
+                        ny = sy * (is_outside ? oy * inv_outside : inside_y);
+                        nz = sz * (is_outside ? oz * inv_outside : inside_z);
+                        return is_outside ? outside : inside;
+                    });
+            }
+
+            for (size_t p = 0; p < planes.size(); p++, c++) {
+                if (!planes[p].enabled)
+                    continue;
+                const double ax = planes[p].normal.get_x();
+                const double ay = planes[p].normal.get_y();
+                const double az = planes[p].normal.get_z();
+                const double offset = planes[p].offset;
+                visit(c, near_planes[p],
+                    [=](double px, double py, double pz, double& nx, double& ny, double& nz) {
+                        nx = ax;
+                        ny = ay;
+                        nz = az;
+                        return ax * px + ay * py + az * pz - offset;
+                    });
+            }
+
+            for (size_t m = 0; m < meshes.size(); m++, c++) {
+                if (!meshes[m].enabled)
+                    continue;
+                const MeshSDF* sdf = meshes[m].sdf;
+                const double ox = meshes[m].position.get_x();
+                const double oy = meshes[m].position.get_y();
+                const double oz = meshes[m].position.get_z();
+                visit(c, near_meshes[m],
+                    [=](double px, double py, double pz, double& nx, double& ny, double& nz) {
+                        return sdf->distance(px - ox, py - oy, pz - oz, nx, ny, nz);
+                    });
+            }
+        }
+
+        // Returns the signed distance of (dx, dy, dz) from a sphere centered in the origin, and its normal
+        static inline double sphere_distance(double dx, double dy, double dz, double radius,
+                                             double& nx, double& ny, double& nz) {
+            double d = sqrt(dx * dx + dy * dy + dz * dz) + 0.00001;
+            nx = dx / d;
+            ny = dy / d;
+            nz = dz / d;
+            return d - radius;
+        }
+
+        // Gathers the points inside the box, grown by reach
+        static void gather_box(const Cloth* cloth, const Box& box, double reach, std::vector<int>& points) {
+            const double lx = box.low[0] - reach, ly = box.low[1] - reach, lz = box.low[2] - reach;
+            const double hx = box.high[0] + reach, hy = box.high[1] + reach, hz = box.high[2] + reach;
+            points.clear();
+            for (int i = 0; i < cloth->get_n_points(); i++)
+                if (cloth->x[i] >= lx && cloth->x[i] <= hx &&
+                    cloth->y[i] >= ly && cloth->y[i] <= hy &&
+                    cloth->z[i] >= lz && cloth->z[i] <= hz)
+                    points.push_back(i);
+        }
+
+        // Pushes the given points out of the collider whose signed distance
+        // and normal are returned by distance(), the points are all distinct
+        template <typename Distance>
+        static void project_points(Cloth* cloth, const std::vector<int>& points, double mu, Distance distance) {
+            double* __restrict x = cloth->x.data();
+            double* __restrict y = cloth->y.data();
+            double* __restrict z = cloth->z.data();
+            const double* __restrict old_x = cloth->old_x.data();
+            const double* __restrict old_y = cloth->old_y.data();
+            const double* __restrict old_z = cloth->old_z.data();
+            const double* __restrict w = cloth->inv_mass.data();
+            const int* __restrict indices = points.data();
+            const int n = points.size();
+
+#pragma omp simd
+            for (int k = 0; k < n; k++) {
+                int i = indices[k];
+                double nx, ny, nz;
+                double depth = COLLISION_MARGIN - distance(x[i], y[i], z[i], nx, ny, nz);
+                double contact = w[i] * (depth > 0 ? 1 : 0);
+                x[i] += nx * depth * contact;
+                y[i] += ny * depth * contact;
+                z[i] += nz * depth * contact;
+                // Removing part of the tangential motion
+                double vx = x[i] - old_x[i];
+                double vy = y[i] - old_y[i];
+                double vz = z[i] - old_z[i];
+                double along = vx * nx + vy * ny + vz * nz;
+                double slide = mu * contact;
+                x[i] -= (vx - along * nx) * slide;
+                y[i] -= (vy - along * ny) * slide;
+                z[i] -= (vz - along * nz) * slide;
+            }
+        }
+};
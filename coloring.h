@@ -0,0 +1,100 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "cloth.h"
+#include "parallel.h"
+
+const int MAX_COLORS = 64; // Colors of a coloring, the items left over are solved serially after them
+
+// Splits items linking up to N points each into colors, no two items of a color
+// sharing a point, so that the items of a color can be solved in parallel.
+// Items are colored greedily in order, each getting the first color free on
+// all its points. get_points(item, points) writes the N points of an item,
+// negative ones being ignored. The items that found no free color among the
+// MAX_COLORS ones are put in leftovers.
+template <int N, typename GetPoints>
+void color_items(int n_items, int n_points, GetPoints get_points,
+                 std::vector<std::vector<int>>* colors, std::vector<int>* leftovers) {
+    // Colors used by the items of each point, one bit each
+    std::vector<uint64_t> used(n_points, 0);
+    colors->clear();
+    leftovers->clear();
+    for (int item = 0; item < n_items; item++) {
+        int points[N];
+        get_points(item, points);
+        uint64_t taken = 0;
+        for (int p = 0; p < N; p++)
+            if (points[p] >= 0)
+                taken |= used[points[p]];
+        if (taken == ~0ull) {
+            leftovers->push_back(item);
+            continue;
+        }
+        int color = 0;
+        while (taken >> color & 1)
+            color++;
+        if (color >= (int)colors->size())
+            colors->resize(color + 1);
+        (*colors)[color].push_back(item);
+        for (int p = 0; p < N; p++)
+            if (points[p] >= 0)
+                used[points[p]] |= 1ull << color;
+    }
+}
+
+// Solves the distance constraints of a cloth with the same projections as
+// Cloth::constrain(), but in parallel: the constraints of each type are
+// colored, and the constraints of a color are projected by parallel tasks,
+// the colors one after the other. Unlike the grid solvers it works on any
+// topology, at the cost of scattered accesses to the points.
+struct ColoredSolver {
+    // Runs the given number of constraint sweeps
+    void constrain(Cloth* cloth, int iterations) {
+        if (topology_version != cloth->topology_version)
+            build(cloth);
+
+        for (int i = 0; i < iterations; i++)
+            for (int type = 0; type < N_CONSTRAINT_TYPES; type++) {
+                const double k = cloth->stiffness[type];
+                const bool tension_only = is_tension_only(type);
+                for (const std::vector<int>& color : colors[type])
+                    parallel_for(color.size(), [&](int begin, int end) {
+                        for (int c = begin; c < end; c++)
+                            cloth->project(color[c], k, tension_only);
+                    });
+                for (int c : leftovers[type])
+                    cloth->project(c, k, tension_only);
+            }
+    }
+
+    // Returns the number of colors of the constraints of the given type
+    int get_n_colors(int type) const {
+        return colors[type].size();
+    }
+
+    private:
+        int topology_version = -1;
+        // Constraints of each color, for each type
+        std::vector<std::vector<int>> colors[N_CONSTRAINT_TYPES];
+        std::vector<int> leftovers[N_CONSTRAINT_TYPES];
+
+        void build(const Cloth* cloth) {
+            for (int type = 0; type < N_CONSTRAINT_TYPES; type++) {
+                const int first = cloth->constraint_start[type];
+                color_items<2>(cloth->constraint_start[type + 1] - first, cloth->get_n_points(),
+                    [&](int c, int* points) {
+                        points[0] = cloth->constraint_a[first + c];
+                        points[1] = cloth->constraint_b[first + c];
+                    }, &colors[type], &leftovers[type]);
+                // Back to constraint indices
+                for (std::vector<int>& color : colors[type])
+                    for (int& c : color)
+                        c += first;
+                for (int& c : leftovers[type])
+                    c += first;
+            }
+            topology_version = cloth->topology_version;
+        }
+};
@@ -0,0 +1,289 @@
+#pragma once
+
+#include <cstdlib>
+#include <vector>
+
+#include "SimplexNoise.h"
+#include "cloth.h"
+#include "parallel.h"
+
+const float MAX_WIND_STRENGHT = 20;
+
+// Uniform acceleration field, applied to every point proportionally to its mass
+struct GravityForce {
+    Vec3d acceleration;
+    bool enabled = true;
+};
+
+// Turbulent wind, direction and strength come from fBm simplex noise
+// sampled along the cloth grid and scrolling with time
+struct WindForce {
+    float strength; // Multiplier of MAX_WIND_STRENGHT
+    int octaves;    // Number of fBm octaves, more is more turbulent
+    int time_offset = rand() % 10000;
+    bool enabled = true;
+};
+
+// Linear air drag, a force opposed to the point velocity
+// (a coefficient of 1 cancels the whole velocity in one step)
+struct DragForce {
+    float coefficient;
+    bool enabled = true;
+};
+
+// Pulls points towards a center, fading linearly to zero at the given radius
+// (a negative strength pushes them away)
+struct AttractorForce {
+    Vec3d center;
+    float strength;
+    float radius;
+    bool enabled = true;
+};
+
+// Swirls points around an axis passing through center,
+// fading linearly to zero at the given radius
+struct VortexForce {
+    Vec3d center;
+    Vec3d axis; // Normalized rotation axis
+    float strength;
+    float radius;
+    bool enabled = true;
+};
+
+// Constant force applied to the points closer than a radius to a ray
+struct RayForce {
+    Vec3d origin;
+    Vec3d direction; // Normalized ray direction
+    Vec3d force;
+    float radius;
+    bool enabled = true;
+};
+
+// A set of force generators registered by a scene. Before each evaluation the
+// generators are compiled into flat parameter arrays, uniform forces being
+// folded into a single constant, so that all of them are evaluated together
+// in one pass over the cloth points, whatever their number.
+struct ForceField {
+    std::vector<GravityForce> gravities;
+    std::vector<WindForce> winds;
+    std::vector<DragForce> drags;
+    std::vector<AttractorForce> attractors;
+    std::vector<VortexForce> vortices;
+    std::vector<RayForce> rays;
+
+    // Registering generators, the returned index allows to tweak them later on
+    int add_gravity(Vec3d acceleration) {
+        gravities.push_back(GravityForce{ acceleration });
+        return gravities.size() - 1;
+    }
+    int add_wind(float strength, int octaves=1) {
+        winds.push_back(WindForce{ strength, octaves });
+        return winds.size() - 1;
+    }
+    int add_drag(float coefficient) {
+        drags.push_back(DragForce{ coefficient });
+        return drags.size() - 1;
+    }
+    int add_attractor(Vec3d center, float strength, float radius) {
+        attractors.push_back(AttractorForce{ center, strength, radius });
+        return attractors.size() - 1;
+    }
+    int add_vortex(Vec3d center, Vec3d axis, float strength, float radius) {
+        vortices.push_back(VortexForce{ center, axis / axis.magnitude(), strength, radius });
+        return vortices.size() - 1;
+    }
+    int add_ray(Vec3d origin, Vec3d direction, Vec3d force, float radius) {
+        rays.push_back(RayForce{ origin, direction / direction.magnitude(), force, radius });
+        return rays.size() - 1;
+    }
+
+    // Computes the sum of the forces acting on each point of the cloth into
+    // its force buffers. cols is the number of points of each grid row,
+    // wind noise is sampled along the grid one row at a time (in the order
+    // the points were added, whatever their current order).
+    void evaluate(Cloth* cloth, int cols, double dt, float time) {
+        compile();
+
+        const int n = cloth->get_n_points();
+        const int n_winds = wind_octaves.size();
+        const int n_fields = field_cx.size();
+        const int n_rows = (n + cols - 1) / cols;
+
+        // Noise offsets of the rows, summed as a sweep of all the rows would
+        // so that the noise doesn't depend on the blocks
+        while ((int)row_noise_yoffs.size() < n_rows) {
+            float noise_yoff = row_noise_yoffs.empty() ? 0 : row_noise_yoffs.back();
+            if (!row_noise_yoffs.empty())
+                noise_yoff += 0.005;
+            row_noise_yoffs.push_back(noise_yoff);
+        }
+        if ((int)chunk_noise.size() < get_n_chunks(n_rows))
+            chunk_noise.resize(get_n_chunks(n_rows));
+        for (ChunkNoise& buffers : chunk_noise) {
+            for (std::vector<float>* buffer : { &buffers.x, &buffers.y, &buffers.z })
+                buffer->resize(cols);
+            buffers.values.resize(n_winds * cols);
+        }
+
+        // The rows are independent, blocks of them are evaluated in parallel with their own noise buffers
+        parallel_for(n_rows, [&](int first_row, int last_row) {
+            ChunkNoise& buffers = chunk_noise[first_row / PARALLEL_GRAIN];
+            float* noise_x = buffers.x.data();
+            float* noise_y = buffers.y.data();
+            float* noise_z = buffers.z.data();
+            float* wind_values = buffers.values.data();
+            for (int row_start = first_row * cols; row_start < min(n, last_row * cols); row_start += cols) {
+                const int row_size = min(cols, n - row_start);
+
+                // Wind noise of the whole row, evaluated in a single batched fBm call per wind
+                for (int w = 0; w < n_winds; w++) {
+                    float noise_xoff = 0;
+                    for (int j = 0; j < row_size; j++) {
+                        noise_x[j] = noise_xoff;
+                        noise_y[j] = row_noise_yoffs[row_start / cols];
+                        noise_z[j] = time + wind_time_offsets[w];
+                        noise_xoff += 0.03;
+                    }
+                    wind_noise.fractal(wind_octaves[w], row_size,
+                        noise_x, noise_y, noise_z, &wind_values[w * cols]);
+                }
+
+                for (int j = 0; j < row_size; j++) {
+                    const int k = cloth->find_point(row_start + j);
+                    const double x = cloth->x[k];
+                    const double y = cloth->y[k];
+                    const double z = cloth->z[k];
+                    double fx = constant_x;
+                    double fy = constant_y;
+                    double fz = constant_z;
+
+                    for (int w = 0; w < n_winds; w++) {
+                        float value = wind_values[w * cols + j];
+                        float wind_strength = map(value, -1, 1, 0, MAX_WIND_STRENGHT);
+                        float wind_phi = map(value, -1, 1, -M_PI, M_PI); // Horizontal rotation angle
+                        float wind_theta = map(value, -1, 1, -M_PI_2, M_PI_2); // Vertical rotation angle
+                        double strength = (double)wind_strength * wind_strengths[w];
+                        fx += sin(wind_phi) * cos(wind_theta) * strength;
+                        fy += sin(wind_phi) * sin(wind_theta) * strength;
+                        fz += cos(wind_phi) * strength;
+                    }
+
+                    // Linear drag, using the verlet velocity
+                    fx -= drag * (x - cloth->old_x[k]) / dt;
+                    fy -= drag * (y - cloth->old_y[k]) / dt;
+                    fz -= drag * (z - cloth->old_z[k]) / dt;
+
+                    // Radial (attractors) and tangential (vortices) fields
+                    for (int f = 0; f < n_fields; f++) {
+                        double rx = field_cx[f] - x;
+                        double ry = field_cy[f] - y;
+                        double rz = field_cz[f] - z;
+                        // Removing the component along the axis (null for attractors)
+                        double along = rx * field_ax[f] + ry * field_ay[f] + rz * field_az[f];
+                        rx -= along * field_ax[f];
+                        ry -= along * field_ay[f];
+                        rz -= along * field_az[f];
+                        double d = sqrt(rx * rx + ry * ry + rz * rz) + 0.00001;
+                        double falloff = max(0, 1 - d / field_radius[f]) * field_strength[f] / d;
+                        // Attractors pull along r, vortices push along axis x r
+                        double tx = field_ay[f] * rz - field_az[f] * ry;
+                        double ty = field_az[f] * rx - field_ax[f] * rz;
+                        double tz = field_ax[f] * ry - field_ay[f] * rx;
+                        fx += (field_radial[f] * rx + tx) * falloff;
+                        fy += (field_radial[f] * ry + ty) * falloff;
+                        fz += (field_radial[f] * rz + tz) * falloff;
+                    }
+
+                    for (const RayForce& ray : rays) {
+                        if (!ray.enabled)
+                            continue;
+                        Vec3d r = Vec3d{ x, y, z } - ray.origin;
+                        double along = r.get_x() * ray.direction.get_x() +
+                                       r.get_y() * ray.direction.get_y() +
+                                       r.get_z() * ray.direction.get_z();
+                        if (r.magnitude(true) - along * along < ray.radius * ray.radius) {
+                            fx += ray.force.get_x();
+                            fy += ray.force.get_y();
+                            fz += ray.force.get_z();
+                        }
+                    }
+
+                    cloth->force_x[k] = fx;
+                    cloth->force_y[k] = fy;
+                    cloth->force_z[k] = fz;
+                }
+            }
+        });
+    }
+
+    private:
+        SimplexNoise wind_noise;
+        // Compiled generators
+        double constant_x, constant_y, constant_z; // Sum of the uniform forces
+        double drag;                               // Sum of the drag coefficients
+        std::vector<float> wind_strengths;
+        std::vector<int> wind_octaves;
+        std::vector<int> wind_time_offsets;
+        // Attractors and vortices share the same parameters: radial is 1 and
+        // the axis is null for attractors, radial is 0 for vortices
+        std::vector<double> field_cx, field_cy, field_cz;
+        std::vector<double> field_ax, field_ay, field_az;
+        std::vector<double> field_radial, field_strength, field_radius;
+
+        // Noise buffers of each parallel chunk of rows, kept allocated between
+        // evaluations, and the noise offset of each row
+        struct ChunkNoise {
+            std::vector<float> x, y, z, values;
+        };
+        std::vector<ChunkNoise> chunk_noise;
+        std::vector<float> row_noise_yoffs;
+
+        // Flattens the enabled generators into the compiled parameters
+        void compile() {
+            constant_x = constant_y = constant_z = 0;
+            for (const GravityForce& gravity : gravities)
+                if (gravity.enabled) {
+                    constant_x += gravity.acceleration.get_x() * MASS;
+                    constant_y += gravity.acceleration.get_y() * MASS;
+                    constant_z += gravity.acceleration.get_z() * MASS;
+                }
+
+            wind_strengths.clear();
+            wind_octaves.clear();
+            wind_time_offsets.clear();
+            for (const WindForce& wind : winds)
+                if (wind.enabled && wind.strength != 0) {
+                    wind_strengths.push_back(wind.strength);
+                    wind_octaves.push_back(wind.octaves);
+                    wind_time_offsets.push_back(wind.time_offset);
+                }
+
+            drag = 0;
+            for (const DragForce& d : drags)
+                if (d.enabled)
+                    drag += d.coefficient;
+
+            for (std::vector<double>* field : { &field_cx, &field_cy, &field_cz,
+                                                &field_ax, &field_ay, &field_az,
+                                                &field_radial, &field_strength, &field_radius })
+                field->clear();
+            for (const AttractorForce& attractor : attractors)
+                if (attractor.enabled)
+                    add_field(attractor.center, Vec3d{}, 1, attractor.strength, attractor.radius);
+            for (const VortexForce& vortex : vortices)
+                if (vortex.enabled)
+                    add_field(vortex.center, vortex.axis, 0, vortex.strength, vortex.radius);
+        }
+
+        void add_field(Vec3d center, Vec3d axis, double radial, double strength, double radius) {
+            field_cx.push_back(center.get_x());
+            field_cy.push_back(center.get_y());
+            field_cz.push_back(center.get_z());
+            field_ax.push_back(axis.get_x());
+            field_ay.push_back(axis.get_y());
+            field_az.push_back(axis.get_z());
+            field_radial.push_back(radial);
+            field_strength.push_back(strength);
+            field_radius.push_back(radius);
+        }
+};
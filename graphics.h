@@ -1,3 +1,5 @@
+#pragma once
+
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
 #include "imgui.h"
@@ -52,6 +54,29 @@ const char* fragmentShaderSource = ""
     "}\0";
 
 
+// Hair is drawn as one instanced line segment per pair of consecutive points,
+// the instances reading both ends from the same per point buffer
+const char* hairVertexShaderSource = ""
+    "#version 330 core\n"
+    "layout (location = 0) in vec4 aStart;\n" // w is 0 at the tip of a strand, where no segment starts
+    "layout (location = 1) in vec3 aEnd;\n"
+    "uniform mat4 model;\n"
+    "uniform mat4 view;\n"
+    "uniform mat4 projection;\n"
+    "void main() {\n"
+    "   vec3 pos = gl_VertexID == 0 ? aStart.xyz : aEnd;\n"
+    "   gl_Position = projection * view * model * vec4(pos, 1.0);\n"
+    "   if (aStart.w == 0.0) gl_Position = vec4(2.0, 2.0, 2.0, 1.0);\n" // Clipping the segments between two strands
+    "}\0";
+
+const char* hairFragmentShaderSource = ""
+    "#version 330 core\n"
+    "out vec4 FragColor;\n"
+    "void main()\n"
+    "{\n"
+    "   FragColor = vec4(0.45, 0.3, 0.15, 1.0);\n"
+    "}\0";
+
 static void glfw_error_callback(int error, const char* description) {
     fprintf(stderr, "GLFW error %d: %s\n", error, description);
 }
@@ -163,6 +188,29 @@ unsigned int getShaderProgram() {
     return shaderProgram;
 }
 
+unsigned int getHairShaderProgram() {
+    unsigned int vertexShader = glCreateShader(GL_VERTEX_SHADER);
+    glShaderSource(vertexShader, 1, &hairVertexShaderSource, NULL);
+    glCompileShader(vertexShader);
+    checkForShaderSuccess(vertexShader, GL_COMPILE_STATUS, "HAIR_VERTEX");
+
+    unsigned int fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
+    glShaderSource(fragmentShader, 1, &hairFragmentShaderSource, NULL);
+    glCompileShader(fragmentShader);
+    checkForShaderSuccess(fragmentShader, GL_COMPILE_STATUS, "HAIR_FRAGMENT");
+
+    unsigned int hairShaderProgram = glCreateProgram();
+    glAttachShader(hairShaderProgram, vertexShader);
+    glAttachShader(hairShaderProgram, fragmentShader);
+    glLinkProgram(hairShaderProgram);
+    checkForShaderSuccess(hairShaderProgram, GL_LINK_STATUS, "HAIR_PROGRAM");
+
+    glDeleteShader(vertexShader);
+    glDeleteShader(fragmentShader);
+
+    return hairShaderProgram;
+}
+
 unsigned int getVAO() {
     // Generating a vertex array object
     unsigned int VAO;
@@ -212,6 +260,69 @@ void setVertexDataInterpretation() {
     glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void*)(6 * sizeof(float)));
 }
 
+// Creates the vertex array and buffer of the hair, 4 floats per point (position and
+// whether a segment starts there), each point being read as an instance attribute
+// twice: as the start of its segment and as the end of the previous one.
+// The bindings of the cloth are restored afterwards.
+unsigned int getHairVAO(unsigned int* hairVBO) {
+    int clothVAO, clothVBO;
+    glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &clothVAO);
+    glGetIntegerv(GL_ARRAY_BUFFER_BINDING, &clothVBO);
+
+    unsigned int hairVAO;
+    glGenVertexArrays(1, &hairVAO);
+    glBindVertexArray(hairVAO);
+    glGenBuffers(1, hairVBO);
+    glBindBuffer(GL_ARRAY_BUFFER, *hairVBO);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, 4 * sizeof(float), 0);
+    glVertexAttribDivisor(0, 1);
+    glEnableVertexAttribArray(1);
+    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 4 * sizeof(float), (void*)(4 * sizeof(float)));
+    glVertexAttribDivisor(1, 1);
+
+    glBindVertexArray(clothVAO);
+    glBindBuffer(GL_ARRAY_BUFFER, clothVBO);
+    return hairVAO;
+}
+
+// Creates the vertex array and buffers of a triangle mesh drawn like the cloth,
+// 8 floats per point in the vertex buffer, with the given triangles.
+// The bindings of the cloth are restored afterwards.
+unsigned int getMeshVAO(unsigned int* meshVBO, const unsigned int* indices, int nIndices) {
+    int clothVAO, clothVBO;
+    glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &clothVAO);
+    glGetIntegerv(GL_ARRAY_BUFFER_BINDING, &clothVBO);
+
+    unsigned int meshVAO = getVAO();
+    *meshVBO = getVBO();
+    getEBO();
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, nIndices * sizeof(unsigned int), indices, GL_STATIC_DRAW);
+    setVertexDataInterpretation();
+
+    glBindVertexArray(clothVAO);
+    glBindBuffer(GL_ARRAY_BUFFER, clothVBO);
+    return meshVAO;
+}
+
+// Replaces the vertex indices of a mesh, keeping the cloth vertex array object bound
+void loadIndices(unsigned int meshVAO, const unsigned int* indices, int nIndices) {
+    int clothVAO;
+    glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &clothVAO);
+    glBindVertexArray(meshVAO);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, nIndices * sizeof(unsigned int), indices, GL_DYNAMIC_DRAW);
+    glBindVertexArray(clothVAO);
+}
+
+// Loads vertices into another buffer than the cloth one (hair, meshes), keeping the cloth buffer bound
+void loadVertices(unsigned int VBO, const float* vertices, unsigned long sizeof_vertices) {
+    int clothVBO;
+    glGetIntegerv(GL_ARRAY_BUFFER_BINDING, &clothVBO);
+    glBindBuffer(GL_ARRAY_BUFFER, VBO);
+    glBufferData(GL_ARRAY_BUFFER, sizeof_vertices, vertices, GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, clothVBO);
+}
+
 unsigned int setTexture(const char* image_filepath) {
     unsigned int texture;
     glGenTextures(1, &texture);
@@ -246,7 +357,13 @@ void drawFrame(
     float* vertices,
     unsigned long sizeof_vertices,
     int shaderProgram,
-    unsigned int VAO
+    unsigned int VAO,
+    int nHairSegments,
+    int hairShaderProgram,
+    unsigned int hairVAO,
+    int nMeshes,
+    const int* nMeshIndices,
+    const unsigned int* meshVAOs
 ) {
     glfwMakeContextCurrent(window);
     // Clearing the screen
@@ -277,10 +394,32 @@ void drawFrame(
     glBindVertexArray(VAO);
     glDrawElements(GL_TRIANGLES, nIndices, GL_UNSIGNED_INT, 0);
 
+    // Drawing the surface of the other meshes (soft body, far flags), with the shading of the cloth
+    for (int m = 0; m < nMeshes; m++)
+        if (nMeshIndices[m] > 0) {
+            glBindVertexArray(meshVAOs[m]);
+            glDrawElements(GL_TRIANGLES, nMeshIndices[m], GL_UNSIGNED_INT, 0);
+        }
+    glBindVertexArray(VAO);
+
     // Drawing crosshair
     glPointSize(3);
     glDrawArrays(GL_POINTS, n_points, 1);
 
+    // Drawing all the hair segments in a single call, with the matrices of the cloth
+    if (nHairSegments > 0) {
+        float matrix[16];
+        glUseProgram(hairShaderProgram);
+        for (const char* name : { "model", "view", "projection" }) {
+            glGetUniformfv(shaderProgram, glGetUniformLocation(shaderProgram, name), matrix);
+            glUniformMatrix4fv(glGetUniformLocation(hairShaderProgram, name), 1, GL_FALSE, matrix);
+        }
+        glBindVertexArray(hairVAO);
+        glDrawArraysInstanced(GL_LINES, 0, 2, nHairSegments);
+        glBindVertexArray(VAO);
+        glUseProgram(shaderProgram);
+    }
+
     // Rendering
     ImGui::Render();
     int display_w, display_h;
@@ -0,0 +1,132 @@
+#pragma once
+
+#include "cloth.h"
+
+// Constraint solver specialized for cloths that are regular grids of rows
+// by cols points, linked as main() builds them. The constraints are not
+// stored anywhere: each stencil is a compile-time list of neighbour offsets,
+// so neighbour indices and resting distances are computed from the point
+// index and the spacing of the grid alone, and the solver only touches the
+// point arrays.
+//
+// Constraints are swept one offset at a time, in phases whose constraints
+// share no point: for offsets reaching the previous rows all the constraints
+// of a row are independent, for horizontal ones every other group of |dj|
+// constraints is. Each phase is then a plain (strided) loop the compiler can
+// vectorize, with trip counts known at compile time for the phases.
+
+// A stencil neighbour, linking (i, j) to (i + DI, j + DJ). DI < 0, or DI == 0 and DJ < 0
+template <int DI, int DJ>
+struct Offset {
+    static constexpr int di = DI;
+    static constexpr int dj = DJ;
+};
+
+// The neighbours linked by the constraints of a type
+template <ConstraintType TYPE, typename... Offsets>
+struct Stencil {
+    static constexpr ConstraintType type = TYPE;
+};
+
+typedef Stencil<STRUCTURAL, Offset<-1, 0>, Offset<0, -1>> StructuralStencil;
+typedef Stencil<SHEAR, Offset<-1, -1>, Offset<-1, 1>> ShearStencil;
+typedef Stencil<BENDING, Offset<-2, 0>, Offset<0, -2>> BendingStencil;
+
+// Point arrays of a grid cloth, and the resting distances of its structural constraints
+// along the rows and the columns, the other constraints resting as far as their offset
+template <typename Scalar>
+struct GridView {
+    Scalar* x;
+    Scalar* y;
+    Scalar* z;
+    const Scalar* inv_mass;
+    int rows, cols;
+    Scalar spacing_x, spacing_y;
+};
+
+template <typename Scalar, typename... Stencils>
+struct GridSolver {
+    // Runs a sweep over the constraints of all the stencils.
+    // stiffness is indexed by constraint type, like Cloth::stiffness.
+    static void constrain(const GridView<Scalar>& grid, const float* stiffness) {
+        (constrain_stencil(grid, stiffness, Stencils{}), ...);
+    }
+
+    private:
+        template <ConstraintType TYPE, typename... Offsets>
+        static void constrain_stencil(const GridView<Scalar>& grid, const float* stiffness, Stencil<TYPE, Offsets...>) {
+            (constrain_offset<TYPE, Offsets::di, Offsets::dj>(grid, stiffness[TYPE]), ...);
+        }
+
+        template <ConstraintType TYPE, int DI, int DJ>
+        static void constrain_offset(const GridView<Scalar>& grid, Scalar stiffness) {
+            constexpr bool TENSION_ONLY = is_tension_only(TYPE);
+            const Scalar rest = std::sqrt(DI * DI * grid.spacing_y * grid.spacing_y + DJ * DJ * grid.spacing_x * grid.spacing_x);
+            // Columns where the constraint is inside the grid
+            const int j_begin = DJ < 0 ? -DJ : 0;
+            const int j_end = DJ > 0 ? grid.cols - DJ : grid.cols;
+
+            if (DI < 0) {
+                for (int i = -DI; i < grid.rows; i++) {
+                    const int row = i * grid.cols;
+                    const int other_row = (i + DI) * grid.cols + DJ;
+#pragma omp simd
+                    for (int j = j_begin; j < j_end; j++)
+                        project<TENSION_ONLY>(grid, row + j, other_row + j, rest, stiffness);
+                }
+            } else {
+                // Constraints (j, j - |DJ|) and (j + 2|DJ|, j + |DJ|) never share a point
+                constexpr int STRIDE = 2 * (DJ < 0 ? -DJ : DJ);
+                for (int i = 0; i < grid.rows; i++) {
+                    const int row = i * grid.cols;
+                    for (int phase = 0; phase < STRIDE; phase++)
+#pragma omp simd
+                        for (int j = j_begin + phase; j < j_end; j += STRIDE)
+                            project<TENSION_ONLY>(grid, row + j, row + j + DJ, rest, stiffness);
+                }
+            }
+        }
+
+        // Moves the two points of a constraint towards its resting distance, like Cloth::project()
+        template <bool TENSION_ONLY>
+        static inline void project(const GridView<Scalar>& grid, int a, int b, Scalar rest, Scalar stiffness) {
+            Scalar dx = grid.x[a] - grid.x[b];
+            Scalar dy = grid.y[a] - grid.y[b];
+            Scalar dz = grid.z[a] - grid.z[b];
+            Scalar d = std::sqrt(dx * dx + dy * dy + dz * dz) + Scalar(0.00001);
+            Scalar target = TENSION_ONLY ? (d < rest ? d : rest) : rest;
+            Scalar translate = Scalar(0.5) * stiffness * (target - d) / d;
+            Scalar wa = translate * grid.inv_mass[a];
+            Scalar wb = translate * grid.inv_mass[b];
+            grid.x[a] += dx * wa;
+            grid.y[a] += dy * wa;
+            grid.z[a] += dz * wa;
+            grid.x[b] -= dx * wb;
+            grid.y[b] -= dy * wb;
+            grid.z[b] -= dz * wb;
+        }
+};
+
+// The solver for the cloths built by main()
+typedef GridSolver<double, StructuralStencil, ShearStencil, BendingStencil> ClothGridSolver;
+
+// Returns a view over the points of a cloth with cols points per row, its spacing being
+// the resting distance of the structural constraints of its first point (RESTING_DISTANCE
+// if it has none), found among the first ones as main() adds them row by row
+GridView<double> get_grid_view(Cloth* cloth, int cols) {
+    double spacing_x = RESTING_DISTANCE, spacing_y = RESTING_DISTANCE;
+    bool found_x = false, found_y = false;
+    for (int c = cloth->constraint_start[STRUCTURAL]; c < cloth->constraint_start[STRUCTURAL + 1] && !(found_x && found_y); c++) {
+        const int a = std::min(cloth->constraint_a[c], cloth->constraint_b[c]);
+        const int b = std::max(cloth->constraint_a[c], cloth->constraint_b[c]);
+        if (a == 0 && b == 1) {
+            spacing_x = cloth->constraint_rest[c];
+            found_x = true;
+        } else if (a == 0 && b == cols) {
+            spacing_y = cloth->constraint_rest[c];
+            found_y = true;
+        }
+    }
+    return GridView<double>{ cloth->x.data(), cloth->y.data(), cloth->z.data(),
+                             cloth->inv_mass.data(), cloth->get_n_points() / cols, cols, spacing_x, spacing_y };
+}
@@ -0,0 +1,155 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "cloth.h"
+#include "colliders.h"
+#include "forces.h"
+#include "parallel.h"
+
+const int HAIR_SEGMENTS = 16;               // Segments of each strand, from the root to the tip
+const float HAIR_FTL_DAMPING = 0.9;         // Fraction of the length correction of a segment taken off the velocity of its upper point
+const float HAIR_BENDING_STIFFNESS = 0.2;   // Stiffness of the constraints skipping a point, keeping the strands from folding
+const int HAIR_STRANDS_PER_TASK = 64;       // Strands solved by each parallel task
+
+// Strands of hair simulated with the verlet integration and the distance
+// constraints of the cloth. The points of all the strands are stored in a
+// Cloth, strand after strand from the root to the tip, so that they share its
+// arrays and integration, the force field and the colliders. The roots are pinned.
+// Each strand is a chain of segments, with bending constraints between the
+// points two segments apart. The segments aren't stored as constraints: they
+// keep their length exactly with a single pass from the root to the tip
+// (dynamic follow the leader), each point being put back at its segment
+// length from the previous one, so that the cost of a strand doesn't grow
+// with the iterations needed for a long chain to stop stretching. The strands
+// being independent they are solved in parallel without any coloring.
+// The strands have no material frame, so they don't twist.
+struct Hair {
+    Cloth points;
+    bool enabled = false;
+    float bending_stiffness = HAIR_BENDING_STIFFNESS;
+
+    // Adds a straight strand of the given length growing from root along direction, returns its index
+    int add_strand(Vec3d root, Vec3d direction, double length) {
+        direction = direction / direction.magnitude();
+        const double segment = length / HAIR_SEGMENTS;
+        for (int k = 0; k <= HAIR_SEGMENTS; k++) {
+            Vec3d position = root + direction * (k * segment);
+            points.add_point(position.get_x(), position.get_y(), position.get_z(), k == 0);
+        }
+        segment_lengths.push_back(segment);
+        return segment_lengths.size() - 1;
+    }
+
+    // Moves the roots of all the strands by offset, the rest of the strands following them in the next steps
+    void move_roots(Vec3d offset) {
+        for (int s = 0; s < get_n_strands(); s++) {
+            const int root = get_strand_start(s);
+            points.drag_to(root, points.get_pos(root) + offset);
+        }
+    }
+
+    int get_n_strands() const {
+        return segment_lengths.size();
+    }
+
+    // Returns the index in points of the root of strand s, the next HAIR_SEGMENTS points being the rest of it
+    int get_strand_start(int s) const {
+        return s * (HAIR_SEGMENTS + 1);
+    }
+
+    // Advances the strands by one step of dt. Unlike the cloth, the strands are
+    // integrated first and then constrained, the given iterations of the
+    // bending constraints being followed by the pass keeping the segment
+    // lengths, so that they are drawn at their exact length. The wind is
+    // sampled along each strand as along a cloth row. colliders can be null,
+    // the strands keep their own collision state.
+    void simulate(ForceField* forces, const Colliders* colliders, int iterations, double dt, float time) {
+        if (colliders)
+            this->colliders.copy_colliders(*colliders);
+
+        forces->evaluate(&points, HAIR_SEGMENTS + 1, dt, time);
+        points.integrate(dt);
+
+        if (colliders) {
+            this->colliders.cull(&points);
+            this->colliders.project(&points, true);
+            this->colliders.sweep(&points);
+        }
+
+        const int n_tasks = (get_n_strands() + HAIR_STRANDS_PER_TASK - 1) / HAIR_STRANDS_PER_TASK;
+        get_thread_pool().run(n_tasks, [&](int task) {
+            const int begin = task * HAIR_STRANDS_PER_TASK;
+            constrain(begin, std::min(get_n_strands(), begin + HAIR_STRANDS_PER_TASK), iterations);
+        });
+    }
+
+    private:
+        std::vector<double> segment_lengths;
+        // Collision state of the strands, with the colliders shared with the cloth copied in
+        Colliders colliders;
+
+        // Solves the constraints of the strands [begin, end): the iterations of the bending constraints,
+        // then the pass from the root to the tip moving each point onto its segment length from the
+        // previous one. The move is taken off the velocity of the previous point, scaled by
+        // HAIR_FTL_DAMPING, which otherwise reads it as the strand being pulled towards its tip.
+        // The strands are swept together, a segment of each in turn, so that their independent
+        // projections overlap
+        void constrain(int begin, int end, int iterations) {
+            double* x = points.x.data();
+            double* y = points.y.data();
+            double* z = points.z.data();
+            double* old_x = points.old_x.data();
+            double* old_y = points.old_y.data();
+            double* old_z = points.old_z.data();
+            const double* w = points.inv_mass.data();
+            for (int iteration = 0; iteration < iterations; iteration++)
+                for (int k = 2; k <= HAIR_SEGMENTS; k++)
+#pragma omp simd
+                    for (int s = begin; s < end; s++) {
+                        const int i = get_strand_start(s) + k;
+                        project(x, y, z, w, i - 2, i, 2 * segment_lengths[s], bending_stiffness);
+                    }
+
+            for (int k = 1; k <= HAIR_SEGMENTS; k++)
+#pragma omp simd
+                for (int s = begin; s < end; s++) {
+                    const int i = get_strand_start(s) + k;
+                    const double dx = x[i] - x[i - 1];
+                    const double dy = y[i] - y[i - 1];
+                    const double dz = z[i] - z[i - 1];
+                    double d = sqrt(dx * dx + dy * dy + dz * dz);
+                    if (d <= 0)
+                        d = 0.00001;
+                    const double scale = (segment_lengths[s] / d - 1) * w[i];
+                    x[i] += dx * scale;
+                    y[i] += dy * scale;
+                    z[i] += dz * scale;
+                    const double damping = HAIR_FTL_DAMPING * w[i - 1];
+                    old_x[i - 1] += dx * scale * damping;
+                    old_y[i - 1] += dy * scale * damping;
+                    old_z[i - 1] += dz * scale * damping;
+                }
+        }
+
+        // Moves points a and b towards the given distance, in proportion to their inverse masses
+        static void project(double* x, double* y, double* z, const double* w, int a, int b, double rest, double stiffness) {
+            // Zero for two pinned points
+            const double total = w[a] + w[b];
+            const double dx = x[b] - x[a];
+            const double dy = y[b] - y[a];
+            const double dz = z[b] - z[a];
+            double d = sqrt(dx * dx + dy * dy + dz * dz);
+            if (d <= 0)
+                d = 0.00001;
+            const double translate = total > 0 ? stiffness * (rest - d) / (d * total) : 0;
+            x[a] -= dx * translate * w[a];
+            y[a] -= dy * translate * w[a];
+            z[a] -= dz * translate * w[a];
+            x[b] += dx * translate * w[b];
+            y[b] += dy * translate * w[b];
+            z[b] += dz * translate * w[b];
+        }
+};
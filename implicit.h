@@ -0,0 +1,285 @@
+#pragma once
+
+#include <algorithm>
+#include <vector>
+
+#include "cloth.h"
+#include "parallel.h"
+
+const float SPRING_STIFFNESS = 2500; // Stiffness of the springs replacing the distance constraints, times their type stiffness
+const int CG_MAX_ITERATIONS = 50;
+const double CG_TOLERANCE = 1e-4; // Relative residual norm at which the solve stops
+
+// Backward Euler integrator. The distance constraints become springs (only
+// resisting stretching unless they are bending ones), and each step solves the linearized system
+//     (I + dt K) d = v (1 - DAMPING) + dt f
+// for the displacement d of the points, where K is the springs Hessian
+// (with its indefinite part clamped, so that the system is symmetric
+// positive definite) and f the external plus spring forces, in the same
+// units as the verlet integrator. The solve is a block Jacobi preconditioned
+// conjugate gradient, whose sparse matrix-vector product runs over the rows
+// in parallel. Pinned points are kept out of the system through their
+// inverse mass. Being unconditionally stable it can take a single large
+// step per frame however stiff the springs are.
+struct ImplicitSolver {
+    // Advances the cloth by one step of dt
+    void step(Cloth* cloth, double dt) {
+        if (topology_version != cloth->topology_version)
+            build_topology(cloth);
+
+        const int n = cloth->get_n_points();
+        assemble(cloth, dt);
+
+        // Right hand side, the initial guess is the damped velocity
+        parallel_for(n, [&](int begin, int end) {
+            for (int i = begin; i < end; i++) {
+                double w = cloth->inv_mass[i];
+                double vx = (cloth->x[i] - cloth->old_x[i]) * (1 - DAMPING);
+                double vy = (cloth->y[i] - cloth->old_y[i]) * (1 - DAMPING);
+                double vz = (cloth->z[i] - cloth->old_z[i]) * (1 - DAMPING);
+                rhs[3 * i    ] = w * (vx + dt * (cloth->force_x[i] + spring_force[3 * i    ]));
+                rhs[3 * i + 1] = w * (vy + dt * (cloth->force_y[i] + spring_force[3 * i + 1]));
+                rhs[3 * i + 2] = w * (vz + dt * (cloth->force_z[i] + spring_force[3 * i + 2]));
+                displacement[3 * i    ] = w * vx;
+                displacement[3 * i + 1] = w * vy;
+                displacement[3 * i + 2] = w * vz;
+            }
+        });
+
+        solve(cloth);
+
+        parallel_for(n, [&](int begin, int end) {
+            for (int i = begin; i < end; i++) {
+                cloth->old_x[i] = cloth->x[i];
+                cloth->old_y[i] = cloth->y[i];
+                cloth->old_z[i] = cloth->z[i];
+                cloth->x[i] += displacement[3 * i    ];
+                cloth->y[i] += displacement[3 * i + 1];
+                cloth->z[i] += displacement[3 * i + 2];
+            }
+        });
+    }
+
+    // Returns the number of conjugate gradient iterations of the last step
+    int get_n_iterations() const {
+        return n_iterations;
+    }
+
+    private:
+        int topology_version = -1;
+        int n_iterations = 0;
+        Adjacency adjacency;
+        // Per spring scaled Hessian dt K, symmetric 3x3 blocks stored by component
+        std::vector<double> hxx, hxy, hxz, hyy, hyz, hzz;
+        // Per spring tension divided by the length
+        std::vector<double> tension;
+        // Inverted diagonal blocks of the system (block Jacobi preconditioner)
+        std::vector<double> preconditioner;
+        // Vectors of 3 coordinates per point
+        std::vector<double> spring_force, rhs, displacement, residual, direction, product, z;
+
+        // Rebuilds the per point adjacency of the springs and resizes the buffers
+        void build_topology(Cloth* cloth) {
+            const int n = cloth->get_n_points();
+            const int m = cloth->get_n_constraints();
+            adjacency.build(cloth);
+            for (std::vector<double>* block : { &hxx, &hxy, &hxz, &hyy, &hyz, &hzz, &tension })
+                block->resize(m);
+            preconditioner.resize(9 * n);
+            for (std::vector<double>* vector : { &spring_force, &rhs, &displacement,
+                                                 &residual, &direction, &product, &z })
+                vector->resize(3 * n);
+            topology_version = cloth->topology_version;
+        }
+
+        // Computes the spring forces, Hessian blocks and preconditioner at the current positions
+        void assemble(Cloth* cloth, double dt) {
+            const int n = cloth->get_n_points();
+            const int m = cloth->get_n_constraints();
+
+            parallel_for(m, [&](int begin, int end) {
+                for (int type = 0; type < N_CONSTRAINT_TYPES; type++) {
+                    const double stiffness = SPRING_STIFFNESS * cloth->stiffness[type];
+                    const bool tension_only = is_tension_only(type);
+                    const int last = std::min(end, cloth->constraint_start[type + 1]);
+                    for (int c = std::max(begin, cloth->constraint_start[type]); c < last; c++) {
+                        int a = cloth->constraint_a[c];
+                        int b = cloth->constraint_b[c];
+                        double dx = cloth->x[a] - cloth->x[b];
+                        double dy = cloth->y[a] - cloth->y[b];
+                        double dz = cloth->z[a] - cloth->z[b];
+                        double d = sqrt(dx * dx + dy * dy + dz * dz);
+                        if (d <= 0)
+                            d = 0.00001;
+                        double active = !tension_only || d > cloth->constraint_rest[c];
+                        double rest_ratio = cloth->constraint_rest[c] / d;
+                        tension[c] = active * stiffness * (1 - rest_ratio);
+                        // K = k (L/d u u^T + (1 - L/d) I), with u = (dx, dy, dz) / d,
+                        // the isotropic part is dropped when compressed to stay definite
+                        double k = active * dt * stiffness;
+                        double radial = k * rest_ratio / (d * d);
+                        double isotropic = k * (rest_ratio < 1 ? 1 - rest_ratio : 0);
+                        hxx[c] = radial * dx * dx + isotropic;
+                        hxy[c] = radial * dx * dy;
+                        hxz[c] = radial * dx * dz;
+                        hyy[c] = radial * dy * dy + isotropic;
+                        hyz[c] = radial * dy * dz;
+                        hzz[c] = radial * dz * dz + isotropic;
+                    }
+                }
+            });
+
+            parallel_for(n, [&](int begin, int end) {
+                for (int i = begin; i < end; i++) {
+                    double fx = 0, fy = 0, fz = 0;
+                    double axx = 1, axy = 0, axz = 0, ayy = 1, ayz = 0, azz = 1;
+                    for (int e = adjacency.row_start[i]; e < adjacency.row_start[i + 1]; e++) {
+                        int c = adjacency.row_constraint[e];
+                        int j = adjacency.row_other[e];
+                        fx -= tension[c] * (cloth->x[i] - cloth->x[j]);
+                        fy -= tension[c] * (cloth->y[i] - cloth->y[j]);
+                        fz -= tension[c] * (cloth->z[i] - cloth->z[j]);
+                        axx += hxx[c];
+                        axy += hxy[c];
+                        axz += hxz[c];
+                        ayy += hyy[c];
+                        ayz += hyz[c];
+                        azz += hzz[c];
+                    }
+                    spring_force[3 * i    ] = fx;
+                    spring_force[3 * i + 1] = fy;
+                    spring_force[3 * i + 2] = fz;
+
+                    // Inverting the symmetric diagonal block, pinned points rows are the identity
+                    if (cloth->inv_mass[i] == 0) {
+                        axx = ayy = azz = 1;
+                        axy = axz = ayz = 0;
+                    }
+                    double cxx = ayy * azz - ayz * ayz;
+                    double cxy = axz * ayz - axy * azz;
+                    double cxz = axy * ayz - axz * ayy;
+                    double inv_det = 1 / (axx * cxx + axy * cxy + axz * cxz);
+                    double* p = &preconditioner[9 * i];
+                    p[0] = cxx * inv_det;
+                    p[1] = cxy * inv_det;
+                    p[2] = cxz * inv_det;
+                    p[3] = p[1];
+                    p[4] = (axx * azz - axz * axz) * inv_det;
+                    p[5] = (axy * axz - axx * ayz) * inv_det;
+                    p[6] = p[2];
+                    p[7] = p[5];
+                    p[8] = (axx * ayy - axy * axy) * inv_det;
+                }
+            });
+        }
+
+        // product = A v, over the point rows in parallel. Each row only
+        // reads the vector, so rows are independent and the inner loops
+        // are plain multiply-adds over the row springs.
+        void multiply(Cloth* cloth, const std::vector<double>& v, std::vector<double>& product, int begin, int end) {
+            const double* __restrict w = cloth->inv_mass.data();
+            const double* __restrict in = v.data();
+            double* __restrict out = product.data();
+            const int* row_start = adjacency.row_start.data();
+            const int* row_spring = adjacency.row_constraint.data();
+            const int* row_other = adjacency.row_other.data();
+            for (int i = begin; i < end; i++) {
+                double wi = w[i];
+                double vx = wi * in[3 * i];
+                double vy = wi * in[3 * i + 1];
+                double vz = wi * in[3 * i + 2];
+                double sx = 0, sy = 0, sz = 0;
+#pragma omp simd reduction(+:sx, sy, sz)
+                for (int e = row_start[i]; e < row_start[i + 1]; e++) {
+                    int c = row_spring[e];
+                    int j = row_other[e];
+                    double dx = vx - w[j] * in[3 * j];
+                    double dy = vy - w[j] * in[3 * j + 1];
+                    double dz = vz - w[j] * in[3 * j + 2];
+                    sx += hxx[c] * dx + hxy[c] * dy + hxz[c] * dz;
+                    sy += hxy[c] * dx + hyy[c] * dy + hyz[c] * dz;
+                    sz += hxz[c] * dx + hyz[c] * dy + hzz[c] * dz;
+                }
+                out[3 * i    ] = in[3 * i    ] + wi * sx;
+                out[3 * i + 1] = in[3 * i + 1] + wi * sy;
+                out[3 * i + 2] = in[3 * i + 2] + wi * sz;
+            }
+        }
+
+        // z = P^-1 r on the points in [begin, end), returns the r.z partial dot product
+        double precondition(int begin, int end) {
+            double rz = 0;
+            for (int i = begin; i < end; i++) {
+                const double* p = &preconditioner[9 * i];
+                const double* r = &residual[3 * i];
+                for (int a = 0; a < 3; a++) {
+                    z[3 * i + a] = p[3 * a] * r[0] + p[3 * a + 1] * r[1] + p[3 * a + 2] * r[2];
+                    rz += r[a] * z[3 * i + a];
+                }
+            }
+            return rz;
+        }
+
+        // Preconditioned conjugate gradient, starting from the current displacement
+        void solve(Cloth* cloth) {
+            const int n = cloth->get_n_points();
+
+            double rhs_norm = parallel_sum(n, [&](int begin, int end) {
+                multiply(cloth, displacement, product, begin, end);
+                double sum = 0;
+#pragma omp simd reduction(+:sum)
+                for (int k = 3 * begin; k < 3 * end; k++) {
+                    residual[k] = rhs[k] - product[k];
+                    sum += rhs[k] * rhs[k];
+                }
+                return sum;
+            });
+            double rz = parallel_sum(n, [&](int begin, int end) {
+                double sum = precondition(begin, end);
+                for (int k = 3 * begin; k < 3 * end; k++)
+                    direction[k] = z[k];
+                return sum;
+            });
+
+            const double tolerance = CG_TOLERANCE * CG_TOLERANCE * rhs_norm;
+            for (n_iterations = 0; n_iterations < CG_MAX_ITERATIONS; n_iterations++) {
+                double p_ap = parallel_sum(n, [&](int begin, int end) {
+                    multiply(cloth, direction, product, begin, end);
+                    double sum = 0;
+#pragma omp simd reduction(+:sum)
+                    for (int k = 3 * begin; k < 3 * end; k++)
+                        sum += direction[k] * product[k];
+                    return sum;
+                });
+                if (p_ap <= 0)
+                    break;
+                double alpha = rz / p_ap;
+
+                double residual_norm = parallel_sum(n, [&](int begin, int end) {
+                    double sum = 0;
+#pragma omp simd reduction(+:sum)
+                    for (int k = 3 * begin; k < 3 * end; k++) {
+                        displacement[k] += alpha * direction[k];
+                        residual[k] -= alpha * product[k];
+                        sum += residual[k] * residual[k];
+                    }
+                    return sum;
+                });
+                if (residual_norm <= tolerance) {
+                    n_iterations++;
+                    break;
+                }
+
+                double rz_new = parallel_sum(n, [&](int begin, int end) {
+                    return precondition(begin, end);
+                });
+                double beta = rz_new / rz;
+                rz = rz_new;
+                parallel_for(n, [&](int begin, int end) {
+#pragma omp simd
+                    for (int k = 3 * begin; k < 3 * end; k++)
+                        direction[k] = z[k] + beta * direction[k];
+                });
+            }
+        }
+};
@@ -0,0 +1,162 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "cloth.h"
+#include "colliders.h"
+#include "forces.h"
+
+const int LOD_LEVELS = 3;               // Resolutions of a cloth, each one halving the rows and the columns of the previous one
+const float LOD_DISTANCE = 2000;        // Camera distance past which a cloth drops to its second level, doubling for each next one
+const float LOD_HYSTERESIS = 0.15;      // Fraction of the distance a level is kept past its threshold, so that it doesn't flicker
+
+// A grid cloth simulated at a resolution depending on its distance from the
+// camera. The coarser grids are built up front by the same function as the
+// full resolution one, spanning the same area, and only the active one is
+// simulated. On a switch the positions and the previous positions of the
+// points of the new grid are interpolated from the old one, which keeps the
+// shape and the velocity of the cloth, its pinned points being the ones it
+// was built with, moved along. The level is kept until the distance goes
+// past its threshold by LOD_HYSTERESIS, so that a camera standing around a
+// threshold doesn't switch it at each frame.
+struct ClothLOD {
+    // Builds the levels, build_grid(cloth, rows, cols) adding to an empty cloth a grid of rows * cols points
+    template <typename BuildGrid>
+    void build(int rows, int cols, BuildGrid build_grid) {
+        levels.clear();
+        for (int l = 0; l < LOD_LEVELS; l++) {
+            Level level;
+            level.rows = ((rows - 1) >> l) + 1;
+            level.cols = ((cols - 1) >> l) + 1;
+            // Not worth going below a single cell
+            if (level.rows < 2 || level.cols < 2)
+                break;
+            build_grid(&level.cloth, level.rows, level.cols);
+            levels.push_back(level);
+        }
+        level = 0;
+    }
+
+    // Switches to the level of the given camera position, returns whether it changed
+    bool update(Vec3d camera_pos) {
+        const double distance = (get_center() - camera_pos).magnitude();
+        int next = level;
+        while (next + 1 < get_n_levels() && distance > get_threshold(next + 1) * (1 + LOD_HYSTERESIS))
+            next++;
+        while (next > 0 && distance < get_threshold(next) * (1 - LOD_HYSTERESIS))
+            next--;
+        if (next == level)
+            return false;
+        transfer(levels[level], &levels[next]);
+        level = next;
+        // The points near the colliders were gathered on the old grid
+        colliders.cull(get_cloth());
+        return true;
+    }
+
+    // Advances the active grid by one step of dt with the verlet solver.
+    // colliders can be null, the cloth keeps its own collision state.
+    void simulate(ForceField* forces, const Colliders* colliders, int iterations, double dt, float time) {
+        Cloth* cloth = get_cloth();
+        if (colliders)
+            this->colliders.copy_colliders(*colliders);
+
+        for (int i = 0; i < iterations; i++) {
+            cloth->constrain();
+            if (colliders)
+                this->colliders.project(cloth, false);
+        }
+
+        forces->evaluate(cloth, get_cols(), dt, time);
+        cloth->integrate(dt);
+
+        if (colliders) {
+            this->colliders.cull(cloth);
+            this->colliders.project(cloth, true);
+            this->colliders.sweep(cloth);
+        }
+    }
+
+    Cloth* get_cloth() {
+        return &levels[level].cloth;
+    }
+
+    int get_level() const {
+        return level;
+    }
+
+    int get_n_levels() const {
+        return levels.size();
+    }
+
+    int get_rows() const {
+        return levels[level].rows;
+    }
+
+    int get_cols() const {
+        return levels[level].cols;
+    }
+
+    // Returns the mean position of the points of the active grid
+    Vec3d get_center() const {
+        const Cloth& cloth = levels[level].cloth;
+        double x = 0, y = 0, z = 0;
+        for (int i = 0; i < cloth.get_n_points(); i++) {
+            x += cloth.x[i];
+            y += cloth.y[i];
+            z += cloth.z[i];
+        }
+        const int n = cloth.get_n_points();
+        return Vec3d{ x / n, y / n, z / n };
+    }
+
+    private:
+        struct Level {
+            Cloth cloth;
+            int rows, cols;
+        };
+
+        std::vector<Level> levels;
+        int level = 0;
+        // Collision state of the cloth, with the colliders shared with the other cloths copied in
+        Colliders colliders;
+
+        // Returns the camera distance past which level l is used
+        static double get_threshold(int l) {
+            return LOD_DISTANCE * (1 << (l - 1));
+        }
+
+        // Sets the points of the grid to to the bilinear interpolation of the ones of the grid from
+        static void transfer(const Level& from, Level* to) {
+            const Cloth& source = from.cloth;
+            Cloth& cloth = to->cloth;
+            for (int i = 0; i < to->rows; i++)
+                for (int j = 0; j < to->cols; j++) {
+                    // Position of the point in the grid from, in points
+                    const double s = (double)i * (from.rows - 1) / (to->rows - 1);
+                    const double t = (double)j * (from.cols - 1) / (to->cols - 1);
+                    // Cell of the grid from, the last row and column ending the previous ones
+                    const int i0 = std::min((int)s, from.rows - 2);
+                    const int j0 = std::min((int)t, from.cols - 2);
+                    const int i1 = i0 + 1, j1 = j0 + 1;
+                    const double fs = s - i0, ft = t - j0;
+                    const int p00 = source.find_point(i0 * from.cols + j0);
+                    const int p01 = source.find_point(i0 * from.cols + j1);
+                    const int p10 = source.find_point(i1 * from.cols + j0);
+                    const int p11 = source.find_point(i1 * from.cols + j1);
+                    auto interpolate = [&](const std::vector<double>& v) {
+                        return (1 - fs) * ((1 - ft) * v[p00] + ft * v[p01]) + fs * ((1 - ft) * v[p10] + ft * v[p11]);
+                    };
+
+                    const int k = cloth.find_point(i * to->cols + j);
+                    cloth.x[k] = interpolate(source.x);
+                    cloth.y[k] = interpolate(source.y);
+                    cloth.z[k] = interpolate(source.z);
+                    cloth.old_x[k] = interpolate(source.old_x);
+                    cloth.old_y[k] = interpolate(source.old_y);
+                    cloth.old_z[k] = interpolate(source.old_z);
+                }
+        }
+};
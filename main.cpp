@@ -1,7 +1,16 @@
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <ctime>
 
+#include "hair.h"
+#include "lod.h"
+#include "mesh_cloth.h"
 #include "physics.h"
+#include "reorder.h"
+#include "snapshot.h"
+#include "softbody.h"
+#include "subdivision.h"
 
 const int TARGET_FPS = 60;
 const double SECONDSPERFRAME = 1.0 / TARGET_FPS;
@@ -11,9 +20,36 @@ const int WINDOW_HEIGHT = 720;
 
 const int N_PHYSICS_UPDATE = 3;
 const int N_CONSTRAIN_SOLVE = 10;
+const int N_IMPLICIT_UPDATE = 1; // The implicit, projective and small steps solvers take a single step per frame
+// Lays the points out along a Hilbert curve, for locality on large cloths
+// (the grid solvers need the grid order and are disabled by it)
+const bool REORDER_POINTS = false;
+const int N_SMALL_STEPS = N_PHYSICS_UPDATE * N_CONSTRAIN_SOLVE; // Substeps of the small steps solver per frame
+// OBJ mesh the cloth collides with (none if empty), its scale and position
+const char* COLLIDER_MESH = "";
+const float COLLIDER_MESH_SCALE = 100;
+const Vec3d COLLIDER_MESH_POSITION{ 0, -200, 60 };
+// OBJ mesh loaded as the cloth in place of the flag (none if empty), its scale and position
+const char* CLOTH_MESH = "";
+const float CLOTH_MESH_SCALE = 100;
+const Vec3d CLOTH_MESH_POSITION{ 0, 0, 0 };
+
+// Hair growing on the top of the sphere collider, and the iterations of its bending constraints per step
+const int N_HAIR_STRANDS = 20000;
+const float HAIR_LENGTH = 80;
+const int N_HAIR_ITERATIONS = 2;
+
+// Soft body lattice falling next to the cloth, points per side
+const int SOFT_BODY_SIZE = 8;
+const Vec3d SOFT_BODY_POSITION{ 120, 100, 40 };
 
 const int ROWS = 30; // Number of cloth rows
 const int COLS = 40; // Number of points for each cloth row
+const Vec3d FLAG_CORNER{ -(COLS - 1) * RESTING_DISTANCE / 2, 160, 0 }; // Position of the first point of the cloth, its top left corner
+
+// Flags behind the cloth, simulated at a resolution depending on their distance from the camera
+const int N_FAR_FLAGS = 6;
+const float FAR_FLAGS_SPACING = 400; // Between the flags along x, they go back by twice that along z
 // Simulation space constrains
 const int XMAX = 500; 
 const int YMAX = 500;
@@ -55,88 +91,143 @@ void key_callback(GLFWwindow* window, int key, int scancode, int action, int mod
         switchCursorMode(window);
 }
 
+// Writes the positions of the points of a cloth, mapped to the rendered space, and their normals,
+// the sum of the normals of the triangles around each point, into vertices (8 floats per point)
+void mapPoints(const Cloth* cloth, float* vertices) {
+    static std::vector<glm::vec3> normals;
+    const int n = cloth->get_n_points();
+    for (int j = 0; j < n; j++) {
+        double x = cloth->get_pos_x(j);
+        double y = cloth->get_pos_y(j);
+        double z = cloth->get_pos_z(j);
+
+        vertices[j * 8    ] = map(x, -XMAX, XMAX, -1, 1);
+        vertices[j * 8 + 1] = map(y, -YMAX, YMAX, -1, 1);
+        vertices[j * 8 + 2] = map(z, -ZMAX, ZMAX, -1, 1);
+    }
+
+    normals.assign(n, glm::vec3(0.0f));
+    for (int i = 0; i < cloth->get_n_triangles(); i++) {
+        /*
+               a
+                +
+                |\         norm ^
+                | \            |
+                |  \           | 
+                +---+          *
+               b     c       
+
+        */
+        int ia = cloth->triangles[3 * i];
+        int ib = cloth->triangles[3 * i + 1];
+        int ic = cloth->triangles[3 * i + 2];
+
+        glm::vec3 a = glm::vec3(cloth->get_pos_x(ia), cloth->get_pos_y(ia), cloth->get_pos_z(ia));
+        glm::vec3 b = glm::vec3(cloth->get_pos_x(ib), cloth->get_pos_y(ib), cloth->get_pos_z(ib));
+        glm::vec3 c = glm::vec3(cloth->get_pos_x(ic), cloth->get_pos_y(ic), cloth->get_pos_z(ic));
+
+        glm::vec3 normal = glm::cross(b - a, c - a);
+        normals[ia] += normal;
+        normals[ib] += normal;
+        normals[ic] += normal;
+    }
+
+    for (int i = 0; i < n; i++) {
+        vertices[8 * i + 3] = normals[i].x;
+        vertices[8 * i + 4] = normals[i].y;
+        vertices[8 * i + 5] = normals[i].z;
+    }
+}
+
+// Pins the highest points of a cloth, the ones within RESTING_DISTANCE of the top
+void pinTop(Cloth* cloth) {
+    double top = -INFINITY;
+    for (int i = 0; i < cloth->get_n_points(); i++)
+        top = max(top, cloth->get_pos_y(i));
+    std::vector<int> pinned;
+    for (int i = 0; i < cloth->get_n_points(); i++)
+        if (cloth->get_pos_y(i) > top - RESTING_DISTANCE)
+            pinned.push_back(i);
+    cloth->set_fixed(pinned, true);
+}
+
+// Returns the number of steps per frame of a solver
+int getUpdatesPerFrame(int solver_mode) {
+    return solver_mode == SOLVER_VERLET || solver_mode == SOLVER_GRID ||
+           solver_mode == SOLVER_TILED ? N_PHYSICS_UPDATE : N_IMPLICIT_UPDATE;
+}
+
+// Returns the number of constraint iterations (substeps for the small steps solver) per step of a solver
+int getIterations(int solver_mode) {
+    return solver_mode == SOLVER_SUBSTEP ? N_SMALL_STEPS : N_CONSTRAIN_SOLVE;
+}
+
 // Unpin all points except corners
-void unpinAll(PointMass* points[]) {
+void unpinAll(Cloth* cloth) {
     // Unfixing all points
     for (int i = 0; i < ROWS; i++)
-        for (int j = 0; j < COLS; j++) {
-            PointMass* point = points[i * COLS + j];
-            point->unfix_position();
-        }   
+        for (int j = 0; j < COLS; j++)
+            cloth->unfix_position(cloth->find_point(i * COLS + j));
 
     // Refixing corners
-    points[0]->fix_position();
-    points[COLS - 1]->fix_position();
-    points[COLS * (ROWS - 1)]->fix_position();
-    points[COLS * ROWS - 1]->fix_position();
+    cloth->fix_position(cloth->find_point(0));
+    cloth->fix_position(cloth->find_point(COLS - 1));
+    cloth->fix_position(cloth->find_point(COLS * (ROWS - 1)));
+    cloth->fix_position(cloth->find_point(COLS * ROWS - 1));
 }
 
-int main() {
-    srand((unsigned int)time(NULL));
-
-    PointMass* points[COLS * ROWS]{};
+// Adds to an empty cloth a flag of rows * cols points pinned by its top row, spanning the same area
+// whatever its resolution, the constraints being as much longer as the points are farther apart.
+// The flag is built at rest, every constraint resting at the distance its points start at
+void buildFlag(Cloth* cloth, int rows, int cols, Vec3d corner) {
+    // Spacing compared to the full resolution flag, along the rows and the columns
+    const double scale_x = (COLS - 1.0) / (cols - 1);
+    const double scale_y = (ROWS - 1.0) / (rows - 1);
 
     int i, j;
-    for (i = 0; i < ROWS; i++)
-        for (j = 0; j < COLS; j++) {
-            PointMass* pm = new PointMass{
-                j * 8.0 - 160,
-                i * -8.0 + 160,
-                0,
-                false,
-                1 + 1 * (int)(i > 0 && j > 0)
-            };
+    for (i = 0; i < rows; i++)
+        for (j = 0; j < cols; j++) {
+            int k = cloth->add_point(
+                j * RESTING_DISTANCE * scale_x + corner.get_x(),
+                i * -RESTING_DISTANCE * scale_y + corner.get_y(),
+                corner.get_z(),
+                false
+            );
             if (i > 0)
                 // Linking to above point
-                pm->add_neighbor(points[to1d_index(i - 1, j, COLS)]);
+                cloth->add_constraint(k, to1d_index(i - 1, j, cols), STRUCTURAL, RESTING_DISTANCE * scale_y);
             if (j > 0)
                 // Linking to left point
-                pm->add_neighbor(points[to1d_index(i, j - 1, COLS)]);
-            
-            points[i * COLS + j] = pm;
+                cloth->add_constraint(k, to1d_index(i, j - 1, cols), STRUCTURAL, RESTING_DISTANCE * scale_x);
         }   
 
-    // Fixing corners
-    // points[0]->fix_position();
-    // points[COLS - 1]->fix_position();
-    // points[COLS * (ROWS - 1)]->fix_position();
-    // points[COLS * ROWS - 1]->fix_position();
-
-    // Fixing top row
-    for (j = 0; j < COLS; j++)
-        points[j]->fix_position();
-    // Fixing bottom row
-    // for (j = 0; j < COLS; j++)
-    //     points[COLS * (ROWS - 1) + j]->fix_position();
-
-    int n_points = sizeof(points) / sizeof(PointMass*);
-    
-    // Array that containts the texture vertices data
-    float vertices[8 * n_points + 3]{}; // +3 to store data for crosshair
-
-    for (i = 0; i < ROWS; i++){
-        for(j = 0; j < COLS; j++){
-            int start_index = 8 * to1d_index(i, j, COLS);
-            vertices[start_index + 6] = map(points[i * COLS + j]->get_pos_x(),
-                                            points[0]->get_pos_x(), points[COLS - 1]->get_pos_x(),
-                                            0, 1);
-            vertices[start_index + 7] = map(points[i * COLS + j]->get_pos_y(),
-                                            points[0]->get_pos_y(), points[COLS * ROWS - 1]->get_pos_y(),
-                                            0, 1);
+    // Shear constraints, linking each point to its upper diagonal neighbours
+    const double diagonal = RESTING_DISTANCE * sqrt(scale_x * scale_x + scale_y * scale_y);
+    for (i = 1; i < rows; i++)
+        for (j = 0; j < cols; j++) {
+            int k = to1d_index(i, j, cols);
+            if (j > 0)
+                cloth->add_constraint(k, to1d_index(i - 1, j - 1, cols), SHEAR, diagonal);
+            if (j < cols - 1)
+                cloth->add_constraint(k, to1d_index(i - 1, j + 1, cols), SHEAR, diagonal);
+        }
+    // Bending constraints, linking each point to the ones two above and two on the left
+    for (i = 0; i < rows; i++)
+        for (j = 0; j < cols; j++) {
+            int k = to1d_index(i, j, cols);
+            if (i > 1)
+                cloth->add_constraint(k, to1d_index(i - 2, j, cols), BENDING, RESTING_DISTANCE * 2 * scale_y);
+            if (j > 1)
+                cloth->add_constraint(k, to1d_index(i, j - 2, cols), BENDING, RESTING_DISTANCE * 2 * scale_x);
         }
 
-    }
-
-    // 3 indices (each referring to a (x, y, z) vertex in vertices[])
-    // for each of the 2 triangles needed to draw a rectangle using 4 points
-    unsigned int indices[3 * 2 * (COLS - 1) * (ROWS - 1)]{}; 
-    
-    for (i = 0; i < ROWS - 1; i++)
-        for (j = 0; j < COLS - 1; j++) {
+    // Surface triangles, rendered and used by the collisions of the cloth with itself
+    for (i = 0; i < rows - 1; i++)
+        for (j = 0; j < cols - 1; j++) {
 
             /*
             Cloth will be rendered using triangles following this pattern,
-            points are stored in a flattened version of this grid matrix (points[])
+            points are stored in a flattened version of this grid matrix (cloth arrays)
             
             +-+-+-+-+       p0 +----+ p1
             |/|/|/|/|          |  / |
@@ -148,16 +239,168 @@ int main() {
 
             */
 
-            int start_index = 6 * to1d_index(i, j, COLS - 1);
-            // Triangle (p0, p1, p2)
-            indices[start_index    ] = to1d_index(i    , j    , COLS);
-            indices[start_index + 1] = to1d_index(i    , j + 1, COLS);
-            indices[start_index + 2] = to1d_index(i + 1, j    , COLS);
+            // Triangle (p0, p2, p1)
+            cloth->add_triangle(to1d_index(i, j, cols), to1d_index(i + 1, j, cols), to1d_index(i, j + 1, cols));
             // Triangle (p1, p2, p3)
-            indices[start_index + 3] = to1d_index(i    , j + 1, COLS);
-            indices[start_index + 4] = to1d_index(i + 1, j    , COLS);
-            indices[start_index + 5] = to1d_index(i + 1, j + 1, COLS);
+            cloth->add_triangle(to1d_index(i, j + 1, cols), to1d_index(i + 1, j, cols), to1d_index(i + 1, j + 1, cols));
+        }
+
+    // Fixing corners
+    // cloth->fix_position(0);
+    // cloth->fix_position(cols - 1);
+    // cloth->fix_position(cols * (rows - 1));
+    // cloth->fix_position(cols * rows - 1);
+
+    // Fixing top row
+    for (j = 0; j < cols; j++)
+        cloth->fix_position(j);
+    // Fixing bottom row
+    // for (j = 0; j < cols; j++)
+    //     cloth->fix_position(cols * (rows - 1) + j);
+}
+
+int main(int argc, char** argv) {
+    srand((unsigned int)time(NULL));
+
+    // --snapshot <path> starts from a saved state of the cloth, --preroll <frames> <path> simulates
+    // the given number of frames headless and saves the state reached, without opening a window
+    const char* snapshot_path = nullptr;
+    const char* preroll_path = nullptr;
+    int n_preroll_frames = 0;
+    for (int a = 1; a < argc; a++)
+        if (strcmp(argv[a], "--snapshot") == 0 && a + 1 < argc)
+            snapshot_path = argv[++a];
+        else if (strcmp(argv[a], "--preroll") == 0 && a + 2 < argc) {
+            n_preroll_frames = atoi(argv[++a]);
+            preroll_path = argv[++a];
+        }
+
+    Cloth cloth;
+    // Texture coordinates of the points of the loaded mesh, in the order they were added
+    std::vector<float> mesh_uvs;
+
+    int i, j;
+    if (CLOTH_MESH[0]) {
+        // Already laid out for locality by the loader
+        load_obj_cloth(CLOTH_MESH, CLOTH_MESH_SCALE, CLOTH_MESH_POSITION, &cloth, &mesh_uvs);
+        pinTop(&cloth);
+    } else {
+        buildFlag(&cloth, ROWS, COLS, FLAG_CORNER);
+        if (REORDER_POINTS)
+            reorder_points(&cloth);
+    }
+
+    const int n_points = cloth.get_n_points();
+    // Room for the points the tears can add
+    const int max_points = n_points + (int)(n_points * TEAR_SPLIT_CAPACITY);
+    
+    // Array that containts the texture vertices data, a vertex per cloth point in the cloth order
+    std::vector<float> vertices(8 * max_points + 3); // +3 to store data for crosshair
+
+    for (i = 0; i < n_points && CLOTH_MESH[0]; i++) {
+        vertices[8 * cloth.find_point(i) + 6] = mesh_uvs[2 * i];
+        vertices[8 * cloth.find_point(i) + 7] = mesh_uvs[2 * i + 1];
+    }
+    for (i = 0; i < ROWS && !CLOTH_MESH[0]; i++){
+        for(j = 0; j < COLS; j++){
+            int start_index = 8 * cloth.find_point(to1d_index(i, j, COLS));
+            vertices[start_index + 6] = map(cloth.get_pos_x(cloth.find_point(i * COLS + j)),
+                                            cloth.get_pos_x(cloth.find_point(0)),
+                                            cloth.get_pos_x(cloth.find_point(COLS - 1)),
+                                            0, 1);
+            vertices[start_index + 7] = map(cloth.get_pos_y(cloth.find_point(i * COLS + j)),
+                                            cloth.get_pos_y(cloth.find_point(0)),
+                                            cloth.get_pos_y(cloth.find_point(COLS * ROWS - 1)),
+                                            0, 1);
+        }
+
+    }
+    // Points having their texture coordinates set, the ones split by tears take those of their source
+    int n_textured = n_points;
+
+    // Registering the forces acting on the cloth
+    float gravity = -10.0f;
+    ForceField forces;
+    int gravity_force = forces.add_gravity(Vec3d{ 0, gravity, 0 });
+    int wind_force = forces.add_wind(1, 1);
+    int drag_force = forces.add_drag(0);
+    int vortex_force = forces.add_vortex(Vec3d{ 0, 0, 0 }, Vec3d{ 0, 1, 0 }, 200, 250);
+    forces.vortices[vortex_force].enabled = false;
+    int solver_mode = SOLVER_VERLET;
+    Tethers tethers;
+    SelfCollisions self_collisions;
+    Tearing tearing;
+    // Smooth surface drawn in place of the cloth triangles, and whether the element buffer holds its triangles
+    LoopSubdivision subdivision;
+    int subdivision_levels = 0;
+    std::vector<float> refined_vertices;
+    bool refined_indices_loaded = false;
+    // Radius of the points picked around the hit spot, 0 picks a single point
+    float brush_radius = 0.0f;
+    // Obstacles for the cloth
+    Colliders colliders;
+    float sphere_z = 40.0f;
+    int sphere_collider = colliders.add_sphere(Vec3d{ 0, -80, sphere_z }, 60);
+    colliders.spheres[sphere_collider].enabled = false;
+    colliders.add_plane(Vec3d{ 0, 1, 0 }, -YMAX);
+
+    // Starting from a saved state and the settings it was reached with, the texture coordinates
+    // being those of the cloth as built, the points split by tears taking those of their source.
+    // Its velocities only hold for the time step, the iterations and the damping it was saved with
+    if (snapshot_path) {
+        Cloth saved;
+        std::vector<int> sources;
+        SnapshotParameters parameters;
+        if (!load_snapshot(snapshot_path, &saved, &sources, &parameters) ||
+            saved.get_n_points() < n_points || saved.get_n_points() > max_points)
+            fprintf(stderr, "Can't start from snapshot %s\n", snapshot_path);
+        else if (parameters.dt != SECONDSPERFRAME / getUpdatesPerFrame(parameters.solver_mode) ||
+                 parameters.n_iterations != getIterations(parameters.solver_mode) || parameters.damping != DAMPING)
+            fprintf(stderr, "Can't start from snapshot %s, saved with another time step, iteration count or damping\n",
+                    snapshot_path);
+        else {
+            cloth = saved;
+            tearing.set_sources(sources);
+            solver_mode = parameters.solver_mode;
+            gravity = parameters.gravity;
+            forces.gravities[gravity_force].acceleration = Vec3d{ 0, gravity, 0 };
+            forces.winds[wind_force].strength = parameters.wind_strength;
+            forces.winds[wind_force].octaves = parameters.wind_octaves;
+            forces.drags[drag_force].coefficient = parameters.drag;
+            tethers.enabled = parameters.tethers;
+            self_collisions.enabled = parameters.self_collisions;
+            tearing.enabled = parameters.tearing;
+            tearing.max_stretch = parameters.tear_stretch;
+        }
+    }
+
+    // Simulating headless with the current settings, then saving the state reached along with them
+    if (preroll_path) {
+        const int n_updates = getUpdatesPerFrame(solver_mode);
+        for (int frame = 0; frame < n_preroll_frames; frame++)
+            for (i = 0; i < n_updates; i++)
+                simulate(&cloth, &forces, &tethers, &colliders, &self_collisions, &tearing, (SolverMode)solver_mode, COLS,
+                         getIterations(solver_mode), SECONDSPERFRAME / n_updates,
+                         (frame + (double)i / n_updates) * SECONDSPERFRAME);
+        SnapshotParameters parameters;
+        parameters.dt = SECONDSPERFRAME / n_updates;
+        parameters.solver_mode = solver_mode;
+        parameters.n_iterations = getIterations(solver_mode);
+        parameters.gravity = gravity;
+        parameters.wind_strength = forces.winds[wind_force].strength;
+        parameters.wind_octaves = forces.winds[wind_force].octaves;
+        parameters.drag = forces.drags[drag_force].coefficient;
+        parameters.tethers = tethers.enabled;
+        parameters.self_collisions = self_collisions.enabled;
+        parameters.tearing = tearing.enabled;
+        parameters.tear_stretch = tearing.max_stretch;
+        if (!save_snapshot(&cloth, tearing.get_sources(cloth.get_n_points()), parameters, preroll_path)) {
+            fprintf(stderr, "Can't save snapshot %s\n", preroll_path);
+            return 1;
         }
+        printf("Saved the cloth after %d frames in %s\n", n_preroll_frames, preroll_path);
+        return 0;
+    }
 
     GLFWwindow* window = createWindow(WINDOW_WIDTH, WINDOW_HEIGHT);
     if (!window || !loadGlad())
@@ -172,8 +415,8 @@ int main() {
     unsigned int VBO = getVBO();
     unsigned int EBO = getEBO();
 
-    // Load the vertex indices inside of the element buffer object
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), indices, GL_DYNAMIC_DRAW);
+    // Load the vertex indices inside of the element buffer object, the triangles of the cloth
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, cloth.triangles.size() * sizeof(unsigned int), cloth.triangles.data(), GL_DYNAMIC_DRAW);
 
     // Wireframe mode
     glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
@@ -208,7 +451,49 @@ int main() {
     // Initialize the state for the GUI
     ImGuiState* GUIState = new ImGuiState();
 
-    float gravity = -10.0f;
+    // Strands growing outwards from random spots of the upper part of the sphere
+    Hair hair;
+    for (i = 0; i < N_HAIR_STRANDS; i++) {
+        double phi = 2 * M_PI * rand() / RAND_MAX;
+        double cos_theta = 0.3 + 0.7 * rand() / RAND_MAX;
+        double sin_theta = sqrt(1 - cos_theta * cos_theta);
+        Vec3d normal{ sin_theta * cos(phi), cos_theta, sin_theta * sin(phi) };
+        SphereCollider& sphere = colliders.spheres[sphere_collider];
+        hair.add_strand(sphere.center + normal * (sphere.radius + 1), normal, HAIR_LENGTH);
+    }
+    // Center of the sphere the roots are on
+    Vec3d hair_center = colliders.spheres[sphere_collider].center;
+    std::vector<float> hair_vertices(4 * hair.points.get_n_points());
+    unsigned int hairShaderProgram = getHairShaderProgram();
+    unsigned int hairVBO;
+    unsigned int hairVAO = getHairVAO(&hairVBO);
+    SoftBody soft_body;
+    soft_body.build_lattice(SOFT_BODY_SIZE, SOFT_BODY_SIZE, SOFT_BODY_SIZE, RESTING_DISTANCE, SOFT_BODY_POSITION);
+    std::vector<float> soft_body_vertices(8 * soft_body.points.get_n_points());
+    unsigned int softBodyVBO;
+    unsigned int softBodyVAO = getMeshVAO(&softBodyVBO, (const unsigned int*)soft_body.points.triangles.data(),
+                                          soft_body.points.triangles.size());
+    // The far flags and the soft body are drawn as meshes, with their own vertex buffers
+    std::vector<ClothLOD> far_flags(N_FAR_FLAGS);
+    std::vector<std::vector<float>> far_flag_vertices(N_FAR_FLAGS);
+    std::vector<unsigned int> meshVAOs(N_FAR_FLAGS + 1), meshVBOs(N_FAR_FLAGS);
+    std::vector<int> nMeshIndices(N_FAR_FLAGS + 1, 0);
+    bool far_flags_enabled = false;
+    for (int f = 0; f < N_FAR_FLAGS; f++) {
+        Vec3d corner = FLAG_CORNER;
+        corner += Vec3d{ (f - (N_FAR_FLAGS - 1) / 2.0) * FAR_FLAGS_SPACING, 0, -2 * FAR_FLAGS_SPACING * (f + 1) };
+        far_flags[f].build(ROWS, COLS, [&](Cloth* level, int rows, int cols) {
+            buildFlag(level, rows, cols, corner);
+        });
+        // The indices are loaded with the vertices of the first level used
+        meshVAOs[f] = getMeshVAO(&meshVBOs[f], nullptr, 0);
+    }
+    meshVAOs[N_FAR_FLAGS] = softBodyVAO;
+    MeshSDF mesh_sdf;
+    if (COLLIDER_MESH[0]) {
+        mesh_sdf.build(load_obj_mesh(COLLIDER_MESH, COLLIDER_MESH_SCALE));
+        colliders.add_mesh(&mesh_sdf, COLLIDER_MESH_POSITION);
+    }
     // // Setting light source pos
     int modelLoc = glGetUniformLocation(shaderProgram, "lightPos");
     glUniform3f(modelLoc, 0.0, 0.0, 3.0);
@@ -230,80 +515,129 @@ int main() {
             glUniformMatrix3fv(modelLoc, 1, GL_FALSE, glm::value_ptr(camera.get_pos()));
         }
         
-        for (i = 0; i < N_PHYSICS_UPDATE; i++)
+        int n_updates = getUpdatesPerFrame(solver_mode);
+        int n_iterations = getIterations(solver_mode);
+        handle_mouse(&cloth, &forces, &mouse, &camera, !cursorEnabled, brush_radius);
+        for (i = 0; i < n_updates; i++)
             timestep(
-                points,
+                &cloth,
+                &forces,
+                &tethers,
+                &colliders,
+                &self_collisions,
+                &tearing,
+                (SolverMode)solver_mode,
                 COLS,
                 ROWS,
-                n_points,
-                N_CONSTRAIN_SOLVE,
-                SECONDSPERFRAME / N_PHYSICS_UPDATE,
-                &mouse,
-                &camera,
-                !cursorEnabled
+                n_iterations,
+                SECONDSPERFRAME / n_updates
             );
+        // The roots follow the sphere, and the hair takes the small verlet steps whatever the cloth solver
+        hair.move_roots(colliders.spheres[sphere_collider].center - hair_center);
+        hair_center = colliders.spheres[sphere_collider].center;
+        if (hair.enabled)
+            for (i = 0; i < N_PHYSICS_UPDATE; i++)
+                hair.simulate(&forces, &colliders, N_HAIR_ITERATIONS, SECONDSPERFRAME / N_PHYSICS_UPDATE, glfwGetTime());
+
+        if (soft_body.enabled)
+            for (i = 0; i < N_PHYSICS_UPDATE; i++)
+                soft_body.simulate(&forces, &colliders, N_CONSTRAIN_SOLVE, SECONDSPERFRAME / N_PHYSICS_UPDATE, glfwGetTime());
+
+        // Each far flag switching to the level of its distance from the camera before its steps
+        if (far_flags_enabled)
+            for (ClothLOD& flag : far_flags) {
+                flag.update(Vec3d(camera.get_pos() * (float)XMAX));
+                for (i = 0; i < N_PHYSICS_UPDATE; i++)
+                    flag.simulate(&forces, &colliders, N_CONSTRAIN_SOLVE, SECONDSPERFRAME / N_PHYSICS_UPDATE, glfwGetTime());
+            }
 
-        // Updating crosshair position -> todo: use another buffer to render crosshair
-        vertices[8 * n_points] = camera.get_pos().x + camera.get_direction().x;
-        vertices[8 * n_points + 1] = camera.get_pos().y + camera.get_direction().y;
-        vertices[8 * n_points + 2] = camera.get_pos().z + camera.get_direction().z;
+        // Mapping PointMass positions and normals
+        const int n_cloth_points = cloth.get_n_points();
+        mapPoints(&cloth, vertices.data());
+        for (; n_textured < n_cloth_points; n_textured++) {
+            int source = tearing.get_source(n_textured);
+            vertices[8 * n_textured + 6] = vertices[8 * source + 6];
+            vertices[8 * n_textured + 7] = vertices[8 * source + 7];
+        }
 
-        // printf("%f %f %f\n", camera.get_pos().x, camera.get_pos().y, camera.get_pos().z);
+        // Rendering the cloth smoothed by subdivision, or as it is
+        float* render_vertices = vertices.data();
+        unsigned long sizeof_render_vertices = vertices.size() * sizeof(float);
+        int n_render_points = n_cloth_points;
+        int n_render_indices = 3 * cloth.get_n_triangles();
+        if (subdivision_levels > 0) {
+            bool new_triangles = subdivision.refine(cloth.triangles, n_cloth_points, vertices.data(), subdivision_levels,
+                                                    cloth.topology_version, &refined_vertices);
+            n_render_points = subdivision.get_n_vertices();
+            n_render_indices = subdivision.get_triangles().size();
+            // Room for the crosshair
+            refined_vertices.resize(8 * n_render_points + 3);
+            render_vertices = refined_vertices.data();
+            sizeof_render_vertices = refined_vertices.size() * sizeof(float);
+            if (new_triangles || !refined_indices_loaded)
+                glBufferData(GL_ELEMENT_ARRAY_BUFFER, n_render_indices * sizeof(unsigned int),
+                             subdivision.get_triangles().data(), GL_DYNAMIC_DRAW);
+            refined_indices_loaded = true;
+        } else if (refined_indices_loaded) {
+            glBufferData(GL_ELEMENT_ARRAY_BUFFER, cloth.triangles.size() * sizeof(unsigned int), cloth.triangles.data(),
+                         GL_DYNAMIC_DRAW);
+            refined_indices_loaded = false;
+        }
 
-        // Mapping PointMass positions
-        for (j = 0; j < n_points; j++) {
-            double x = points[j]->get_pos_x();
-            double y = points[j]->get_pos_y();
-            double z = points[j]->get_pos_z();
+        // Updating crosshair position, right after the cloth vertices -> todo: use another buffer to render crosshair
+        render_vertices[8 * n_render_points] = camera.get_pos().x + camera.get_direction().x;
+        render_vertices[8 * n_render_points + 1] = camera.get_pos().y + camera.get_direction().y;
+        render_vertices[8 * n_render_points + 2] = camera.get_pos().z + camera.get_direction().z;
 
-            vertices[j * 8    ] = map(x, -XMAX, XMAX, -1, 1);
-            vertices[j * 8 + 1] = map(y, -YMAX, YMAX, -1, 1);
-            vertices[j * 8 + 2] = map(z, -ZMAX, ZMAX, -1, 1);
-        }
+        // printf("%f %f %f\n", camera.get_pos().x, camera.get_pos().y, camera.get_pos().z);
 
-        // Calculating vertex normal based on bottom and right vertexes
-        glm::vec3 normals[n_points]{};
-        for (i = 0; i < ROWS - 1; i++) {
-            for (j = 0; j < COLS - 1; j++) {
-                /*
-                   a     b         norm  
-                    +---+       ^   ^   ^
-                    |\ /|        \  |  /
-                    | \ |      ca \ | / db
-                    |/ \|          \|/
-                    +---+           *
-                   d     c         
-
-                */
-                int ia = to1d_index(i    , j    , COLS);
-                int ib = to1d_index(i    , j + 1, COLS);
-                int ic = to1d_index(i + 1, j + 1, COLS);
-                int id = to1d_index(i + 1, j    , COLS);
-
-                glm::vec3 a = glm::vec3(points[ia]->get_pos_x(), points[ia]->get_pos_y(), points[ia]->get_pos_z());
-                glm::vec3 b = glm::vec3(points[ib]->get_pos_x(), points[ib]->get_pos_y(), points[ib]->get_pos_z());
-                glm::vec3 c = glm::vec3(points[ic]->get_pos_x(), points[ic]->get_pos_y(), points[ic]->get_pos_z());
-                glm::vec3 d = glm::vec3(points[id]->get_pos_x(), points[id]->get_pos_y(), points[id]->get_pos_z());
-
-                glm::vec3 ca = c - a;
-                glm::vec3 db = d - b;
-
-                glm::vec3 normal = glm::cross(db, ca);
-                normals[ia] += normal;
-                normals[ib] += normal;
-                normals[ic] += normal;
-                normals[id] += normal;
+        // Updating the triangles split by tears, only the changed ranges of the element buffer (the refined
+        // triangles being all loaded again on tears)
+        tearing.flush_changed_triangles([&](int first, int count) {
+            if (!refined_indices_loaded)
+                glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, 3 * first * sizeof(unsigned int), 3 * count * sizeof(unsigned int),
+                                &cloth.triangles[3 * first]);
+        });
+
+        // Mapping the hair points, each one starting a segment but the tips
+        if (hair.enabled) {
+            for (j = 0; j < hair.points.get_n_points(); j++) {
+                hair_vertices[j * 4    ] = map(hair.points.get_pos_x(j), -XMAX, XMAX, -1, 1);
+                hair_vertices[j * 4 + 1] = map(hair.points.get_pos_y(j), -YMAX, YMAX, -1, 1);
+                hair_vertices[j * 4 + 2] = map(hair.points.get_pos_z(j), -ZMAX, ZMAX, -1, 1);
+                hair_vertices[j * 4 + 3] = (j + 1) % (HAIR_SEGMENTS + 1) != 0;
             }
+            loadVertices(hairVBO, hair_vertices.data(), hair_vertices.size() * sizeof(float));
         }
 
-        for (i = 0; i < n_points; i++) {
-            vertices[8 * i + 3] = normals[i].x;
-            vertices[8 * i + 4] = normals[i].y;
-            vertices[8 * i + 5] = normals[i].z;
+        if (soft_body.enabled) {
+            mapPoints(&soft_body.points, soft_body_vertices.data());
+            loadVertices(softBodyVBO, soft_body_vertices.data(), soft_body_vertices.size() * sizeof(float));
+        }
+        nMeshIndices[N_FAR_FLAGS] = soft_body.enabled ? 3 * soft_body.points.get_n_triangles() : 0;
+
+        for (int f = 0; f < N_FAR_FLAGS; f++) {
+            ClothLOD& flag = far_flags[f];
+            std::vector<float>& flag_vertices = far_flag_vertices[f];
+            nMeshIndices[f] = far_flags_enabled ? 3 * flag.get_cloth()->get_n_triangles() : 0;
+            if (!far_flags_enabled)
+                continue;
+            // New level, its triangles and the texture coordinates of its grid
+            if ((int)flag_vertices.size() != 8 * flag.get_cloth()->get_n_points()) {
+                flag_vertices.resize(8 * flag.get_cloth()->get_n_points());
+                for (i = 0; i < flag.get_rows(); i++)
+                    for (j = 0; j < flag.get_cols(); j++) {
+                        flag_vertices[8 * (i * flag.get_cols() + j) + 6] = (float)j / (flag.get_cols() - 1);
+                        flag_vertices[8 * (i * flag.get_cols() + j) + 7] = (float)i / (flag.get_rows() - 1);
+                    }
+                loadIndices(meshVAOs[f], (const unsigned int*)flag.get_cloth()->triangles.data(), nMeshIndices[f]);
+            }
+            mapPoints(flag.get_cloth(), flag_vertices.data());
+            loadVertices(meshVBOs[f], flag_vertices.data(), flag_vertices.size() * sizeof(float));
         }
 
         // Loading vertices into buffer
-        glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_DYNAMIC_DRAW);
+        glBufferData(GL_ARRAY_BUFFER, sizeof_render_vertices, render_vertices, GL_DYNAMIC_DRAW);
 
         // Start the Dear ImGui frame
         ImGui_ImplOpenGL3_NewFrame();
@@ -320,17 +654,62 @@ int main() {
             ImGui::Text("Graphical parameters.");               // Display some text (you can use a format strings too)
             //ImGui::Checkbox("Demo Window", &GUIState->show_helper_window);      // Edit bools storing our window open/close state
             ImGui::Checkbox("Wireframe", &GUIState->wireframe_enabled);
+            ImGui::SliderInt("Subdivision", &subdivision_levels, 0, SUBDIVISION_MAX_LEVELS);
             //ImGui::Checkbox("Another Window", &GUIState->show_another_window);
 
+            ImGui::RadioButton("Verlet", &solver_mode, SOLVER_VERLET);
+            ImGui::SameLine();
+            ImGui::RadioButton("Implicit", &solver_mode, SOLVER_IMPLICIT);
+            ImGui::SameLine();
+            ImGui::RadioButton("Projective", &solver_mode, SOLVER_PROJECTIVE);
+            ImGui::SameLine();
+            ImGui::RadioButton("Small steps", &solver_mode, SOLVER_SUBSTEP);
+            ImGui::SameLine();
+            ImGui::RadioButton("Grid", &solver_mode, SOLVER_GRID);
+            ImGui::SameLine();
+            ImGui::RadioButton("Tiled", &solver_mode, SOLVER_TILED);
+            ImGui::Checkbox("Tethers", &tethers.enabled);
+            ImGui::SliderFloat("Stiffness", &cloth.stiffness[STRUCTURAL], 0.0f, 1.0f);
+            ImGui::SliderFloat("Shear Stiffness", &cloth.stiffness[SHEAR], 0.0f, 1.0f);
+            ImGui::SliderFloat("Bending Stiffness", &cloth.stiffness[BENDING], 0.0f, 1.0f);
+            ImGui::Checkbox("Self collisions", &self_collisions.enabled);
+            ImGui::Checkbox("Tearing", &tearing.enabled);
+            ImGui::SliderFloat("Tear Stretch", &tearing.max_stretch, 1.1f, 4.0f);
+            ImGui::SliderFloat("Brush Radius", &brush_radius, 0.0f, 80.0f);
+            // The hair grows on the sphere collider, which is enabled along with it
+            if (ImGui::Checkbox("Hair", &hair.enabled) && hair.enabled)
+                colliders.spheres[sphere_collider].enabled = true;
+            ImGui::SliderFloat("Hair Bending Stiffness", &hair.bending_stiffness, 0.0f, 1.0f);
+            ImGui::Checkbox("Soft body", &soft_body.enabled);
+            ImGui::SliderFloat("Soft Body Volume Stiffness", &soft_body.volume_stiffness, 0.0f, 1.0f);
+            ImGui::Checkbox("Far flags", &far_flags_enabled);
+            if (far_flags_enabled) {
+                ImGui::SameLine();
+                ImGui::Text("levels");
+                for (const ClothLOD& flag : far_flags) {
+                    ImGui::SameLine();
+                    ImGui::Text("%d", flag.get_level());
+                }
+            }
+            if (ImGui::Checkbox("Sphere", &colliders.spheres[sphere_collider].enabled) && !colliders.spheres[sphere_collider].enabled)
+                hair.enabled = false;
+            ImGui::SliderFloat("Sphere Z", &sphere_z, -200.0f, 200.0f);
+            colliders.spheres[sphere_collider].center = Vec3d{ 0, -80, sphere_z };
+            ImGui::SliderFloat("Friction", &colliders.friction, 0.0f, 1.0f);
+
             ImGui::SliderFloat("Gravity", &gravity, -20.0f, 20.0f);
-            GRAVITY = Vec3d{0.0f, gravity, 0.0f};
+            forces.gravities[gravity_force].acceleration = Vec3d{0.0f, gravity, 0.0f};
 
-            ImGui::SliderFloat("Wind Strength", &WIND_STRENGTH_MULTIPLIER, 0.0f, 5.0f);
+            ImGui::SliderFloat("Wind Strength", &forces.winds[wind_force].strength, 0.0f, 5.0f);
+            ImGui::SliderInt("Wind Turbulence", &forces.winds[wind_force].octaves, 1, 8);
+            ImGui::SliderFloat("Air Drag", &forces.drags[drag_force].coefficient, 0.0f, 1.0f);
+            ImGui::Checkbox("Vortex", &forces.vortices[vortex_force].enabled);
+            ImGui::SliderFloat("Vortex Strength", &forces.vortices[vortex_force].strength, -1000.0f, 1000.0f);
             
             ImGui::SliderInt("Mouse Sensitivity", &camera.MOUSE_SENS, 1000, 20000);
 
             //if (ImGui::Button("Unpin all")) // Buttons return true when clicked (most widgets return true when edited/activated)
-            //    unpinAll(points);
+            //    unpinAll(&cloth);
             /*ImGui::SameLine();
             ImGui::Text("counter = %d", counter);*/
             if (ImGui::Button("Close"))
@@ -349,7 +728,9 @@ int main() {
             glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
         }
 
-        drawFrame(window, n_points, sizeof(indices) / sizeof(unsigned int), vertices, sizeof(vertices), shaderProgram, VAO);
+        drawFrame(window, n_render_points, n_render_indices, render_vertices, sizeof_render_vertices, shaderProgram, VAO,
+                  hair.enabled ? hair.points.get_n_points() - 1 : 0, hairShaderProgram, hairVAO,
+                  N_FAR_FLAGS + 1, nMeshIndices.data(), meshVAOs.data());
     }
 
     collectGarbage(VAO, VBO, shaderProgram);
@@ -0,0 +1,406 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "cloth.h"
+#include "parallel.h"
+#include "reorder.h"
+
+const int OBJ_CHUNK_SIZE = 1 << 20;     // Bytes of the file parsed by each parallel task
+const float OBJ_WELD_DISTANCE = 0.01;   // Vertices closer than this after scaling are merged in a single point
+
+// Vertices, texture coordinates and triangles read from a part of an OBJ file
+struct ObjChunk {
+    std::vector<float> positions, uvs; // 3 and 2 floats per vertex
+    // Position and texture coordinates (-1 if none) of each corner of the triangles, 3 per triangle
+    std::vector<int> corners, corner_uvs;
+    // Corners with negative indices, counting back from the last vertex read: they're stored relative
+    // to the first vertex of the chunk, the vertices of the previous chunks being added once known
+    std::vector<int> relative_corners, relative_corner_uvs;
+
+    // Parses the lines of [begin, end), which ends with a line break or the end of the file
+    void parse(const char* begin, const char* end) {
+        std::vector<int> face, face_uvs, face_relative, face_relative_uvs;
+        for (const char* p = begin; p < end; p = next_line(p, end)) {
+            if (p[0] == 'v' && (p[1] == ' ' || p[1] == '\t')) {
+                float v[3];
+                if (read_floats(p + 2, end, v, 3))
+                    positions.insert(positions.end(), v, v + 3);
+            } else if (p[0] == 'v' && p[1] == 't' && (p[2] == ' ' || p[2] == '\t')) {
+                float vt[2];
+                if (read_floats(p + 3, end, vt, 2))
+                    uvs.insert(uvs.end(), vt, vt + 2);
+            } else if (p[0] == 'f' && (p[1] == ' ' || p[1] == '\t')) {
+                // Corners are "v", "v/vt", "v//vn" or "v/vt/vn"
+                face.clear();
+                face_uvs.clear();
+                face_relative.clear();
+                face_relative_uvs.clear();
+                const char* c = p + 2;
+                while (true) {
+                    while (c < end && (*c == ' ' || *c == '\t'))
+                        c++;
+                    long v, vt = 0;
+                    if (c >= end || !read_int(&c, &v))
+                        break;
+                    if (*c == '/') {
+                        c++;
+                        if (*c != '/')
+                            read_int(&c, &vt);
+                        // Skipping the normal
+                        while (c < end && *c != ' ' && *c != '\t' && *c != '\n' && *c != '\r')
+                            c++;
+                    }
+                    face_relative.push_back(v < 0);
+                    face.push_back(v < 0 ? (long)positions.size() / 3 + v : v - 1);
+                    face_relative_uvs.push_back(vt < 0);
+                    face_uvs.push_back(vt < 0 ? (long)uvs.size() / 2 + vt : vt - 1);
+                }
+                // Polygons are split in fans of triangles
+                for (size_t k = 2; k < face.size(); k++)
+                    for (size_t corner : { (size_t)0, k - 1, k }) {
+                        if (face_relative[corner])
+                            relative_corners.push_back(corners.size());
+                        if (face_relative_uvs[corner])
+                            relative_corner_uvs.push_back(corner_uvs.size());
+                        corners.push_back(face[corner]);
+                        corner_uvs.push_back(face_uvs[corner]);
+                    }
+            }
+        }
+    }
+
+    private:
+        // Reads n floats, returns whether there were n
+        static bool read_floats(const char* p, const char* end, float* values, int n) {
+            for (int k = 0; k < n; k++) {
+                while (p < end && (*p == ' ' || *p == '\t'))
+                    p++;
+                if (p >= end || !read_float(&p, &values[k]))
+                    return false;
+            }
+            return true;
+        }
+
+        // Reads an integer at p and moves p past it, returns whether there was one
+        static bool read_int(const char** p, long* value) {
+            const char* c = *p;
+            const bool negative = *c == '-';
+            if (*c == '-' || *c == '+')
+                c++;
+            if (*c < '0' || *c > '9')
+                return false;
+            long magnitude = 0;
+            for (; *c >= '0' && *c <= '9'; c++)
+                magnitude = 10 * magnitude + (*c - '0');
+            *value = negative ? -magnitude : magnitude;
+            *p = c;
+            return true;
+        }
+
+        // Reads a decimal number at p and moves p past it, returns whether there was one.
+        // Faster than strtof, which goes through the locale, and exact to the float precision
+        static bool read_float(const char** p, float* value) {
+            const char* c = *p;
+            const bool negative = *c == '-';
+            if (*c == '-' || *c == '+')
+                c++;
+            uint64_t mantissa = 0;
+            int exponent = 0, n_digits = 0;
+            for (; *c >= '0' && *c <= '9'; c++, n_digits++)
+                if (mantissa < (1ull << 60) / 10)
+                    mantissa = 10 * mantissa + (*c - '0');
+                else
+                    exponent++;
+            if (*c == '.')
+                for (c++; *c >= '0' && *c <= '9'; c++, n_digits++)
+                    if (mantissa < (1ull << 60) / 10) {
+                        mantissa = 10 * mantissa + (*c - '0');
+                        exponent--;
+                    }
+            if (n_digits == 0)
+                return false;
+            if (*c == 'e' || *c == 'E') {
+                long e;
+                c++;
+                if (read_int(&c, &e))
+                    exponent += e;
+            }
+            // Exact powers of ten for the usual exponents
+            static const double POWERS[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+                                             1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+            const double magnitude = exponent >= 0 && exponent <= 22 ? mantissa * POWERS[exponent] :
+                                     exponent < 0 && exponent >= -22 ? mantissa / POWERS[-exponent] :
+                                     mantissa * pow(10.0, exponent);
+            *value = negative ? -magnitude : magnitude;
+            *p = c;
+            return true;
+        }
+
+        static const char* next_line(const char* p, const char* end) {
+            while (p < end && *p != '\n')
+                p++;
+            return p + 1;
+        }
+};
+
+// Loads an OBJ mesh as a cloth: its vertices closer than OBJ_WELD_DISTANCE
+// are welded, each edge of its triangles becomes a structural constraint and
+// each pair of triangles sharing an edge a bending constraint between their
+// opposite points, all resting at their length in the file. uvs gets the
+// texture coordinates of each point, 2 floats per point in the order they were
+// added (Cloth::find_point() gives their index once reordered): the ones of the
+// first corner on the point in the file, or a projection on the two widest
+// axes of the mesh if it has none. The file is read at once and parsed by
+// parallel tasks, a chunk of lines each, and the points are then laid out along
+// a space filling curve before the constraints are built. Polygons are split
+// in fans of triangles.
+void load_obj_cloth(const char* path, float scale, Vec3d position, Cloth* cloth, std::vector<float>* uvs) {
+    FILE* file = fopen(path, "rb");
+    if (!file)
+        throw std::runtime_error{ std::string("Can't open mesh ") + path };
+    fseek(file, 0, SEEK_END);
+    const long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    // Null terminated, the number parsing stopping there at the latest
+    std::string text(size, '\0');
+    const bool read = fread(&text[0], 1, size, file) == (size_t)size;
+    fclose(file);
+    if (!read)
+        throw std::runtime_error{ std::string("Can't read mesh ") + path };
+
+    // Chunks of lines, cut at the first line break after each OBJ_CHUNK_SIZE bytes
+    const char* end = text.data() + size;
+    std::vector<const char*> cuts = { text.data() };
+    while (cuts.back() < end) {
+        const char* cut = std::min(cuts.back() + OBJ_CHUNK_SIZE, end);
+        while (cut < end && cut[-1] != '\n')
+            cut++;
+        cuts.push_back(cut);
+    }
+    const int n_chunks = cuts.size() - 1;
+    std::vector<ObjChunk> chunks(n_chunks);
+    get_thread_pool().run(n_chunks, [&](int c) {
+        chunks[c].parse(cuts[c], cuts[c + 1]);
+    });
+
+    // Gathering the chunks in parallel, offsetting their indices by the vertices of the previous ones
+    std::vector<size_t> first_positions(n_chunks + 1, 0), first_uvs(n_chunks + 1, 0), first_corners(n_chunks + 1, 0);
+    for (int c = 0; c < n_chunks; c++) {
+        first_positions[c + 1] = first_positions[c] + chunks[c].positions.size();
+        first_uvs[c + 1] = first_uvs[c] + chunks[c].uvs.size();
+        first_corners[c + 1] = first_corners[c] + chunks[c].corners.size();
+    }
+    std::vector<float> positions(first_positions[n_chunks]), file_uvs(first_uvs[n_chunks]);
+    std::vector<int> corners(first_corners[n_chunks]), corner_uvs(first_corners[n_chunks]);
+    get_thread_pool().run(n_chunks, [&](int c) {
+        ObjChunk& chunk = chunks[c];
+        for (int k : chunk.relative_corners)
+            chunk.corners[k] += first_positions[c] / 3;
+        for (int k : chunk.relative_corner_uvs)
+            chunk.corner_uvs[k] += first_uvs[c] / 2;
+        for (size_t k = 0; k < chunk.positions.size(); k++)
+            positions[first_positions[c] + k] = chunk.positions[k] * scale;
+        std::copy(chunk.uvs.begin(), chunk.uvs.end(), file_uvs.begin() + first_uvs[c]);
+        std::copy(chunk.corners.begin(), chunk.corners.end(), corners.begin() + first_corners[c]);
+        std::copy(chunk.corner_uvs.begin(), chunk.corner_uvs.end(), corner_uvs.begin() + first_corners[c]);
+        chunk = ObjChunk();
+    });
+    const int n_vertices = positions.size() / 3;
+
+    // Welding the vertices closer than OBJ_WELD_DISTANCE. The vertices are counting sorted by the hash
+    // of their cell in a grid twice that size, cells sharing a hash only adding vertices to compare
+    const float cell_size = 2 * OBJ_WELD_DISTANCE;
+    int n_buckets = 1;
+    while (n_buckets < n_vertices)
+        n_buckets *= 2;
+    auto cell_bucket = [&](long long x, long long y, long long z) {
+        return (int)(((uint64_t)x * 73856093 ^ (uint64_t)y * 19349663 ^ (uint64_t)z * 83492791) & (n_buckets - 1));
+    };
+    std::vector<int> buckets(n_vertices);
+    parallel_for(n_vertices, [&](int begin, int end) {
+        for (int v = begin; v < end; v++)
+            buckets[v] = cell_bucket((long long)std::floor(positions[3 * v] / cell_size),
+                                     (long long)std::floor(positions[3 * v + 1] / cell_size),
+                                     (long long)std::floor(positions[3 * v + 2] / cell_size));
+    });
+    std::vector<int> cell_start(n_buckets + 1, 0);
+    for (int v = 0; v < n_vertices; v++)
+        cell_start[buckets[v] + 1]++;
+    for (int b = 0; b < n_buckets; b++)
+        cell_start[b + 1] += cell_start[b];
+    // Vertices of each bucket, in the order of the file
+    std::vector<int> sorted(n_vertices);
+    {
+        std::vector<int> filled(cell_start.begin(), cell_start.end() - 1);
+        for (int v = 0; v < n_vertices; v++)
+            sorted[filled[buckets[v]]++] = v;
+    }
+    // Each vertex goes to the point of the first vertex before it within the distance, or
+    // becomes one, the points being numbered in the order of the file. Those are in the 2 x 2 x 2
+    // cells around the corner nearest to the vertex, the first one of each bucket being the only candidate
+    std::vector<int> points(n_vertices);
+    parallel_for(n_vertices, [&](int begin, int end) {
+        for (int v = begin; v < end; v++) {
+            points[v] = v;
+            long long corner[3];
+            for (int a = 0; a < 3; a++)
+                corner[a] = (long long)std::floor(positions[3 * v + a] / cell_size - 0.5f);
+            for (int n = 0; n < 8; n++) {
+                const int b = cell_bucket(corner[0] + n % 2, corner[1] + n / 2 % 2, corner[2] + n / 4);
+                for (int k = cell_start[b]; k < cell_start[b + 1] && sorted[k] < points[v]; k++) {
+                    const int u = sorted[k];
+                    float distance2 = 0;
+                    for (int a = 0; a < 3; a++)
+                        distance2 += (positions[3 * u + a] - positions[3 * v + a]) * (positions[3 * u + a] - positions[3 * v + a]);
+                    if (distance2 < OBJ_WELD_DISTANCE * OBJ_WELD_DISTANCE) {
+                        points[v] = u;
+                        break;
+                    }
+                }
+            }
+        }
+    });
+    int n_points = 0;
+    for (int v = 0; v < n_vertices; v++)
+        points[v] = points[v] == v ? n_points++ : points[points[v]];
+
+    *cloth = Cloth();
+    cloth->reserve_points(n_points);
+    for (int v = 0; v < n_vertices; v++)
+        if (points[v] == cloth->get_n_points())
+            cloth->add_point(positions[3 * v] + position.get_x(), positions[3 * v + 1] + position.get_y(),
+                             positions[3 * v + 2] + position.get_z(), false);
+
+    // Triangles between three different points, and the texture coordinates of their corners
+    std::vector<int> triangles;
+    triangles.reserve(corners.size());
+    uvs->assign(2 * n_points, NAN);
+    for (size_t t = 0; t + 2 < corners.size(); t += 3) {
+        bool valid = true;
+        for (int k = 0; k < 3; k++)
+            valid &= corners[t + k] >= 0 && corners[t + k] < n_vertices;
+        if (!valid)
+            continue;
+        const int a = points[corners[t]], b = points[corners[t + 1]], c = points[corners[t + 2]];
+        if (a == b || b == c || c == a)
+            continue;
+        triangles.insert(triangles.end(), { a, b, c });
+        for (int k = 0; k < 3; k++) {
+            const int point = points[corners[t + k]], uv = corner_uvs[t + k];
+            if (std::isnan((*uvs)[2 * point]) && uv >= 0 && uv < (int)file_uvs.size() / 2) {
+                (*uvs)[2 * point] = file_uvs[2 * uv];
+                // OBJ texture coordinates start from the bottom, the images from the top
+                (*uvs)[2 * point + 1] = 1 - file_uvs[2 * uv + 1];
+            }
+        }
+    }
+
+    // Points with no texture coordinates, projected on the two widest axes of the mesh
+    double low[3] = { INFINITY, INFINITY, INFINITY };
+    double high[3] = { -INFINITY, -INFINITY, -INFINITY };
+    for (int i = 0; i < n_points; i++) {
+        const double p[3] = { cloth->x[i], cloth->y[i], cloth->z[i] };
+        for (int a = 0; a < 3; a++) {
+            low[a] = std::min(low[a], p[a]);
+            high[a] = std::max(high[a], p[a]);
+        }
+    }
+    int axes[3] = { 0, 1, 2 };
+    std::sort(axes, axes + 3, [&](int a, int b) { return high[a] - low[a] > high[b] - low[b]; });
+    for (int i = 0; i < n_points; i++)
+        if (std::isnan((*uvs)[2 * i])) {
+            const double p[3] = { cloth->x[i], cloth->y[i], cloth->z[i] };
+            (*uvs)[2 * i] = (p[axes[0]] - low[axes[0]]) / std::max(high[axes[0]] - low[axes[0]], 0.00001);
+            (*uvs)[2 * i + 1] = (high[axes[1]] - p[axes[1]]) / std::max(high[axes[1]] - low[axes[1]], 0.00001);
+        }
+
+    // The points are laid out along a space filling curve before the constraints are built, so that
+    // the structural ones come out sorted by their lowest point and the bending ones by the lowest
+    // point of their edge, without sorting the constraints
+    cloth->triangles.swap(triangles);
+    reorder_points(cloth);
+
+    // Sides of the triangles bucketed by their lowest point, the sides of an edge landing in the same bucket
+    const int n_triangles = cloth->get_n_triangles();
+    std::vector<int> bucket_start(n_points + 1, 0);
+    for (int t = 0; t < n_triangles; t++)
+        for (int s = 0; s < 3; s++)
+            bucket_start[std::min(cloth->triangles[3 * t + s], cloth->triangles[3 * t + (s + 1) % 3]) + 1]++;
+    for (int i = 0; i < n_points; i++)
+        bucket_start[i + 1] += bucket_start[i];
+    // Highest point of each side, and the third point of its triangle
+    std::vector<int> side_ends(bucket_start[n_points]), side_opposites(bucket_start[n_points]);
+    std::vector<int> filled(bucket_start.begin(), bucket_start.end() - 1);
+    for (int t = 0; t < n_triangles; t++)
+        for (int s = 0; s < 3; s++) {
+            const int a = cloth->triangles[3 * t + s], b = cloth->triangles[3 * t + (s + 1) % 3];
+            const int k = filled[std::min(a, b)]++;
+            side_ends[k] = std::max(a, b);
+            side_opposites[k] = cloth->triangles[3 * t + (s + 2) % 3];
+        }
+    // Each bucket (stably) sorted by highest point, the sides of an edge then following each other
+    parallel_for(n_points, [&](int begin, int end) {
+        for (int a = begin; a < end; a++)
+            for (int k = bucket_start[a] + 1; k < bucket_start[a + 1]; k++)
+                for (int q = k; q > bucket_start[a] && side_ends[q - 1] > side_ends[q]; q--) {
+                    std::swap(side_ends[q - 1], side_ends[q]);
+                    std::swap(side_opposites[q - 1], side_opposites[q]);
+                }
+    });
+
+    // A structural constraint at the first side of each edge, a bending one between the opposite
+    // points of the edges of two triangles (the ones shared by more don't bend around a single axis).
+    // They're counted for each bucket, then filled in place in parallel, the cloth having none yet
+    auto for_each_edge = [&](int a, auto edge) {
+        for (int k = bucket_start[a]; k < bucket_start[a + 1];) {
+            int n_sides = 1;
+            while (k + n_sides < bucket_start[a + 1] && side_ends[k + n_sides] == side_ends[k])
+                n_sides++;
+            edge(k, n_sides == 2 && side_opposites[k] != side_opposites[k + 1]);
+            k += n_sides;
+        }
+    };
+    std::vector<int> structural_start(n_points + 1, 0), bending_start(n_points + 1, 0);
+    parallel_for(n_points, [&](int begin, int end) {
+        for (int a = begin; a < end; a++)
+            for_each_edge(a, [&](int, bool bends) {
+                structural_start[a + 1]++;
+                bending_start[a + 1] += bends;
+            });
+    });
+    for (int a = 0; a < n_points; a++) {
+        structural_start[a + 1] += structural_start[a];
+        bending_start[a + 1] += bending_start[a];
+    }
+    const int n_structural = structural_start[n_points], n_constraints = n_structural + bending_start[n_points];
+    cloth->constraint_a.resize(n_constraints);
+    cloth->constraint_b.resize(n_constraints);
+    cloth->constraint_rest.resize(n_constraints);
+    for (int type = STRUCTURAL + 1; type <= N_CONSTRAINT_TYPES; type++)
+        cloth->constraint_start[type] = type > BENDING ? n_constraints : n_structural;
+    auto set_constraint = [&](int c, int a, int b) {
+        const double dx = cloth->x[b] - cloth->x[a], dy = cloth->y[b] - cloth->y[a], dz = cloth->z[b] - cloth->z[a];
+        cloth->constraint_a[c] = a;
+        cloth->constraint_b[c] = b;
+        cloth->constraint_rest[c] = sqrt(dx * dx + dy * dy + dz * dz);
+    };
+    parallel_for(n_points, [&](int begin, int end) {
+        for (int a = begin; a < end; a++) {
+            int structural = structural_start[a], bending = n_structural + bending_start[a];
+            for_each_edge(a, [&](int k, bool bends) {
+                set_constraint(structural++, a, side_ends[k]);
+                if (bends)
+                    set_constraint(bending++, side_opposites[k], side_opposites[k + 1]);
+            });
+        }
+    });
+    cloth->topology_version++;
+}
@@ -0,0 +1,148 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Number of items processed by each parallel task, fixed so that chunking
+// (and so the order of floating point reductions) doesn't depend on the
+// number of cores
+const int PARALLEL_GRAIN = 512;
+
+// A pool of worker threads created once and reused by every parallel loop,
+// the calling thread takes part in the work too.
+// Tasks must not start parallel loops themselves.
+struct ThreadPool {
+    explicit ThreadPool(int n_threads) {
+        set_n_threads(n_threads);
+    }
+
+    ~ThreadPool() {
+        stop_workers();
+    }
+
+    // Replaces the workers so that the tasks run on n_threads threads, including
+    // the caller. Must not be called while tasks are running
+    void set_n_threads(int n_threads) {
+        stop_workers();
+        for (int i = 1; i < n_threads; i++)
+            workers.emplace_back(&ThreadPool::work, this, generation);
+    }
+
+    // Returns the number of threads running the tasks, including the caller
+    int get_n_threads() const {
+        return workers.size() + 1;
+    }
+
+    // Runs task(i) for each i in [0, n_tasks), returns when all are done
+    void run(int n_tasks, const std::function<void(int)>& task) {
+        if (workers.empty() || n_tasks <= 1) {
+            for (int i = 0; i < n_tasks; i++)
+                task(i);
+            return;
+        }
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            current_task = &task;
+            this->n_tasks = n_tasks;
+            next_task = 0;
+            n_busy = workers.size();
+            generation++;
+        }
+        wake.notify_all();
+        execute();
+
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [this] { return n_busy == 0; });
+        current_task = nullptr;
+    }
+
+    private:
+        std::vector<std::thread> workers;
+        std::mutex mutex;
+        std::condition_variable wake;
+        std::condition_variable done;
+        const std::function<void(int)>* current_task = nullptr;
+        int n_tasks = 0;
+        std::atomic<int> next_task{ 0 };
+        int n_busy = 0;
+        unsigned generation = 0;
+        bool stopping = false;
+
+        // Takes tasks until none are left
+        void execute() {
+            int i;
+            while ((i = next_task.fetch_add(1)) < n_tasks)
+                (*current_task)(i);
+        }
+
+        // Ends the workers, which are waiting for tasks
+        void stop_workers() {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            wake.notify_all();
+            for (std::thread& worker : workers)
+                worker.join();
+            workers.clear();
+            stopping = false;
+        }
+
+        // Runs the tasks of each generation after seen_generation, the one current when the worker started
+        void work(unsigned seen_generation) {
+            while (true) {
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    wake.wait(lock, [&] { return stopping || generation != seen_generation; });
+                    if (stopping)
+                        return;
+                    seen_generation = generation;
+                }
+                execute();
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    if (--n_busy == 0)
+                        done.notify_one();
+                }
+            }
+        }
+};
+
+// Returns the pool shared by the whole program, one thread per core
+ThreadPool& get_thread_pool() {
+    static ThreadPool pool(std::max(1u, std::thread::hardware_concurrency()));
+    return pool;
+}
+
+// Returns the number of PARALLEL_GRAIN sized chunks covering n items
+int get_n_chunks(int n) {
+    return (n + PARALLEL_GRAIN - 1) / PARALLEL_GRAIN;
+}
+
+// Calls fn(begin, end) on chunks of [0, n) in parallel
+void parallel_for(int n, const std::function<void(int, int)>& fn) {
+    get_thread_pool().run(get_n_chunks(n), [&](int chunk) {
+        int begin = chunk * PARALLEL_GRAIN;
+        fn(begin, std::min(n, begin + PARALLEL_GRAIN));
+    });
+}
+
+// Calls fn(begin, end) on chunks of [0, n) in parallel and returns the sum
+// of the results, always added in the same order
+double parallel_sum(int n, const std::function<double(int, int)>& fn) {
+    static std::vector<double> partial_sums;
+    partial_sums.resize(get_n_chunks(n));
+    get_thread_pool().run(get_n_chunks(n), [&](int chunk) {
+        int begin = chunk * PARALLEL_GRAIN;
+        partial_sums[chunk] = fn(begin, std::min(n, begin + PARALLEL_GRAIN));
+    });
+    double sum = 0;
+    for (double partial_sum : partial_sums)
+        sum += partial_sum;
+    return sum;
+}
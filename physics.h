@@ -1,214 +1,232 @@
+#pragma once
+
+#include <algorithm>
 #include <cstdio>
 #include <random>
 
-#include "SimplexNoise.h"
+#include "cloth.h"
+#include "colliders.h"
+#include "forces.h"
+#include "grid.h"
+#include "implicit.h"
+#include "pick.h"
+#include "projective.h"
+#include "self_collision.h"
+#include "substep.h"
+#include "tear.h"
+#include "tether.h"
+#include "tiled.h"
 #include "utils.h"
 
-Vec3d GRAVITY{ 0, -10, 0 };
-const float MAX_WIND_STRENGHT = 20;
-float WIND_STRENGTH_MULTIPLIER = 1;
-
-struct PointMass {
-    const float DAMPING = .03;
-    const float RESTING_DISTANCE = 12;
-    const float STIFFNESS = 0.8; // from 0 to 1
-    const double MASS = 3.5;
-    
-    PointMass(double x, double y, double z, bool fixed, int n_neighbors=1)
-        : pos{ Vec3d{ x, y, z } }, fixed{ fixed }, n_neighbors{ n_neighbors } {
-        old_pos = pos;
-        fixed_pos = pos;
-        // Storing pointer to dynamic array
-        neighbors = new PointMass*[n_neighbors]{};
-    }
-
-    ~PointMass() {
-        // Deallocates dynamic array
-        delete[] neighbors;
-    }
-    // Returns point pos
-    Vec3d get_pos() const {
-        return pos;
-    }
-    // Returns the x position coordinate casted to float
-    float get_pos_x() const {
-        return (float)pos.get_x();
-    }
-    // Returns the y position coordinate casted to float
-    float get_pos_y() const {
-        return (float)pos.get_y();
-    }
-    // Returns the z position coordinate casted to float
-    float get_pos_z() const {
-        return (float)pos.get_z();
-    }
-    // Fix the point on its current position
-    void fix_position() {
-        fixed = true;
-        fixed_pos = pos;
-    }
-    // Unfix the point
-    void unfix_position() {
-        fixed = false;
-    }
-    // Links the point to another point
-    void add_neighbor(PointMass* neighbor_ptr) {
-        // Looping inside neighbors array, placing given neighbor_ptr
-        // at the first index where a nullptr is found
-        for (int i = 0; i < n_neighbors; i++) {
-            if (!neighbors[i]) {
-                neighbors[i] = neighbor_ptr;
-                return;
-            }
-        }
-        printf("Maximum number of neighbors reached!\n");
-    }
-    // Adds a given vector to the acceleration
-    void apply_force(Vec3d force) {
-        acc += force;
-    }
-    void apply_force(glm::vec3 force) {
-        acc += Vec3d(force.x, force.y, force.z);
-    }
-    // Moves the point to the given pos
-    void drag_to(Vec3d pos) {
-        this->pos = pos;
-        old_pos = pos;
-        fixed_pos = pos;
-    }
-    // Handles constrain solving for each neighbor
-    void constrain() {
-        static Vec3d diff, translate;
-        static double d, difference;
-        for (int i = 0; i < n_neighbors; i++) {
-            if (neighbors[i]) {
-                diff = pos - neighbors[i]->pos;
-                d = diff.magnitude();
-                if (d <= 0)
-                    d = 0.00001;
-                difference = (min(d, RESTING_DISTANCE) - d) / d;
-                translate = diff * 0.5 * STIFFNESS * difference;
-                if (!fixed)
-                    pos += translate;
-                if (!(neighbors[i]->fixed))
-                    neighbors[i]->pos -= translate;
-            }
-        }
-    }
-    // Updates the point position using verlet integration
-    void update(double dt) {
-        if (fixed) {
-            pos = fixed_pos;
-        } else {
-            vel = pos - old_pos;
-            old_pos = pos;
-            pos += (vel * (1 - DAMPING) + acc * dt);
-        }
-        acc = Vec3d{};
-    }
-
-    private:
-        Vec3d pos;
-        Vec3d old_pos;
-        Vec3d vel;
-        Vec3d acc{};
-        bool fixed;
-        Vec3d fixed_pos;
-        // Pointer to dynamic array containing pointers to PointMass neighbors 
-        PointMass** neighbors;
-        int n_neighbors;
+// How the cloth is advanced in time
+enum SolverMode {
+    SOLVER_VERLET,     // Explicit verlet integration followed by constraint projection
+    SOLVER_IMPLICIT,   // Backward Euler with springs, stable with one large step per frame
+    SOLVER_PROJECTIVE, // Projective dynamics with a prefactored global system
+    SOLVER_SUBSTEP,    // Many small verlet steps per step with a single fused constraint sweep each
+    SOLVER_GRID,       // Verlet with the constraint sweeps specialized for the grid built by main()
+    SOLVER_TILED       // Like SOLVER_GRID, sweeping cache sized tiles of the grid in parallel
 };
-
-
-void timestep(
-    PointMass** points,
-    int cols, int rows,
-    int n_points,
+// The grid solvers need the points in grid order, reordered cloths use SOLVER_VERLET instead
+
+// Advances the cloth by one step of dt with the given solver, without any
+// user interaction. iterations is the number of constraint sweeps, of
+// projective dynamics iterations, or of small steps the step is split in
+// with SOLVER_SUBSTEP. The forces are evaluated and the self collisions
+// detected once per step, so the small steps only run the fused sweep of the
+// substep solver and the contacts projections. time is the simulation time
+// the wind is sampled at, tethers, colliders, self collisions and tearing can
+// be null.
+// The contacts with the colliders and the cloth itself are solved along with
+// the constraints: after each sweep, after each pass of TILE_ITERATIONS tiled
+// sweeps, or after each small step. The implicit and projective solvers solve
+// their constraints all at once, without the positions in between, so their
+// contacts only get the pass on the new positions every solver ends with.
+void simulate(
+    Cloth* cloth,
+    ForceField* forces,
+    Tethers* tethers,
+    Colliders* colliders,
+    SelfCollisions* self_collisions,
+    Tearing* tearing,
+    SolverMode mode,
+    int cols,
     int iterations,
     double dt,
+    float time) {
+
+    static ImplicitSolver implicit_solver;
+    static ProjectiveSolver projective_solver;
+    static SubstepSolver substep_solver;
+    static TiledGridSolver tiled_solver;
+
+    bool use_tethers = tethers && tethers->enabled;
+    bool use_self_collisions = self_collisions && self_collisions->enabled;
+    if (use_self_collisions)
+        self_collisions->detect(cloth);
+    if ((mode == SOLVER_GRID || mode == SOLVER_TILED) && (!cloth->is_in_added_order() || cloth->torn))
+        mode = SOLVER_VERLET;
+    if (mode == SOLVER_VERLET) {
+        for (int i = 0; i < iterations; i++) {
+            cloth->constrain();
+            if (use_self_collisions)
+                self_collisions->constrain(cloth);
+            if (colliders)
+                colliders->project(cloth, false);
+        }
+        if (use_tethers)
+            tethers->constrain(cloth);
+    } else if (mode == SOLVER_GRID) {
+        GridView<double> grid = get_grid_view(cloth, cols);
+        for (int i = 0; i < iterations; i++) {
+            ClothGridSolver::constrain(grid, cloth->stiffness);
+            if (use_self_collisions)
+                self_collisions->constrain(cloth);
+            if (colliders)
+                colliders->project(cloth, false);
+        }
+        if (use_tethers)
+            tethers->constrain(cloth);
+    } else if (mode == SOLVER_TILED) {
+        for (int done = 0; done < iterations; done += TILE_ITERATIONS) {
+            tiled_solver.constrain(cloth, cols, std::min(TILE_ITERATIONS, iterations - done));
+            if (use_self_collisions)
+                self_collisions->constrain(cloth);
+            if (colliders)
+                colliders->project(cloth, false);
+        }
+        if (use_tethers)
+            tethers->constrain(cloth);
+    }
+
+    // Adding forces, the ones of the small steps being evaluated at the start of the first one
+    forces->evaluate(cloth, cols, mode == SOLVER_SUBSTEP ? dt / iterations : dt, time);
+    if (mode == SOLVER_IMPLICIT)
+        implicit_solver.step(cloth, dt);
+    else if (mode == SOLVER_PROJECTIVE)
+        projective_solver.step(cloth, dt, iterations);
+    else if (mode == SOLVER_SUBSTEP)
+        for (int i = 0; i < iterations; i++) {
+            substep_solver.step(cloth, dt / iterations);
+            if (use_tethers)
+                tethers->constrain(cloth);
+            if (use_self_collisions)
+                self_collisions->constrain(cloth);
+            if (colliders)
+                colliders->project(cloth, true);
+        }
+    else
+        cloth->integrate(dt);
+
+    if (use_tethers && (mode == SOLVER_IMPLICIT || mode == SOLVER_PROJECTIVE))
+        tethers->constrain(cloth);
+
+    if (use_self_collisions)
+        self_collisions->constrain(cloth);
+    // Last collision pass on the new positions, the points near the
+    // colliders are gathered here for the sweeps of the next step too.
+    // Points that jumped over a collider are then brought back in front of it.
+    if (colliders) {
+        colliders->cull(cloth);
+        colliders->project(cloth, true);
+        colliders->sweep(cloth);
+    }
+
+    // The topology only changes between steps, once all the solver passes are done
+    if (tearing && tearing->enabled)
+        tearing->tear(cloth);
+}
+
+// Picks, drags and unpins points with the mouse and pushes the cloth with the camera,
+// once per frame: the ray from the camera is tested against a BVH of the cloth
+// triangles, refit here. Without a brush the point of the hit triangle closest to
+// the hit is picked, else all the points within brush_radius of the hit are, and
+// they are pinned, unpinned and dragged as a group. Dragged points keep their
+// offset from the spot of the surface that was hit, which follows the camera.
+void handle_mouse(
+    Cloth* cloth,
+    ForceField* forces,
     Mouse* mouse,
     Camera* camera,
-    bool cursor_enabled) {
-
-    static PointMass* dragged_point = nullptr;
-    static float dragged_dist; // Distance of dragged point from camera when it was picked
-    static int noise_time_off = rand() % 10000;
-
-    for (int i = 0; i < iterations; i++) {
-        for (int j = 0; j < n_points; j++)
-            points[j]->constrain();
-    }
-
-    double min_distance = INFINITY;
-    PointMass* closest_point = nullptr;
-    float noise_xoff = 0;
-    float noise_yoff = 0;
-    float min_dist = INFINITY;
-    float min_dist_to_camera;
+    bool cursor_enabled,
+    float brush_radius) {
+
+    static TriangleBVH bvh;
+    static std::vector<int> selection;
+    static std::vector<double> dragged_offsets; // From the dragged spot to each dragged point
+    static bool dragging = false;
+    static double dragged_dist; // Distance of the dragged spot from the camera when it was picked
+    // Ray force pushing the points the camera is moving across
+    static int mouse_push = forces->add_ray(Vec3d{}, Vec3d{ 0, 0, 1 }, Vec3d{}, sqrt(40));
     glm::vec3 camera_pos = camera->get_pos() * 500.0f; // Why does this value work?
-    glm::vec3 camera_direction = camera->get_direction() * camera->get_zfar(); 
-
-    for (int i = 0; i < rows; i++) {
-        // Resetting noise xoffset
-        noise_xoff = 0;
-        for (int j = 0; j < cols; j++) {
-            int k = j + i * cols; // 1d index
-            float time = glfwGetTime();
-
-            // Calculating wind vector
-            float wind_strength = map(
-                SimplexNoise::noise(noise_xoff, noise_yoff, time + noise_time_off),
-                -1, 1, 0, MAX_WIND_STRENGHT);
-            float wind_phi = map( // Horizontal rotation angle
-                SimplexNoise::noise(noise_xoff, noise_yoff, time + noise_time_off),
-                -1, 1, -M_PI, M_PI); 
-            float wind_theta = map( // Vertical rotation angle
-                SimplexNoise::noise(noise_xoff, noise_yoff, time + noise_time_off),
-                -1, 1, -M_PI_2, M_PI_2);
-            Vec3d wind = Vec3d{ sin(wind_phi) * cos(wind_theta),
-                                sin(wind_phi) * sin(wind_theta),
-                                cos(wind_phi) } * wind_strength;
-
-            // Calculating closest point to camera direction
-            glm::vec3 dist_to_camera = glm::vec3(
-                points[k]->get_pos_x(),
-                points[k]->get_pos_y(),
-                points[k]->get_pos_z()) - camera_pos;
-            float dist_to_direction_squared = glm::length2(dist_to_camera) -
-                pow(glm::dot(camera_direction, dist_to_camera) / camera->get_zfar(), 2);
-
-            if (dist_to_direction_squared < min_dist && cursor_enabled) {
-                min_dist = dist_to_direction_squared;
-                min_dist_to_camera = glm::length(dist_to_camera);
-                closest_point = points[k];
-            }
-
-            // Adding forces
-            points[k]->apply_force(GRAVITY * points[k]->MASS);
-            points[k]->apply_force(wind * WIND_STRENGTH_MULTIPLIER);
-            if (dist_to_direction_squared < 40 && !dragged_point && cursor_enabled)
-                points[k]->apply_force(camera->get_direction_vel() * 60000.0f);
-           
-            points[k]->update(dt);
-            noise_xoff += 0.03;
-        }
-        noise_yoff += 0.005;
+    glm::vec3 camera_direction = glm::normalize(camera->get_direction());
+    const double origin[3] = { camera_pos.x, camera_pos.y, camera_pos.z };
+    const double direction[3] = { camera_direction.x, camera_direction.y, camera_direction.z };
+
+    RayForce& push = forces->rays[mouse_push];
+    push.origin = Vec3d(camera_pos);
+    push.direction = Vec3d(camera->get_direction());
+    push.force = Vec3d(camera->get_direction_vel() * 60000.0f);
+    push.enabled = !dragging && cursor_enabled;
+
+    // Selecting the points around the spot the camera points at, only when they're going to be used
+    bool picking = cursor_enabled && (mouse->get_left_button() ? !dragging : mouse->get_right_button());
+    if (picking) {
+        RayHit hit;
+        bvh.update(cloth);
+        picking = bvh.intersect(origin, direction, &hit);
+        selection.clear();
+        if (picking && brush_radius > 0) {
+            double spot[3];
+            for (int a = 0; a < 3; a++)
+                spot[a] = origin[a] + direction[a] * hit.distance;
+            bvh.gather_points(spot, brush_radius, &selection);
+        } else if (picking)
+            selection.push_back(hit.get_closest_point(cloth));
+        dragged_dist = hit.distance;
     }
 
     if (mouse->get_left_button()) {
-        if (dragged_point) {
-            camera_direction *= dragged_dist;
-            dragged_point->fix_position();
-            dragged_point->drag_to(Vec3d(camera_pos + camera_direction));
-
-        } else {
-            dragged_point = closest_point;
-            dragged_dist = min_dist_to_camera / camera->get_zfar();
+        if (dragging) {
+            const double spot[3] = {
+                origin[0] + direction[0] * dragged_dist,
+                origin[1] + direction[1] * dragged_dist,
+                origin[2] + direction[2] * dragged_dist
+            };
+            for (size_t k = 0; k < selection.size(); k++) {
+                const double* o = &dragged_offsets[3 * k];
+                cloth->drag_to(selection[k], Vec3d(spot[0] + o[0], spot[1] + o[1], spot[2] + o[2]));
+            }
+
+        } else if (picking) {
+            dragging = true;
+            cloth->set_fixed(selection, true);
+            dragged_offsets.resize(3 * selection.size());
+            for (size_t k = 0; k < selection.size(); k++) {
+                const int i = selection[k];
+                dragged_offsets[3 * k] = cloth->x[i] - (origin[0] + direction[0] * dragged_dist);
+                dragged_offsets[3 * k + 1] = cloth->y[i] - (origin[1] + direction[1] * dragged_dist);
+                dragged_offsets[3 * k + 2] = cloth->z[i] - (origin[2] + direction[2] * dragged_dist);
+            }
         }
     } else if (mouse->get_right_button()) {
-        if (closest_point)
-            closest_point->unfix_position();
+        if (picking)
+            cloth->set_fixed(selection, false);
     } else
-        dragged_point = nullptr;
+        dragging = false;
+}
+
+void timestep(
+    Cloth* cloth,
+    ForceField* forces,
+    Tethers* tethers,
+    Colliders* colliders,
+    SelfCollisions* self_collisions,
+    Tearing* tearing,
+    SolverMode mode,
+    int cols, int rows,
+    int iterations,
+    double dt) {
 
-}
\ No newline at end of file
+    simulate(cloth, forces, tethers, colliders, self_collisions, tearing, mode, cols, iterations, dt, glfwGetTime());
+}
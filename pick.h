@@ -0,0 +1,270 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "cloth.h"
+#include "parallel.h"
+
+const int BVH_LEAF_SIZE = 4;    // Triangles per leaf of the bounding volume hierarchy
+const int BVH_MAX_DEPTH = 64;   // Depth of the traversal stack, the median splits keep the tree far shallower
+
+// Where a ray hit the cloth surface
+struct RayHit {
+    int triangle = -1;
+    double distance = INFINITY; // Along the ray, in units of its direction
+    // Barycentric coordinates of the hit point, weights of the second and third point of the
+    // triangle (the first one weighs 1 - u - v)
+    double u = 0, v = 0;
+
+    // Returns the point of the triangle closest to the hit
+    int get_closest_point(const Cloth* cloth) const {
+        const int* points = &cloth->triangles[3 * triangle];
+        if (1 - u - v >= u && 1 - u - v >= v)
+            return points[0];
+        return u >= v ? points[1] : points[2];
+    }
+};
+
+// Bounding volume hierarchy over the triangles of a cloth, to find where a ray
+// hits the surface without testing every triangle. The tree is built once by
+// splitting the triangles at the median of their widest axis, then only its
+// boxes are refit to the moving points, which keeps the queries logarithmic as
+// long as the cloth doesn't fold too much compared to its resting shape.
+// It's built again when the topology of the cloth changes.
+struct TriangleBVH {
+    // Refits the boxes to the current positions of the points, building the tree first if needed
+    void update(const Cloth* cloth) {
+        this->cloth = cloth;
+        if (topology_version != cloth->topology_version || (int)order.size() != cloth->get_n_triangles())
+            build(cloth);
+        else
+            refit(cloth);
+    }
+
+    // Finds the closest triangle hit by the ray from origin along direction, returns whether there's one
+    bool intersect(const double* origin, const double* direction, RayHit* hit) const {
+        if (nodes.empty())
+            return false;
+        const double inv_direction[3] = { 1 / direction[0], 1 / direction[1], 1 / direction[2] };
+        int stack[BVH_MAX_DEPTH];
+        int n_stack = 0;
+        stack[n_stack++] = 0;
+        bool found = false;
+        while (n_stack > 0) {
+            const Node& node = nodes[stack[--n_stack]];
+            if (hit_box(node, origin, inv_direction) >= hit->distance)
+                continue;
+            if (node.count > 0) {
+                for (int k = node.first; k < node.first + node.count; k++)
+                    found |= hit_triangle(order[k], origin, direction, hit);
+                continue;
+            }
+            // Visiting the nearest child first, the farther one is often culled by its hit
+            int near_child = node.first, far_child = node.first + 1;
+            if (hit_box(nodes[near_child], origin, inv_direction) > hit_box(nodes[far_child], origin, inv_direction))
+                std::swap(near_child, far_child);
+            stack[n_stack++] = far_child;
+            stack[n_stack++] = near_child;
+        }
+        return found;
+    }
+
+    // Appends to points each point of the triangles within radius of center, once
+    void gather_points(const double* center, double radius, std::vector<int>* points) const {
+        if (nodes.empty())
+            return;
+        const size_t first = points->size();
+        int stack[BVH_MAX_DEPTH];
+        int n_stack = 0;
+        stack[n_stack++] = 0;
+        while (n_stack > 0) {
+            const Node& node = nodes[stack[--n_stack]];
+            // Squared distance from the center to the box
+            double distance = 0;
+            for (int a = 0; a < 3; a++) {
+                double outside = std::max(node.low[a] - center[a], center[a] - node.high[a]);
+                if (outside > 0)
+                    distance += outside * outside;
+            }
+            if (distance > radius * radius)
+                continue;
+            if (node.count == 0) {
+                stack[n_stack++] = node.first;
+                stack[n_stack++] = node.first + 1;
+                continue;
+            }
+            for (int k = node.first; k < node.first + node.count; k++)
+                for (int p = 0; p < 3; p++) {
+                    const int i = cloth->triangles[3 * order[k] + p];
+                    const double dx = cloth->x[i] - center[0];
+                    const double dy = cloth->y[i] - center[1];
+                    const double dz = cloth->z[i] - center[2];
+                    if (dx * dx + dy * dy + dz * dz <= radius * radius)
+                        points->push_back(i);
+                }
+        }
+        // Points are shared by neighbouring triangles
+        std::sort(points->begin() + first, points->end());
+        points->erase(std::unique(points->begin() + first, points->end()), points->end());
+    }
+
+    private:
+        // Leaves have count > 0 triangles starting at order[first], the
+        // children of the other nodes are nodes[first] and nodes[first + 1]
+        struct Node {
+            double low[3], high[3];
+            int first, count;
+        };
+
+        int topology_version = -1;
+        const Cloth* cloth = nullptr;
+        std::vector<Node> nodes;
+        // Triangles, grouped by leaf
+        std::vector<int> order;
+        std::vector<int> leaves;
+        std::vector<double> centroids;
+
+        void build(const Cloth* cloth) {
+            const int n = cloth->get_n_triangles();
+            order.resize(n);
+            centroids.resize(3 * n);
+            for (int t = 0; t < n; t++) {
+                order[t] = t;
+                const int* v = &cloth->triangles[3 * t];
+                centroids[3 * t] = (cloth->x[v[0]] + cloth->x[v[1]] + cloth->x[v[2]]) / 3;
+                centroids[3 * t + 1] = (cloth->y[v[0]] + cloth->y[v[1]] + cloth->y[v[2]]) / 3;
+                centroids[3 * t + 2] = (cloth->z[v[0]] + cloth->z[v[1]] + cloth->z[v[2]]) / 3;
+            }
+            nodes.clear();
+            leaves.clear();
+            if (n > 0) {
+                nodes.reserve(2 * (n / BVH_LEAF_SIZE + 1));
+                nodes.push_back(Node{});
+                split(0, 0, n);
+            }
+            topology_version = cloth->topology_version;
+            refit(cloth);
+        }
+
+        // Splits the triangles order[begin, end) of node at the median of the widest axis of their centroids
+        void split(int node, int begin, int end) {
+            if (end - begin <= BVH_LEAF_SIZE) {
+                nodes[node].first = begin;
+                nodes[node].count = end - begin;
+                leaves.push_back(node);
+                return;
+            }
+            double low[3] = { INFINITY, INFINITY, INFINITY };
+            double high[3] = { -INFINITY, -INFINITY, -INFINITY };
+            for (int k = begin; k < end; k++)
+                for (int a = 0; a < 3; a++) {
+                    low[a] = std::min(low[a], centroids[3 * order[k] + a]);
+                    high[a] = std::max(high[a], centroids[3 * order[k] + a]);
+                }
+            int axis = 0;
+            for (int a = 1; a < 3; a++)
+                if (high[a] - low[a] > high[axis] - low[axis])
+                    axis = a;
+            const int middle = (begin + end) / 2;
+            std::nth_element(order.begin() + begin, order.begin() + middle, order.begin() + end,
+                [&](int t1, int t2) { return centroids[3 * t1 + axis] < centroids[3 * t2 + axis]; });
+
+            const int children = nodes.size();
+            nodes[node].first = children;
+            nodes[node].count = 0;
+            nodes.push_back(Node{});
+            nodes.push_back(Node{});
+            split(children, begin, middle);
+            split(children + 1, middle, end);
+        }
+
+        // Fits the leaves to their triangles in parallel, then each node to its
+        // children, children being always stored after their parent
+        void refit(const Cloth* cloth) {
+            parallel_for(leaves.size(), [&](int begin, int end) {
+                for (int l = begin; l < end; l++) {
+                    Node& node = nodes[leaves[l]];
+                    for (int a = 0; a < 3; a++) {
+                        node.low[a] = INFINITY;
+                        node.high[a] = -INFINITY;
+                    }
+                    for (int k = node.first; k < node.first + node.count; k++)
+                        for (int p = 0; p < 3; p++) {
+                            const int i = cloth->triangles[3 * order[k] + p];
+                            const double position[3] = { cloth->x[i], cloth->y[i], cloth->z[i] };
+                            for (int a = 0; a < 3; a++) {
+                                node.low[a] = std::min(node.low[a], position[a]);
+                                node.high[a] = std::max(node.high[a], position[a]);
+                            }
+                        }
+                }
+            });
+            for (int k = nodes.size() - 1; k >= 0; k--) {
+                Node& node = nodes[k];
+                if (node.count > 0)
+                    continue;
+                const Node& left = nodes[node.first];
+                const Node& right = nodes[node.first + 1];
+                for (int a = 0; a < 3; a++) {
+                    node.low[a] = std::min(left.low[a], right.low[a]);
+                    node.high[a] = std::max(left.high[a], right.high[a]);
+                }
+            }
+        }
+
+        // Returns the distance along the ray at which it enters the box, INFINITY if it misses it
+        static double hit_box(const Node& node, const double* origin, const double* inv_direction) {
+            double near = 0, far = INFINITY;
+            for (int a = 0; a < 3; a++) {
+                double t1 = (node.low[a] - origin[a]) * inv_direction[a];
+                double t2 = (node.high[a] - origin[a]) * inv_direction[a];
+                if (t1 > t2)
+                    std::swap(t1, t2);
+                // NaN from a point on the slab border with a parallel ray keeps the bounds as they are
+                near = t1 > near ? t1 : near;
+                far = t2 < far ? t2 : far;
+            }
+            return near <= far ? near : INFINITY;
+        }
+
+        // Tests the ray against triangle t (Moller-Trumbore, both sides), keeping it in hit if it's closer
+        bool hit_triangle(int t, const double* origin, const double* direction, RayHit* hit) const {
+            const int* points = &cloth->triangles[3 * t];
+            double ab[3], ac[3], ao[3];
+            for (int k = 0; k < 3; k++) {
+                const std::vector<double>& coordinate = k == 0 ? cloth->x : k == 1 ? cloth->y : cloth->z;
+                ab[k] = coordinate[points[1]] - coordinate[points[0]];
+                ac[k] = coordinate[points[2]] - coordinate[points[0]];
+                ao[k] = origin[k] - coordinate[points[0]];
+            }
+            double p[3], q[3];
+            cross(direction, ac, p);
+            const double determinant = ab[0] * p[0] + ab[1] * p[1] + ab[2] * p[2];
+            if (fabs(determinant) < 1e-12)
+                return false;
+            const double inv_determinant = 1 / determinant;
+            const double u = (ao[0] * p[0] + ao[1] * p[1] + ao[2] * p[2]) * inv_determinant;
+            if (u < 0 || u > 1)
+                return false;
+            cross(ao, ab, q);
+            const double v = (direction[0] * q[0] + direction[1] * q[1] + direction[2] * q[2]) * inv_determinant;
+            if (v < 0 || u + v > 1)
+                return false;
+            const double distance = (ac[0] * q[0] + ac[1] * q[1] + ac[2] * q[2]) * inv_determinant;
+            if (distance < 0 || distance >= hit->distance)
+                return false;
+            hit->triangle = t;
+            hit->distance = distance;
+            hit->u = u;
+            hit->v = v;
+            return true;
+        }
+
+        static void cross(const double* a, const double* b, double* result) {
+            result[0] = a[1] * b[2] - a[2] * b[1];
+            result[1] = a[2] * b[0] - a[0] * b[2];
+            result[2] = a[0] * b[1] - a[1] * b[0];
+        }
+};
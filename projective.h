@@ -0,0 +1,270 @@
+#pragma once
+
+#include <algorithm>
+#include <vector>
+
+#include "cloth.h"
+#include "implicit.h"
+#include "parallel.h"
+
+// Projective dynamics integrator. Each iteration alternates a local step,
+// projecting every distance constraint on its rest length independently
+// (in parallel), and a global step, solving for the positions closest to
+// both the inertial prediction and the projections. The global system
+//     (I + L) q = s + Σ k A^T p
+// (L being the constraint graph Laplacian, weighted by the constraints k)
+// is the same for the three coordinates and only depends on the constraints
+// and on which points are pinned, so it is factored once with a sparse
+// Cholesky decomposition and each iteration just runs the triangular
+// solves. The constraint weights match the implicit solver springs.
+struct ProjectiveSolver {
+    // Advances the cloth by one step of dt, running the given number of local/global iterations
+    void step(Cloth* cloth, double dt, int iterations) {
+        if (topology_version != cloth->topology_version) {
+            adjacency.build(cloth);
+            projection_x.resize(cloth->get_n_constraints());
+            projection_y.resize(cloth->get_n_constraints());
+            projection_z.resize(cloth->get_n_constraints());
+        }
+        if (topology_version != cloth->topology_version || pin_version != cloth->pin_version ||
+            factored_dt != dt || !std::equal(factored_stiffness, factored_stiffness + N_CONSTRAINT_TYPES, cloth->stiffness))
+            factor(cloth, dt);
+
+        const int n = cloth->get_n_points();
+        const int m = cloth->get_n_constraints();
+
+        // Inertial prediction, also the starting point of the iterations
+        parallel_for(n, [&](int begin, int end) {
+            for (int i = begin; i < end; i++) {
+                double w = cloth->inv_mass[i];
+                inertial_x[i] = cloth->x[i] + ((cloth->x[i] - cloth->old_x[i]) * (1 - DAMPING) + cloth->force_x[i] * dt) * w;
+                inertial_y[i] = cloth->y[i] + ((cloth->y[i] - cloth->old_y[i]) * (1 - DAMPING) + cloth->force_y[i] * dt) * w;
+                inertial_z[i] = cloth->z[i] + ((cloth->z[i] - cloth->old_z[i]) * (1 - DAMPING) + cloth->force_z[i] * dt) * w;
+                cloth->old_x[i] = cloth->x[i];
+                cloth->old_y[i] = cloth->y[i];
+                cloth->old_z[i] = cloth->z[i];
+                cloth->x[i] = inertial_x[i];
+                cloth->y[i] = inertial_y[i];
+                cloth->z[i] = inertial_z[i];
+            }
+        });
+
+        for (int iteration = 0; iteration < iterations; iteration++) {
+            // Local step, the projection of the vector between the points of each constraint
+            parallel_for(m, [&](int begin, int end) {
+                for (int type = 0; type < N_CONSTRAINT_TYPES; type++) {
+                    const bool tension_only = is_tension_only(type);
+                    const int last = std::min(end, cloth->constraint_start[type + 1]);
+                    for (int c = std::max(begin, cloth->constraint_start[type]); c < last; c++) {
+                        int a = cloth->constraint_a[c];
+                        int b = cloth->constraint_b[c];
+                        double dx = cloth->x[a] - cloth->x[b];
+                        double dy = cloth->y[a] - cloth->y[b];
+                        double dz = cloth->z[a] - cloth->z[b];
+                        double d = sqrt(dx * dx + dy * dy + dz * dz);
+                        if (d <= 0)
+                            d = 0.00001;
+                        double rest = cloth->constraint_rest[c];
+                        double scale = (tension_only ? min(d, rest) : rest) / d;
+                        projection_x[c] = dx * scale;
+                        projection_y[c] = dy * scale;
+                        projection_z[c] = dz * scale;
+                    }
+                }
+            });
+
+            // Global step right hand side, in the factorization order
+            parallel_for(n_free, [&](int begin, int end) {
+                for (int r = begin; r < end; r++) {
+                    int i = free_points[r];
+                    double bx = inertial_x[i];
+                    double by = inertial_y[i];
+                    double bz = inertial_z[i];
+                    for (int e = adjacency.row_start[i]; e < adjacency.row_start[i + 1]; e++) {
+                        int c = adjacency.row_constraint[e];
+                        int j = adjacency.row_other[e];
+                        double k = weight[c];
+                        double sign = cloth->constraint_a[c] == i ? 1 : -1;
+                        bx += k * sign * projection_x[c];
+                        by += k * sign * projection_y[c];
+                        bz += k * sign * projection_z[c];
+                        // Pinned neighbours are known, they move to the right hand side
+                        if (cloth->inv_mass[j] == 0) {
+                            bx += k * cloth->x[j];
+                            by += k * cloth->y[j];
+                            bz += k * cloth->z[j];
+                        }
+                    }
+                    rhs[0][r] = bx;
+                    rhs[1][r] = by;
+                    rhs[2][r] = bz;
+                }
+            });
+
+            // The three coordinates are independent systems
+            get_thread_pool().run(3, [&](int coordinate) {
+                solve(rhs[coordinate]);
+            });
+
+            parallel_for(n_free, [&](int begin, int end) {
+                for (int r = begin; r < end; r++) {
+                    int i = free_points[r];
+                    cloth->x[i] = rhs[0][r];
+                    cloth->y[i] = rhs[1][r];
+                    cloth->z[i] = rhs[2][r];
+                }
+            });
+        }
+    }
+
+    private:
+        int topology_version = -1;
+        int pin_version = -1;
+        double factored_dt = 0;
+        float factored_stiffness[N_CONSTRAINT_TYPES]{};
+        Adjacency adjacency;
+        // Weight of each constraint in the global system
+        std::vector<double> weight;
+        // Free points, in the order of the factorization rows
+        std::vector<int> free_points;
+        // Factorization row of each point, -1 for pinned points
+        std::vector<int> free_row;
+        int n_free = 0;
+        // Lower triangular factor, stored by rows from their first nonzero column (envelope)
+        std::vector<int> first_column, row_offset;
+        std::vector<double> factor_values;
+        std::vector<double> inertial_x, inertial_y, inertial_z;
+        std::vector<double> projection_x, projection_y, projection_z;
+        std::vector<double> rhs[3];
+
+        // Returns a reference to the (r, c) entry of the factor, with first_column[r] <= c <= r
+        double& entry(int r, int c) {
+            return factor_values[row_offset[r] + c - first_column[r]];
+        }
+
+        // Orders the free points with reverse Cuthill-McKee, so that the
+        // factor envelope stays narrow (about one grid row wide)
+        void order_free_points(Cloth* cloth) {
+            const int n = cloth->get_n_points();
+            std::vector<int> degree(n, 0);
+            std::vector<int> candidates;
+            for (int i = 0; i < n; i++) {
+                if (cloth->is_fixed(i))
+                    continue;
+                for (int e = adjacency.row_start[i]; e < adjacency.row_start[i + 1]; e++)
+                    degree[i] += !cloth->is_fixed(adjacency.row_other[e]);
+                candidates.push_back(i);
+            }
+            // Starting each connected component from a low degree (border) point
+            std::stable_sort(candidates.begin(), candidates.end(),
+                [&](int a, int b) { return degree[a] < degree[b]; });
+
+            std::vector<bool> visited(n, false);
+            std::vector<int> neighbours;
+            free_points.clear();
+            for (int start : candidates) {
+                if (visited[start])
+                    continue;
+                visited[start] = true;
+                free_points.push_back(start);
+                // Breadth first visit, the points vector is the queue
+                for (size_t head = free_points.size() - 1; head < free_points.size(); head++) {
+                    int i = free_points[head];
+                    neighbours.clear();
+                    for (int e = adjacency.row_start[i]; e < adjacency.row_start[i + 1]; e++) {
+                        int j = adjacency.row_other[e];
+                        if (!cloth->is_fixed(j) && !visited[j]) {
+                            visited[j] = true;
+                            neighbours.push_back(j);
+                        }
+                    }
+                    std::stable_sort(neighbours.begin(), neighbours.end(),
+                        [&](int a, int b) { return degree[a] < degree[b]; });
+                    free_points.insert(free_points.end(), neighbours.begin(), neighbours.end());
+                }
+            }
+            std::reverse(free_points.begin(), free_points.end());
+
+            n_free = free_points.size();
+            free_row.assign(n, -1);
+            for (int r = 0; r < n_free; r++)
+                free_row[free_points[r]] = r;
+        }
+
+        // Assembles the global system of the free points and computes its Cholesky factor
+        void factor(Cloth* cloth, double dt) {
+            const int n = cloth->get_n_points();
+            const int m = cloth->get_n_constraints();
+            weight.resize(m);
+            for (int c = 0; c < m; c++)
+                weight[c] = dt * SPRING_STIFFNESS * cloth->stiffness[cloth->get_constraint_type(c)];
+            order_free_points(cloth);
+
+            first_column.resize(n_free);
+            row_offset.resize(n_free + 1);
+            row_offset[0] = 0;
+            for (int r = 0; r < n_free; r++) {
+                int i = free_points[r];
+                first_column[r] = r;
+                for (int e = adjacency.row_start[i]; e < adjacency.row_start[i + 1]; e++) {
+                    int c = free_row[adjacency.row_other[e]];
+                    if (c >= 0 && c < first_column[r])
+                        first_column[r] = c;
+                }
+                row_offset[r + 1] = row_offset[r] + r - first_column[r] + 1;
+            }
+
+            // Lower triangle of I + k L
+            factor_values.assign(row_offset[n_free], 0);
+            for (int r = 0; r < n_free; r++) {
+                int i = free_points[r];
+                entry(r, r) = 1;
+                for (int e = adjacency.row_start[i]; e < adjacency.row_start[i + 1]; e++) {
+                    double k = weight[adjacency.row_constraint[e]];
+                    entry(r, r) += k;
+                    int c = free_row[adjacency.row_other[e]];
+                    if (c >= 0 && c < r)
+                        entry(r, c) -= k;
+                }
+            }
+
+            // Row by row Cholesky, the envelope of the factor is the one of the matrix
+            for (int r = 0; r < n_free; r++) {
+                for (int c = first_column[r]; c <= r; c++) {
+                    int start = std::max(first_column[r], first_column[c]);
+                    const double* row_r = &entry(r, start);
+                    const double* row_c = &entry(c, start);
+                    double sum = entry(r, c);
+                    for (int j = 0; j < c - start; j++)
+                        sum -= row_r[j] * row_c[j];
+                    entry(r, c) = c < r ? sum / entry(c, c) : sqrt(sum);
+                }
+            }
+
+            for (std::vector<double>* vector : { &inertial_x, &inertial_y, &inertial_z })
+                vector->resize(n);
+            for (std::vector<double>& vector : rhs)
+                vector.resize(n_free);
+            topology_version = cloth->topology_version;
+            pin_version = cloth->pin_version;
+            factored_dt = dt;
+            std::copy(cloth->stiffness, cloth->stiffness + N_CONSTRAINT_TYPES, factored_stiffness);
+        }
+
+        // Solves L L^T x = b in place
+        void solve(std::vector<double>& b) {
+            for (int r = 0; r < n_free; r++) {
+                const double* row = &entry(r, first_column[r]);
+                double sum = b[r];
+                for (int c = first_column[r]; c < r; c++)
+                    sum -= row[c - first_column[r]] * b[c];
+                b[r] = sum / entry(r, r);
+            }
+            for (int r = n_free - 1; r >= 0; r--) {
+                const double* row = &entry(r, first_column[r]);
+                b[r] /= entry(r, r);
+                for (int c = first_column[r]; c < r; c++)
+                    b[c] -= row[c - first_column[r]] * b[r];
+            }
+        }
+};
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "cloth.h"
+#include "parallel.h"
+
+// Space filling curves the points can be laid out along
+enum SpaceFillingCurve {
+    MORTON_CURVE, // Z order over the 3 axes, cheap to compute
+    HILBERT_CURVE // Hilbert order over the 2 widest axes, better locality for flat cloths
+};
+
+const int MORTON_BITS = 21;  // Bits per axis of the Morton keys
+const int HILBERT_BITS = 16; // Bits per axis of the Hilbert keys
+
+// Spreads the lowest MORTON_BITS bits of v, two zero bits between each
+uint64_t spread_bits(uint64_t v) {
+    v &= (1ull << MORTON_BITS) - 1;
+    v = (v | v << 32) & 0x1f00000000ffffull;
+    v = (v | v << 16) & 0x1f0000ff0000ffull;
+    v = (v | v << 8) & 0x100f00f00f00f00full;
+    v = (v | v << 4) & 0x10c30c30c30c30c3ull;
+    v = (v | v << 2) & 0x1249249249249249ull;
+    return v;
+}
+
+// Returns the distance along the Hilbert curve of the cell (x, y)
+uint64_t hilbert_key(uint32_t x, uint32_t y) {
+    uint64_t d = 0;
+    for (uint32_t s = 1u << (HILBERT_BITS - 1); s > 0; s >>= 1) {
+        uint32_t rx = (x & s) > 0;
+        uint32_t ry = (y & s) > 0;
+        d += (uint64_t)s * s * ((3 * rx) ^ ry);
+        // Rotating the quadrant
+        if (ry == 0) {
+            if (rx == 1) {
+                x = s - 1 - x;
+                y = s - 1 - y;
+            }
+            std::swap(x, y);
+        }
+    }
+    return d;
+}
+
+// Returns the new index of each point of the cloth, sorting them along the given curve
+std::vector<int> space_filling_order(const Cloth* cloth, SpaceFillingCurve curve) {
+    const int n = cloth->get_n_points();
+    // Bounding box of the points
+    double low[3] = { INFINITY, INFINITY, INFINITY };
+    double high[3] = { -INFINITY, -INFINITY, -INFINITY };
+    for (int i = 0; i < n; i++) {
+        const double p[3] = { cloth->x[i], cloth->y[i], cloth->z[i] };
+        for (int a = 0; a < 3; a++) {
+            low[a] = min(low[a], p[a]);
+            high[a] = max(high[a], p[a]);
+        }
+    }
+
+    // The Hilbert curve follows the two widest axes
+    int axes[3] = { 0, 1, 2 };
+    std::sort(axes, axes + 3, [&](int a, int b) { return high[a] - low[a] > high[b] - low[b]; });
+    const int bits = curve == MORTON_CURVE ? MORTON_BITS : HILBERT_BITS;
+    double scale[3];
+    for (int a = 0; a < 3; a++)
+        scale[a] = ((1 << bits) - 1) / max(high[a] - low[a], 0.00001);
+
+    std::vector<uint64_t> keys(n);
+    parallel_for(n, [&](int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            const double p[3] = { cloth->x[i], cloth->y[i], cloth->z[i] };
+            uint32_t cell[3];
+            for (int a = 0; a < 3; a++)
+                cell[a] = (uint32_t)((p[a] - low[a]) * scale[a]);
+            keys[i] = curve == MORTON_CURVE ?
+                spread_bits(cell[0]) | spread_bits(cell[1]) << 1 | spread_bits(cell[2]) << 2 :
+                hilbert_key(cell[axes[0]], cell[axes[1]]);
+        }
+    });
+
+    // Points sorted by key with a (stable) radix sort, a byte of the keys at a time
+    const int key_bits = curve == MORTON_CURVE ? 3 * MORTON_BITS : 2 * HILBERT_BITS;
+    std::vector<int> sorted(n), buffer(n);
+    std::vector<uint64_t> sorted_keys(keys), key_buffer(n);
+    for (int i = 0; i < n; i++)
+        sorted[i] = i;
+    for (int shift = 0; shift < key_bits; shift += 8) {
+        int slot[257] = {};
+        for (int k = 0; k < n; k++)
+            slot[(sorted_keys[k] >> shift & 255) + 1]++;
+        for (int digit = 0; digit < 256; digit++)
+            slot[digit + 1] += slot[digit];
+        for (int k = 0; k < n; k++) {
+            const int to = slot[sorted_keys[k] >> shift & 255]++;
+            buffer[to] = sorted[k];
+            key_buffer[to] = sorted_keys[k];
+        }
+        sorted.swap(buffer);
+        sorted_keys.swap(key_buffer);
+    }
+    std::vector<int> new_index(n);
+    for (int k = 0; k < n; k++)
+        new_index[sorted[k]] = k;
+    return new_index;
+}
+
+// Lays the points of a cloth out along a space filling curve, so that points
+// close in space are close in memory too. Cloth::find_point() gives the
+// new index of each point.
+void reorder_points(Cloth* cloth, SpaceFillingCurve curve=HILBERT_CURVE) {
+    cloth->permute(space_filling_order(cloth, curve));
+}
@@ -0,0 +1,423 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <numeric>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "parallel.h"
+#include "utils.h"
+
+const int SDF_BRICK = 8;                 // Cells per side of a brick of the sparse grid
+const int SDF_BRICK_SAMPLES = (SDF_BRICK + 1) * (SDF_BRICK + 1) * (SDF_BRICK + 1); // Bricks store their border samples too
+const float SDF_CELL_SIZE = 4;           // Default grid spacing
+const int SDF_BAND_CELLS = 4;            // Half width of the narrow band, in cells
+const char* SDF_CACHE_DIR = "sdf_cache"; // Where the built fields are saved
+const uint32_t SDF_CACHE_VERSION = 2;    // Bumped when the cache layout or the build change
+
+// Triangle mesh, as flat arrays
+struct TriangleMesh {
+    std::vector<glm::vec3> vertices;
+    std::vector<int> indices; // 3 per triangle
+
+    int get_n_triangles() const {
+        return indices.size() / 3;
+    }
+};
+
+// Loads the vertices and faces of an OBJ file, polygons are split in fans of triangles
+TriangleMesh load_obj_mesh(const char* path, float scale=1) {
+    FILE* file = fopen(path, "r");
+    if (!file)
+        throw std::runtime_error{ std::string("Can't open mesh ") + path };
+    TriangleMesh mesh;
+    char line[1024];
+    while (fgets(line, sizeof(line), file)) {
+        if (line[0] == 'v' && line[1] == ' ') {
+            glm::vec3 v;
+            if (sscanf(line + 2, "%f %f %f", &v.x, &v.y, &v.z) == 3)
+                mesh.vertices.push_back(v * scale);
+        } else if (line[0] == 'f' && line[1] == ' ') {
+            // Face corners are "v", "v/vt", "v//vn" or "v/vt/vn", negative indices count from the end.
+            // Faces with a corner that isn't one of the vertices read so far are skipped
+            std::vector<int> face;
+            bool valid = true;
+            char* token = strtok(line + 2, " \t\r\n");
+            for (; token; token = strtok(nullptr, " \t\r\n")) {
+                char* end;
+                const long index = strtol(token, &end, 10);
+                const long n_vertices = mesh.vertices.size();
+                const long vertex = index < 0 ? n_vertices + index : index - 1;
+                valid &= end != token && index != 0 && vertex >= 0 && vertex < n_vertices;
+                face.push_back(vertex);
+            }
+            for (size_t k = 2; valid && k < face.size(); k++)
+                mesh.indices.insert(mesh.indices.end(), { face[0], face[k - 1], face[k] });
+        }
+    }
+    fclose(file);
+    return mesh;
+}
+
+// Signed distance field of a closed triangle mesh, negative inside. Only a
+// narrow band around the surface is sampled: the grid is split in bricks of
+// SDF_BRICK cells, and only the bricks the band crosses are stored.
+// distance() reads a single brick per query, so lookups are a trilinear
+// interpolation of 8 samples whatever the mesh complexity. Points deeper
+// inside than the band are not resolved and read as outside.
+// Building is parallel over the bricks, and the result is cached on disk in
+// SDF_CACHE_DIR, keyed by a hash of the mesh and of the grid parameters.
+struct MeshSDF {
+    // Builds the field of the mesh, or loads it from the cache
+    void build(const TriangleMesh& mesh, float cell_size=SDF_CELL_SIZE) {
+        cell = cell_size;
+        band = SDF_BAND_CELLS * cell_size;
+        const uint64_t hash = hash_mesh(mesh);
+        char name[32];
+        snprintf(name, sizeof(name), "%016llx.sdf", (unsigned long long)hash);
+        const std::string path = std::string(SDF_CACHE_DIR) + "/" + name;
+        if (load(path, hash))
+            return;
+
+        compute(mesh);
+        std::error_code error;
+        std::filesystem::create_directories(SDF_CACHE_DIR, error);
+        save(path, hash);
+    }
+
+    // Returns the signed distance at (px, py, pz) and its gradient (the
+    // surface normal) in nx, ny, nz. Outside the band it returns the band width.
+    inline double distance(double px, double py, double pz, double& nx, double& ny, double& nz) const {
+        // Position in cells
+        double cx = (px - origin.x) / cell;
+        double cy = (py - origin.y) / cell;
+        double cz = (pz - origin.z) / cell;
+        int bx = (int)floor(cx / SDF_BRICK);
+        int by = (int)floor(cy / SDF_BRICK);
+        int bz = (int)floor(cz / SDF_BRICK);
+        nx = ny = nz = 0;
+        if (bx < 0 || by < 0 || bz < 0 || bx >= n_bricks[0] || by >= n_bricks[1] || bz >= n_bricks[2])
+            return band;
+        int brick = brick_index[(bz * n_bricks[1] + by) * n_bricks[0] + bx];
+        if (brick < 0)
+            return band;
+
+        // Cell inside the brick and position inside the cell
+        double fx = cx - bx * SDF_BRICK, fy = cy - by * SDF_BRICK, fz = cz - bz * SDF_BRICK;
+        int i = std::min((int)fx, SDF_BRICK - 1), j = std::min((int)fy, SDF_BRICK - 1), k = std::min((int)fz, SDF_BRICK - 1);
+        double u = fx - i, v = fy - j, w = fz - k;
+        const float* s = &samples[brick * SDF_BRICK_SAMPLES + sample_offset(i, j, k)];
+        const int dj = SDF_BRICK + 1, dk = dj * dj;
+        double s000 = s[0], s100 = s[1], s010 = s[dj], s110 = s[dj + 1];
+        double s001 = s[dk], s101 = s[dk + 1], s011 = s[dk + dj], s111 = s[dk + dj + 1];
+
+        // Interpolating along x, then y, then z
+        double s00 = s000 + (s100 - s000) * u, s10 = s010 + (s110 - s010) * u;
+        double s01 = s001 + (s101 - s001) * u, s11 = s011 + (s111 - s011) * u;
+        double s0 = s00 + (s10 - s00) * v, s1 = s01 + (s11 - s01) * v;
+        // Gradient of the interpolation
+        double gx = ((s100 - s000) * (1 - v) + (s110 - s010) * v) * (1 - w) +
+                    ((s101 - s001) * (1 - v) + (s111 - s011) * v) * w;
+        double gy = (s10 - s00) * (1 - w) + (s11 - s01) * w;
+        double gz = s1 - s0;
+        double g = sqrt(gx * gx + gy * gy + gz * gz) + 0.00001;
+        nx = gx / g;
+        ny = gy / g;
+        nz = gz / g;
+        return s0 + (s1 - s0) * w;
+    }
+
+    // Bounding box of the sampled region
+    glm::vec3 get_low() const {
+        return origin;
+    }
+    glm::vec3 get_high() const {
+        return origin + glm::vec3(n_bricks[0], n_bricks[1], n_bricks[2]) * (cell * SDF_BRICK);
+    }
+
+    // Returns the number of stored bricks
+    int get_n_bricks() const {
+        return samples.size() / SDF_BRICK_SAMPLES;
+    }
+
+    private:
+        glm::vec3 origin;
+        float cell = SDF_CELL_SIZE;
+        float band = SDF_BAND_CELLS * SDF_CELL_SIZE;
+        int n_bricks[3] = { 0, 0, 0 };
+        // Per brick of the grid, its index among the stored ones (-1 if outside the band)
+        std::vector<int> brick_index;
+        // SDF_BRICK_SAMPLES samples per stored brick, x fastest
+        std::vector<float> samples;
+
+        static inline int sample_offset(int i, int j, int k) {
+            return (k * (SDF_BRICK + 1) + j) * (SDF_BRICK + 1) + i;
+        }
+
+        // FNV-1a over the mesh and the grid parameters
+        uint64_t hash_mesh(const TriangleMesh& mesh) const {
+            uint64_t hash = 14695981039346656037ull;
+            auto add = [&](const void* data, size_t size) {
+                const unsigned char* bytes = (const unsigned char*)data;
+                for (size_t b = 0; b < size; b++)
+                    hash = (hash ^ bytes[b]) * 1099511628211ull;
+            };
+            const uint32_t parameters[] = { SDF_CACHE_VERSION, SDF_BRICK, SDF_BAND_CELLS };
+            add(parameters, sizeof(parameters));
+            add(&cell, sizeof(cell));
+            add(mesh.vertices.data(), mesh.vertices.size() * sizeof(glm::vec3));
+            add(mesh.indices.data(), mesh.indices.size() * sizeof(int));
+            return hash;
+        }
+
+        void compute(const TriangleMesh& mesh) {
+            const int n_triangles = mesh.get_n_triangles();
+            const glm::vec3* vertex = mesh.vertices.data();
+            const int* index = mesh.indices.data();
+
+            // Grid covering the mesh and the band around it
+            glm::vec3 low(INFINITY), high(-INFINITY);
+            for (const glm::vec3& v : mesh.vertices) {
+                low = glm::min(low, v);
+                high = glm::max(high, v);
+            }
+            origin = low - glm::vec3(band + cell);
+            const float brick_size = cell * SDF_BRICK;
+            for (int a = 0; a < 3; a++)
+                n_bricks[a] = (int)ceil((high[a] + band + cell - origin[a]) / brick_size);
+
+            // Triangles whose band overlaps each brick
+            std::unordered_map<int, std::vector<int>> brick_triangles;
+            for (int t = 0; t < n_triangles; t++) {
+                const glm::vec3& a = vertex[index[3 * t]];
+                const glm::vec3& b = vertex[index[3 * t + 1]];
+                const glm::vec3& c = vertex[index[3 * t + 2]];
+                glm::vec3 first = (glm::min(glm::min(a, b), c) - glm::vec3(band) - origin) / brick_size;
+                glm::vec3 last = (glm::max(glm::max(a, b), c) + glm::vec3(band) - origin) / brick_size;
+                for (int bz = std::max(0, (int)first.z); bz <= std::min(n_bricks[2] - 1, (int)last.z); bz++)
+                    for (int by = std::max(0, (int)first.y); by <= std::min(n_bricks[1] - 1, (int)last.y); by++)
+                        for (int bx = std::max(0, (int)first.x); bx <= std::min(n_bricks[0] - 1, (int)last.x); bx++)
+                            brick_triangles[(bz * n_bricks[1] + by) * n_bricks[0] + bx].push_back(t);
+            }
+
+            brick_index.assign(n_bricks[0] * n_bricks[1] * n_bricks[2], -1);
+            std::vector<int> active;
+            for (const auto& entry : brick_triangles)
+                active.push_back(entry.first);
+            std::sort(active.begin(), active.end());
+            for (size_t b = 0; b < active.size(); b++)
+                brick_index[active[b]] = b;
+            samples.resize(active.size() * SDF_BRICK_SAMPLES);
+
+            std::vector<glm::vec3> face_normal, vertex_normal, edge_normal;
+            compute_pseudonormals(mesh, face_normal, vertex_normal, edge_normal);
+            std::vector<int> all_triangles(n_triangles);
+            std::iota(all_triangles.begin(), all_triangles.end(), 0);
+
+            parallel_for(active.size(), [&](int begin, int end) {
+                for (int b = begin; b < end; b++) {
+                    const int brick = active[b];
+                    const int bx = brick % n_bricks[0];
+                    const int by = brick / n_bricks[0] % n_bricks[1];
+                    const int bz = brick / (n_bricks[0] * n_bricks[1]);
+                    const std::vector<int>& triangles = brick_triangles.at(brick);
+                    float* s = &samples[b * SDF_BRICK_SAMPLES];
+                    for (int k = 0; k <= SDF_BRICK; k++)
+                        for (int j = 0; j <= SDF_BRICK; j++)
+                            for (int i = 0; i <= SDF_BRICK; i++) {
+                                glm::vec3 p = origin + glm::vec3(bx * SDF_BRICK + i, by * SDF_BRICK + j,
+                                                                 bz * SDF_BRICK + k) * cell;
+                                s[sample_offset(i, j, k)] = signed_distance(
+                                    p, triangles, mesh, face_normal, vertex_normal, edge_normal);
+                            }
+                    const glm::vec3 brick_origin = origin + glm::vec3(bx, by, bz) * brick_size;
+                    flood_signs(s, brick_origin, all_triangles, mesh, face_normal, vertex_normal, edge_normal);
+                }
+            });
+        }
+
+        // Angle weighted normals of the vertices and normals of the edges, which
+        // give the right sign to the points whose closest feature isn't a face
+        static void compute_pseudonormals(const TriangleMesh& mesh, std::vector<glm::vec3>& face_normal,
+                                          std::vector<glm::vec3>& vertex_normal, std::vector<glm::vec3>& edge_normal) {
+            const int n_triangles = mesh.get_n_triangles();
+            face_normal.resize(n_triangles);
+            vertex_normal.assign(mesh.vertices.size(), glm::vec3(0));
+            edge_normal.assign(3 * n_triangles, glm::vec3(0));
+            std::unordered_map<uint64_t, glm::vec3> edge_sum;
+            auto edge_key = [](uint64_t a, uint64_t b) { return a < b ? a << 32 | b : b << 32 | a; };
+
+            for (int t = 0; t < n_triangles; t++) {
+                const int* v = &mesh.indices[3 * t];
+                glm::vec3 n = glm::cross(mesh.vertices[v[1]] - mesh.vertices[v[0]],
+                                         mesh.vertices[v[2]] - mesh.vertices[v[0]]);
+                face_normal[t] = n / (glm::length(n) + 1e-12f);
+                for (int e = 0; e < 3; e++) {
+                    glm::vec3 to_next = mesh.vertices[v[(e + 1) % 3]] - mesh.vertices[v[e]];
+                    glm::vec3 to_prev = mesh.vertices[v[(e + 2) % 3]] - mesh.vertices[v[e]];
+                    float cosine = glm::dot(to_next, to_prev) / (glm::length(to_next) * glm::length(to_prev) + 1e-12f);
+                    vertex_normal[v[e]] += face_normal[t] * acosf(glm::clamp(cosine, -1.0f, 1.0f));
+                    edge_sum[edge_key(v[e], v[(e + 1) % 3])] += face_normal[t];
+                }
+            }
+            for (int t = 0; t < n_triangles; t++)
+                for (int e = 0; e < 3; e++)
+                    edge_normal[3 * t + e] = edge_sum[edge_key(mesh.indices[3 * t + e], mesh.indices[3 * t + (e + 1) % 3])];
+        }
+
+        // Distance from p to the nearest of the given triangles, signed by the
+        // pseudonormal of the nearest feature and clamped to the band
+        float signed_distance(glm::vec3 p, const std::vector<int>& triangles, const TriangleMesh& mesh,
+                              const std::vector<glm::vec3>& face_normal, const std::vector<glm::vec3>& vertex_normal,
+                              const std::vector<glm::vec3>& edge_normal) const {
+            float best = INFINITY;
+            float sign = 1;
+            for (int t : triangles) {
+                const int* v = &mesh.indices[3 * t];
+                int feature;
+                glm::vec3 q = closest_point(p, mesh.vertices[v[0]], mesh.vertices[v[1]], mesh.vertices[v[2]], feature);
+                float d2 = glm::dot(p - q, p - q);
+                if (d2 >= best)
+                    continue;
+                best = d2;
+                glm::vec3 normal = feature == 0 ? face_normal[t] :
+                                   feature <= 3 ? vertex_normal[v[feature - 1]] : edge_normal[3 * t + feature - 4];
+                sign = glm::dot(p - q, normal) < 0 ? -1 : 1;
+            }
+            return sign * std::min(sqrtf(best), band);
+        }
+
+        // Signs the samples of a brick farther from the surface than the band,
+        // whose nearest listed triangle may be far from the nearest one of the
+        // mesh, from their neighbours: the sign can't change between two
+        // neighbouring samples when one of them is beyond the band, the surface
+        // would be within a cell of it. Regions of the brick that no sample in the
+        // band reaches are signed by a query over all the triangles of the mesh.
+        void flood_signs(float* s, glm::vec3 brick_origin, const std::vector<int>& all_triangles, const TriangleMesh& mesh,
+                         const std::vector<glm::vec3>& face_normal, const std::vector<glm::vec3>& vertex_normal,
+                         const std::vector<glm::vec3>& edge_normal) const {
+            const int n = SDF_BRICK + 1;
+            std::vector<char> resolved(SDF_BRICK_SAMPLES, 0);
+            std::vector<int> queue;
+            for (int o = 0; o < SDF_BRICK_SAMPLES; o++)
+                if (fabsf(s[o]) < band) {
+                    resolved[o] = 1;
+                    queue.push_back(o);
+                }
+            auto flood = [&](size_t head) {
+                for (; head < queue.size(); head++) {
+                    const int o = queue[head];
+                    const int i = o % n, j = o / n % n, k = o / (n * n);
+                    const int neighbours[6][2] = { { i > 0, -1 }, { i < SDF_BRICK, 1 }, { j > 0, -n },
+                                                   { j < SDF_BRICK, n }, { k > 0, -n * n }, { k < SDF_BRICK, n * n } };
+                    for (const int* neighbour : neighbours)
+                        if (neighbour[0] && !resolved[o + neighbour[1]]) {
+                            resolved[o + neighbour[1]] = 1;
+                            s[o + neighbour[1]] = copysignf(band, s[o]);
+                            queue.push_back(o + neighbour[1]);
+                        }
+                }
+            };
+            flood(0);
+            for (int o = 0; o < SDF_BRICK_SAMPLES; o++)
+                if (!resolved[o]) {
+                    glm::vec3 p = brick_origin + glm::vec3(o % n, o / n % n, o / (n * n)) * cell;
+                    s[o] = copysignf(band, signed_distance(p, all_triangles, mesh, face_normal, vertex_normal, edge_normal));
+                    resolved[o] = 1;
+                    queue.push_back(o);
+                    flood(queue.size() - 1);
+                }
+        }
+
+        // Closest point to p of the triangle abc, feature is 0 for the face,
+        // 1 to 3 for the vertices a, b, c and 4 to 6 for the edges ab, bc, ca
+        static glm::vec3 closest_point(glm::vec3 p, glm::vec3 a, glm::vec3 b, glm::vec3 c, int& feature) {
+            glm::vec3 ab = b - a, ac = c - a, ap = p - a;
+            float d1 = glm::dot(ab, ap), d2 = glm::dot(ac, ap);
+            if (d1 <= 0 && d2 <= 0) {
+                feature = 1;
+                return a;
+            }
+            glm::vec3 bp = p - b;
+            float d3 = glm::dot(ab, bp), d4 = glm::dot(ac, bp);
+            if (d3 >= 0 && d4 <= d3) {
+                feature = 2;
+                return b;
+            }
+            float vc = d1 * d4 - d3 * d2;
+            if (vc <= 0 && d1 >= 0 && d3 <= 0) {
+                feature = 4;
+                return a + ab * (d1 / (d1 - d3));
+            }
+            glm::vec3 cp = p - c;
+            float d5 = glm::dot(ab, cp), d6 = glm::dot(ac, cp);
+            if (d6 >= 0 && d5 <= d6) {
+                feature = 3;
+                return c;
+            }
+            float vb = d5 * d2 - d1 * d6;
+            if (vb <= 0 && d2 >= 0 && d6 <= 0) {
+                feature = 6;
+                return a + ac * (d2 / (d2 - d6));
+            }
+            float va = d3 * d6 - d5 * d4;
+            if (va <= 0 && d4 - d3 >= 0 && d5 - d6 >= 0) {
+                feature = 5;
+                return b + (c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6)));
+            }
+            feature = 0;
+            float denominator = 1 / (va + vb + vc);
+            return a + ab * (vb * denominator) + ac * (vc * denominator);
+        }
+
+        // The cache files are a header followed by the brick indices and the samples
+        struct CacheHeader {
+            uint32_t version;
+            uint64_t hash;
+            float origin[3];
+            float cell, band;
+            int32_t n_bricks[3];
+            uint64_t n_samples;
+        };
+
+        bool load(const std::string& path, uint64_t hash) {
+            FILE* file = fopen(path.c_str(), "rb");
+            if (!file)
+                return false;
+            CacheHeader header;
+            bool ok = fread(&header, sizeof(header), 1, file) == 1 &&
+                      header.version == SDF_CACHE_VERSION && header.hash == hash;
+            if (ok) {
+                origin = glm::vec3(header.origin[0], header.origin[1], header.origin[2]);
+                cell = header.cell;
+                band = header.band;
+                for (int a = 0; a < 3; a++)
+                    n_bricks[a] = header.n_bricks[a];
+                brick_index.resize(n_bricks[0] * n_bricks[1] * n_bricks[2]);
+                samples.resize(header.n_samples);
+                ok = fread(brick_index.data(), sizeof(int), brick_index.size(), file) == brick_index.size() &&
+                     fread(samples.data(), sizeof(float), samples.size(), file) == samples.size();
+            }
+            fclose(file);
+            return ok;
+        }
+
+        void save(const std::string& path, uint64_t hash) const {
+            FILE* file = fopen(path.c_str(), "wb");
+            if (!file)
+                return;
+            CacheHeader header{ SDF_CACHE_VERSION, hash, { origin.x, origin.y, origin.z }, cell, band,
+                                { n_bricks[0], n_bricks[1], n_bricks[2] }, samples.size() };
+            fwrite(&header, sizeof(header), 1, file);
+            fwrite(brick_index.data(), sizeof(int), brick_index.size(), file);
+            fwrite(samples.data(), sizeof(float), samples.size(), file);
+            fclose(file);
+        }
+};
@@ -0,0 +1,458 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <vector>
+
+#include "cloth.h"
+#include "coloring.h"
+#include "parallel.h"
+
+const float SELF_COLLISION_THICKNESS = 3;           // Distance kept between the points and the rest of the cloth
+const float SELF_COLLISION_PADDING = 3;             // Contacts are gathered this much farther, covering the motion during a step
+const float SELF_COLLISION_CELL = RESTING_DISTANCE; // Minimum side of the spatial hash cells
+
+// Keeps the cloth from passing through itself, with point-point contacts and
+// point-triangle ones (the points being farther apart than the thickness).
+// Contacts are detected once per step with a spatial hash of the points, and
+// then solved as inequality constraints in every solver iteration, after the
+// distance ones.
+// The hash is a table of buckets filled by a counting sort: a parallel count
+// of the points per bucket, a prefix sum, then a parallel scatter, all into
+// arrays reused from step to step.
+struct SelfCollisions {
+    bool enabled = false;
+    float thickness = SELF_COLLISION_THICKNESS;
+
+    // Gathers the pairs of points and the point-triangle pairs close to each other
+    void detect(const Cloth* cloth) {
+        const double reach = thickness + SELF_COLLISION_PADDING;
+        if (topology_version != cloth->topology_version) {
+            adjacency.build(cloth);
+            topology_version = cloth->topology_version;
+        }
+        inv_cell = 1 / max(SELF_COLLISION_CELL, 2 * reach);
+        build_hash(cloth);
+        const int n = cloth->get_n_points();
+        const int n_triangles = cloth->get_n_triangles();
+        const int n_chunks = std::max(get_n_chunks(n), get_n_chunks(n_triangles));
+        if ((int)chunk_contacts.size() < n_chunks)
+            chunk_contacts.resize(n_chunks);
+
+        // Point pairs. Cells are at least twice the reach, so the points within
+        // reach are in the 2 x 2 x 2 cells around the corner nearest to the point
+        parallel_for(n, [&](int begin, int end) {
+            std::vector<PointContact>& contacts = chunk_contacts[begin / PARALLEL_GRAIN].points;
+            contacts.clear();
+            for (int i = begin; i < end; i++) {
+                const double x = cloth->x[i], y = cloth->y[i], z = cloth->z[i];
+                int ci, cj, ck;
+                get_cell(x - 0.5 / inv_cell, y - 0.5 / inv_cell, z - 0.5 / inv_cell, ci, cj, ck);
+                for_cells(ci, cj, ck, ci + 1, cj + 1, ck + 1, [&](int j, int e) {
+                    if (j <= i)
+                        return;
+                    double dx = x - bucket_x[e];
+                    double dy = y - bucket_y[e];
+                    double dz = z - bucket_z[e];
+                    if (dx * dx + dy * dy + dz * dz < reach * reach)
+                        contacts.push_back(PointContact{ i, j });
+                });
+            }
+        });
+
+        // Point-triangle pairs, from the cells around each triangle
+        parallel_for(n_triangles, [&](int begin, int end) {
+            std::vector<TriangleContact>& contacts = chunk_contacts[begin / PARALLEL_GRAIN].triangles;
+            contacts.clear();
+            for (int t = begin; t < end; t++) {
+                const int* v = &cloth->triangles[3 * t];
+                // Bounding box of the triangle grown by the reach, and the cells it covers
+                const double lx = min(min(cloth->x[v[0]], cloth->x[v[1]]), cloth->x[v[2]]) - reach;
+                const double ly = min(min(cloth->y[v[0]], cloth->y[v[1]]), cloth->y[v[2]]) - reach;
+                const double lz = min(min(cloth->z[v[0]], cloth->z[v[1]]), cloth->z[v[2]]) - reach;
+                const double hx = max(max(cloth->x[v[0]], cloth->x[v[1]]), cloth->x[v[2]]) + reach;
+                const double hy = max(max(cloth->y[v[0]], cloth->y[v[1]]), cloth->y[v[2]]) + reach;
+                const double hz = max(max(cloth->z[v[0]], cloth->z[v[1]]), cloth->z[v[2]]) + reach;
+                int low[3], high[3];
+                get_cell(lx, ly, lz, low[0], low[1], low[2]);
+                get_cell(hx, hy, hz, high[0], high[1], high[2]);
+                TriangleFrame frame;
+                // Stretched triangles would visit too many cells
+                if ((high[0] - low[0] + 1) * (high[1] - low[1] + 1) * (high[2] - low[2] + 1) > 64 ||
+                    !get_frame(cloth, t, frame))
+                    continue;
+                for_cells(low[0], low[1], low[2], high[0], high[1], high[2], [&](int i, int e) {
+                    const double x = bucket_x[e], y = bucket_y[e], z = bucket_z[e];
+                    if (x < lx || x > hx || y < ly || y > hy || z < lz || z > hz ||
+                        i == v[0] || i == v[1] || i == v[2])
+                        return;
+                    TriangleContact contact;
+                    if (test_triangle(cloth, i, x, y, z, frame, reach, contact) && !is_linked(i, v))
+                        contacts.push_back(contact);
+                });
+            }
+        });
+
+        // Joining the chunks in order, so that contacts are solved in the same order every run
+        point_contacts.clear();
+        triangle_contacts.clear();
+        for (int c = 0; c < n_chunks; c++) {
+            if (c < get_n_chunks(n))
+                point_contacts.insert(point_contacts.end(),
+                    chunk_contacts[c].points.begin(), chunk_contacts[c].points.end());
+            if (c < get_n_chunks(n_triangles))
+                triangle_contacts.insert(triangle_contacts.end(),
+                    chunk_contacts[c].triangles.begin(), chunk_contacts[c].triangles.end());
+        }
+
+        // Coloring the contacts, the point ones first then the triangle ones, and storing them
+        // by color so that the solve of a color streams through its own contacts
+        const int n_point_contacts = point_contacts.size();
+        color_items<4>(get_n_contacts(), n, [&](int c, int* points) {
+            if (c < n_point_contacts) {
+                points[0] = point_contacts[c].a;
+                points[1] = point_contacts[c].b;
+                points[2] = points[3] = -1;
+            } else {
+                const TriangleContact& contact = triangle_contacts[c - n_point_contacts];
+                points[0] = contact.point;
+                for (int k = 0; k < 3; k++)
+                    points[k + 1] = cloth->triangles[3 * contact.triangle + k];
+            }
+        }, &contact_colors, &contact_leftovers);
+        n_parallel_colors = contact_colors.size();
+        contact_colors.push_back(contact_leftovers);
+        colored_points.clear();
+        colored_triangles.clear();
+        color_point_start.assign(1, 0);
+        color_triangle_start.assign(1, 0);
+        for (const std::vector<int>& color : contact_colors) {
+            for (int c : color)
+                if (c < n_point_contacts)
+                    colored_points.push_back(point_contacts[c]);
+                else
+                    colored_triangles.push_back(triangle_contacts[c - n_point_contacts]);
+            color_point_start.push_back(colored_points.size());
+            color_triangle_start.push_back(colored_triangles.size());
+        }
+        point_contacts.swap(colored_points);
+        triangle_contacts.swap(colored_triangles);
+    }
+
+    // Pushes apart the points of the detected contacts closer than the thickness.
+    // The contacts of each color share no point and are solved by parallel tasks,
+    // the colors one after the other, then the ones left over serially
+    void constrain(Cloth* cloth) {
+        for (int color = 0; color + 1 < (int)color_point_start.size(); color++) {
+            const int first_point = color_point_start[color];
+            const int first_triangle = color_triangle_start[color];
+            const int n_points = color_point_start[color + 1] - first_point;
+            const int n_contacts = n_points + color_triangle_start[color + 1] - first_triangle;
+            auto solve = [&](int begin, int end) {
+                for (int k = begin; k < end; k++)
+                    if (k < n_points)
+                        solve_point_contact(cloth, point_contacts[first_point + k]);
+                    else
+                        solve_triangle_contact(cloth, triangle_contacts[first_triangle + k - n_points]);
+            };
+            if (color < n_parallel_colors)
+                parallel_for(n_contacts, solve);
+            else
+                solve(0, n_contacts);
+        }
+    }
+
+    // Returns the number of contacts found by the last detection
+    int get_n_contacts() const {
+        return point_contacts.size() + triangle_contacts.size();
+    }
+
+    private:
+        struct PointContact {
+            int a, b;
+        };
+        struct TriangleContact {
+            int point, triangle;
+            double barycentric[3];
+            double side; // 1 if the point was in front of the triangle, -1 behind
+        };
+        // Contacts found by each parallel chunk, kept allocated between steps
+        struct ChunkContacts {
+            std::vector<PointContact> points;
+            std::vector<TriangleContact> triangles;
+        };
+        std::vector<ChunkContacts> chunk_contacts;
+        // Points linked by a constraint to a triangle don't collide with it, the
+        // triangles around a point fold over it without the cloth intersecting
+        Adjacency adjacency;
+        int topology_version = -1;
+        std::vector<PointContact> point_contacts;
+        std::vector<TriangleContact> triangle_contacts;
+        // Contacts of each color, the point ones first then the triangle ones, and the ones left over.
+        // The contacts are then stored by color, the last one being the leftovers
+        std::vector<std::vector<int>> contact_colors;
+        std::vector<int> contact_leftovers;
+        std::vector<PointContact> colored_points;
+        std::vector<TriangleContact> colored_triangles;
+        std::vector<int> color_point_start, color_triangle_start;
+        int n_parallel_colors = 0;
+
+        // Spatial hash: the points of bucket h are bucket_points[bucket_start[h]] to
+        // bucket_points[bucket_start[h + 1]], with copies of their positions in bucket_x, y, z.
+        // Cells sharing a bucket aren't told apart, the distance tests discard the extra points.
+        std::vector<int> point_bucket;
+        std::vector<std::atomic<int>> bucket_fill;
+        std::vector<int> bucket_start, bucket_points;
+        std::vector<double> bucket_x, bucket_y, bucket_z;
+        unsigned mask = 0;
+        double inv_cell = 1 / SELF_COLLISION_CELL;
+
+        inline void get_cell(double x, double y, double z, int& ci, int& cj, int& ck) const {
+            ci = (int)floor(x * inv_cell);
+            cj = (int)floor(y * inv_cell);
+            ck = (int)floor(z * inv_cell);
+        }
+
+        // Cells along k land in consecutive buckets, so a column of cells is a single range of entries
+        inline unsigned hash(int ci, int cj, int ck) const {
+            return (((unsigned)ci * 73856093u ^ (unsigned)cj * 19349663u) + (unsigned)ck) & mask;
+        }
+
+        // Calls fn(i, e) for each point i, at entry e of the hash, in the cells
+        // from (i0, j0, k0) to (i1, j1, k1), visiting each bucket once
+        template <typename Function>
+        inline void for_cells(int i0, int j0, int k0, int i1, int j1, int k1, Function fn) const {
+            // Visited bucket ranges, a column wrapping around the table takes two
+            unsigned low[128], high[128];
+            int n_ranges = 0;
+            auto visit = [&](unsigned first, unsigned last) {
+                bool overlaps = false;
+                for (int r = 0; r < n_ranges; r++)
+                    overlaps |= first <= high[r] && low[r] <= last;
+                if (!overlaps) {
+                    for (int e = bucket_start[first]; e < bucket_start[last + 1]; e++)
+                        fn(bucket_points[e], e);
+                } else {
+                    // Columns sharing buckets, rare enough to go bucket by bucket
+                    for (unsigned h = first; h <= last; h++) {
+                        bool seen = false;
+                        for (int r = 0; r < n_ranges; r++)
+                            seen |= h >= low[r] && h <= high[r];
+                        if (!seen)
+                            for (int e = bucket_start[h]; e < bucket_start[h + 1]; e++)
+                                fn(bucket_points[e], e);
+                    }
+                }
+                low[n_ranges] = first;
+                high[n_ranges++] = last;
+            };
+            for (int ci = i0; ci <= i1; ci++)
+                for (int cj = j0; cj <= j1; cj++) {
+                    unsigned first = hash(ci, cj, k0), last = hash(ci, cj, k1);
+                    if (first <= last) {
+                        visit(first, last);
+                    } else {
+                        visit(first, mask);
+                        visit(0, last);
+                    }
+                }
+        }
+
+        void build_hash(const Cloth* cloth) {
+            const int n = cloth->get_n_points();
+            unsigned size = 1;
+            while (size < 2u * n)
+                size *= 2;
+            mask = size - 1;
+            if (bucket_fill.size() != size)
+                bucket_fill = std::vector<std::atomic<int>>(size);
+            point_bucket.resize(n);
+            bucket_start.resize(size + 1);
+            for (std::vector<double>* array : { &bucket_x, &bucket_y, &bucket_z })
+                array->resize(n);
+            bucket_points.resize(n);
+
+            parallel_for(size, [&](int begin, int end) {
+                for (int h = begin; h < end; h++)
+                    bucket_fill[h].store(0, std::memory_order_relaxed);
+            });
+            parallel_for(n, [&](int begin, int end) {
+                for (int i = begin; i < end; i++) {
+                    int ci, cj, ck;
+                    get_cell(cloth->x[i], cloth->y[i], cloth->z[i], ci, cj, ck);
+                    point_bucket[i] = hash(ci, cj, ck);
+                    bucket_fill[point_bucket[i]].fetch_add(1, std::memory_order_relaxed);
+                }
+            });
+            bucket_start[0] = 0;
+            for (unsigned h = 0; h < size; h++) {
+                bucket_start[h + 1] = bucket_start[h] + bucket_fill[h].load(std::memory_order_relaxed);
+                bucket_fill[h].store(bucket_start[h], std::memory_order_relaxed);
+            }
+            parallel_for(n, [&](int begin, int end) {
+                for (int i = begin; i < end; i++)
+                    bucket_points[bucket_fill[point_bucket[i]].fetch_add(1, std::memory_order_relaxed)] = i;
+            });
+            // The scatter order depends on the threads, buckets are sorted to make it deterministic
+            parallel_for(size, [&](int begin, int end) {
+                for (int h = begin; h < end; h++)
+                    if (bucket_start[h + 1] - bucket_start[h] > 1)
+                        std::sort(&bucket_points[bucket_start[h]], &bucket_points[bucket_start[h + 1]]);
+            });
+            parallel_for(n, [&](int begin, int end) {
+                for (int e = begin; e < end; e++) {
+                    bucket_x[e] = cloth->x[bucket_points[e]];
+                    bucket_y[e] = cloth->y[bucket_points[e]];
+                    bucket_z[e] = cloth->z[bucket_points[e]];
+                }
+            });
+        }
+
+        void solve_point_contact(Cloth* cloth, const PointContact& contact) const {
+            double* x = cloth->x.data();
+            double* y = cloth->y.data();
+            double* z = cloth->z.data();
+            const double* w = cloth->inv_mass.data();
+            int a = contact.a, b = contact.b;
+            double dx = x[a] - x[b];
+            double dy = y[a] - y[b];
+            double dz = z[a] - z[b];
+            double d = sqrt(dx * dx + dy * dy + dz * dz) + 0.00001;
+            double weight = w[a] + w[b];
+            if (d >= thickness || weight == 0)
+                return;
+            double translate = (thickness - d) / (d * weight);
+            x[a] += dx * translate * w[a];
+            y[a] += dy * translate * w[a];
+            z[a] += dz * translate * w[a];
+            x[b] -= dx * translate * w[b];
+            y[b] -= dy * translate * w[b];
+            z[b] -= dz * translate * w[b];
+        }
+
+        // The point stays on its side of the triangle plane, at thickness distance
+        // from the point of the triangle with the detected barycentric coordinates.
+        // Points found across the plane are left alone, dragging them back through
+        // a tangled cloth only makes it fight its own constraints.
+        void solve_triangle_contact(Cloth* cloth, const TriangleContact& contact) const {
+            double* x = cloth->x.data();
+            double* y = cloth->y.data();
+            double* z = cloth->z.data();
+            const double* w = cloth->inv_mass.data();
+            const int* v = &cloth->triangles[3 * contact.triangle];
+            const int p = contact.point;
+            double nx, ny, nz;
+            get_normal(cloth, v, nx, ny, nz);
+            const double* b = contact.barycentric;
+            double qx = b[0] * x[v[0]] + b[1] * x[v[1]] + b[2] * x[v[2]];
+            double qy = b[0] * y[v[0]] + b[1] * y[v[1]] + b[2] * y[v[2]];
+            double qz = b[0] * z[v[0]] + b[1] * z[v[1]] + b[2] * z[v[2]];
+            double c = contact.side * ((x[p] - qx) * nx + (y[p] - qy) * ny + (z[p] - qz) * nz) - thickness;
+            double weight = w[p] + b[0] * b[0] * w[v[0]] + b[1] * b[1] * w[v[1]] + b[2] * b[2] * w[v[2]];
+            if (c >= 0 || c < -thickness || weight == 0)
+                return;
+            double lambda = -c / weight * contact.side;
+            x[p] += nx * lambda * w[p];
+            y[p] += ny * lambda * w[p];
+            z[p] += nz * lambda * w[p];
+            for (int k = 0; k < 3; k++) {
+                double move = lambda * b[k] * w[v[k]];
+                x[v[k]] -= nx * move;
+                y[v[k]] -= ny * move;
+                z[v[k]] -= nz * move;
+            }
+        }
+
+        // Unit normal of a triangle, from the current positions
+        static inline void get_normal(const Cloth* cloth, const int* v, double& nx, double& ny, double& nz) {
+            double ux = cloth->x[v[1]] - cloth->x[v[0]], uy = cloth->y[v[1]] - cloth->y[v[0]], uz = cloth->z[v[1]] - cloth->z[v[0]];
+            double vx = cloth->x[v[2]] - cloth->x[v[0]], vy = cloth->y[v[2]] - cloth->y[v[0]], vz = cloth->z[v[2]] - cloth->z[v[0]];
+            nx = uy * vz - uz * vy;
+            ny = uz * vx - ux * vz;
+            nz = ux * vy - uy * vx;
+            double length = sqrt(nx * nx + ny * ny + nz * nz) + 0.00001;
+            nx /= length;
+            ny /= length;
+            nz /= length;
+        }
+
+        // Returns wether point i is linked by a constraint to a point of the triangle v
+        bool is_linked(int i, const int* v) const {
+            for (int k = 0; k < 3; k++)
+                for (int e = adjacency.row_start[v[k]]; e < adjacency.row_start[v[k] + 1]; e++)
+                    if (adjacency.row_other[e] == i)
+                        return true;
+            return false;
+        }
+
+        // Quantities of a triangle shared by the tests of all the points around it
+        struct TriangleFrame {
+            int triangle;
+            double origin[3], normal[3], u[3], v[3];
+            double uu, uv, vv, inv_determinant;
+            double old_origin[3], old_normal[3]; // Unnormalized
+        };
+
+        // Returns false for degenerate triangles
+        static bool get_frame(const Cloth* cloth, int t, TriangleFrame& frame) {
+            const int* v = &cloth->triangles[3 * t];
+            const std::vector<double>* position[3] = { &cloth->x, &cloth->y, &cloth->z };
+            const std::vector<double>* old_position[3] = { &cloth->old_x, &cloth->old_y, &cloth->old_z };
+            double old_u[3], old_v[3];
+            for (int a = 0; a < 3; a++) {
+                frame.origin[a] = (*position[a])[v[0]];
+                frame.u[a] = (*position[a])[v[1]] - frame.origin[a];
+                frame.v[a] = (*position[a])[v[2]] - frame.origin[a];
+                frame.old_origin[a] = (*old_position[a])[v[0]];
+                old_u[a] = (*old_position[a])[v[1]] - frame.old_origin[a];
+                old_v[a] = (*old_position[a])[v[2]] - frame.old_origin[a];
+            }
+            frame.triangle = t;
+            get_normal(cloth, v, frame.normal[0], frame.normal[1], frame.normal[2]);
+            frame.old_normal[0] = old_u[1] * old_v[2] - old_u[2] * old_v[1];
+            frame.old_normal[1] = old_u[2] * old_v[0] - old_u[0] * old_v[2];
+            frame.old_normal[2] = old_u[0] * old_v[1] - old_u[1] * old_v[0];
+            frame.uu = frame.u[0] * frame.u[0] + frame.u[1] * frame.u[1] + frame.u[2] * frame.u[2];
+            frame.uv = frame.u[0] * frame.v[0] + frame.u[1] * frame.v[1] + frame.u[2] * frame.v[2];
+            frame.vv = frame.v[0] * frame.v[0] + frame.v[1] * frame.v[1] + frame.v[2] * frame.v[2];
+            double determinant = frame.uu * frame.vv - frame.uv * frame.uv;
+            frame.inv_determinant = 1 / determinant;
+            return determinant > 0;
+        }
+
+        // Returns wether point i, at (x, y, z), is within reach of a triangle, above or below its interior
+        static bool test_triangle(const Cloth* cloth, int i, double x, double y, double z,
+                                  const TriangleFrame& frame, double reach, TriangleContact& contact) {
+            double p[3] = { x - frame.origin[0], y - frame.origin[1], z - frame.origin[2] };
+            double height = p[0] * frame.normal[0] + p[1] * frame.normal[1] + p[2] * frame.normal[2];
+            if (fabs(height) >= reach)
+                return false;
+
+            // Barycentric coordinates of the projection on the plane
+            double pu = p[0] * frame.u[0] + p[1] * frame.u[1] + p[2] * frame.u[2];
+            double pv = p[0] * frame.v[0] + p[1] * frame.v[1] + p[2] * frame.v[2];
+            double b1 = (frame.vv * pu - frame.uv * pv) * frame.inv_determinant;
+            double b2 = (frame.uu * pv - frame.uv * pu) * frame.inv_determinant;
+            if (b1 < 0 || b2 < 0 || b1 + b2 > 1)
+                return false;
+
+            // The side the point was on at the previous positions, before the last integration
+            double old_height = (cloth->old_x[i] - frame.old_origin[0]) * frame.old_normal[0] +
+                                (cloth->old_y[i] - frame.old_origin[1]) * frame.old_normal[1] +
+                                (cloth->old_z[i] - frame.old_origin[2]) * frame.old_normal[2];
+
+            // Points that changed side since are already through, or tangled
+            const double side = old_height < 0 ? -1 : 1;
+            if (side * height < 0)
+                return false;
+
+            contact.point = i;
+            contact.triangle = frame.triangle;
+            contact.barycentric[0] = 1 - b1 - b2;
+            contact.barycentric[1] = b1;
+            contact.barycentric[2] = b2;
+            contact.side = side;
+            return true;
+        }
+};
@@ -0,0 +1,254 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "cloth.h"
+
+const char SNAPSHOT_MAGIC[8] = { 'C', '-', 'L', 'O', 'T', 'H', 'S', 'S' };
+const uint32_t SNAPSHOT_VERSION = 3;    // Bumped when the layout of the snapshots changes
+const int SNAPSHOT_ALIGNMENT = 64;      // Of each array in the file, as the arrays in memory
+
+// Arrays of a snapshot, in the order they're stored
+enum SnapshotSection {
+    SNAPSHOT_X, SNAPSHOT_Y, SNAPSHOT_Z,
+    SNAPSHOT_OLD_X, SNAPSHOT_OLD_Y, SNAPSHOT_OLD_Z,
+    SNAPSHOT_INV_MASS,
+    SNAPSHOT_CONSTRAINT_A, SNAPSHOT_CONSTRAINT_B, SNAPSHOT_CONSTRAINT_REST,
+    SNAPSHOT_TRIANGLES,
+    SNAPSHOT_ORDER,
+    SNAPSHOT_SOURCES,
+    N_SNAPSHOT_SECTIONS
+};
+
+// Settings of the simulation the state of a snapshot was reached with, saved along with it
+struct SnapshotParameters {
+    double dt = 0;                 // Of each step
+    double damping = DAMPING;
+    int32_t solver_mode = 0;
+    int32_t n_iterations = 0;      // Constraint iterations (substeps for the small steps solver) of each step
+    float gravity = 0;             // Along y
+    float wind_strength = 0;
+    int32_t wind_octaves = 1;
+    float drag = 0;
+    uint32_t tethers = 0, self_collisions = 0, tearing = 0;
+    float tear_stretch = 0;
+};
+
+// Start of a snapshot file, the arrays follow at the given offsets
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t n_points, n_constraints, n_triangle_indices, n_order;
+    int32_t constraint_start[N_CONSTRAINT_TYPES + 1];
+    float stiffness[N_CONSTRAINT_TYPES];
+    uint32_t torn;
+    SnapshotParameters parameters;
+    uint64_t offsets[N_SNAPSHOT_SECTIONS], sizes[N_SNAPSHOT_SECTIONS];
+};
+
+// A file mapped read only in memory (read at once where there's no mmap)
+struct MappedFile {
+    const char* data = nullptr;
+    size_t size = 0;
+
+    bool open(const char* path) {
+#ifdef _WIN32
+        FILE* file = fopen(path, "rb");
+        if (!file)
+            return false;
+        fseek(file, 0, SEEK_END);
+        buffer.resize(ftell(file));
+        fseek(file, 0, SEEK_SET);
+        const bool read = fread(buffer.data(), 1, buffer.size(), file) == buffer.size();
+        fclose(file);
+        data = buffer.data();
+        size = buffer.size();
+        return read;
+#else
+        const int fd = ::open(path, O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat info;
+        if (fstat(fd, &info) == 0 && info.st_size > 0) {
+            void* mapped = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapped != MAP_FAILED) {
+                data = (const char*)mapped;
+                size = info.st_size;
+            }
+        }
+        ::close(fd);
+        return data != nullptr;
+#endif
+    }
+
+    ~MappedFile() {
+#ifndef _WIN32
+        if (data)
+            munmap((void*)data, size);
+#endif
+    }
+
+    private:
+#ifdef _WIN32
+        std::vector<char> buffer;
+#endif
+};
+
+// Saves the state of the cloth: the positions and the previous positions of its
+// points, their pins, its constraints, triangles and stiffnesses, along with the
+// point of the cloth as built each point was split from by tears (one per point)
+// and the settings it was simulated with. Each array is stored as it is in memory,
+// aligned, after a header giving where it is, so that loading is a copy per array.
+// Returns whether the whole file could be written.
+bool save_snapshot(const Cloth* cloth, const std::vector<int>& sources, const SnapshotParameters& parameters,
+                   const char* path) {
+    if ((int)sources.size() != cloth->get_n_points())
+        return false;
+    const void* arrays[N_SNAPSHOT_SECTIONS] = {
+        cloth->x.data(), cloth->y.data(), cloth->z.data(),
+        cloth->old_x.data(), cloth->old_y.data(), cloth->old_z.data(),
+        cloth->inv_mass.data(),
+        cloth->constraint_a.data(), cloth->constraint_b.data(), cloth->constraint_rest.data(),
+        cloth->triangles.data(),
+        cloth->order.data(),
+        sources.data()
+    };
+    SnapshotHeader header{};
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.n_points = cloth->get_n_points();
+    header.n_constraints = cloth->get_n_constraints();
+    header.n_triangle_indices = cloth->triangles.size();
+    header.n_order = cloth->order.size();
+    for (int t = 0; t <= N_CONSTRAINT_TYPES; t++)
+        header.constraint_start[t] = cloth->constraint_start[t];
+    for (int t = 0; t < N_CONSTRAINT_TYPES; t++)
+        header.stiffness[t] = cloth->stiffness[t];
+    header.torn = cloth->torn;
+    header.parameters = parameters;
+    const uint64_t points = header.n_points * sizeof(double);
+    const uint64_t sizes[N_SNAPSHOT_SECTIONS] = {
+        points, points, points, points, points, points, points,
+        header.n_constraints * sizeof(int), header.n_constraints * sizeof(int), header.n_constraints * sizeof(double),
+        header.n_triangle_indices * sizeof(int),
+        header.n_order * sizeof(int),
+        header.n_points * sizeof(int)
+    };
+    uint64_t offset = sizeof(header);
+    for (int s = 0; s < N_SNAPSHOT_SECTIONS; s++) {
+        offset = (offset + SNAPSHOT_ALIGNMENT - 1) / SNAPSHOT_ALIGNMENT * SNAPSHOT_ALIGNMENT;
+        header.offsets[s] = offset;
+        header.sizes[s] = sizes[s];
+        offset += sizes[s];
+    }
+
+    FILE* file = fopen(path, "wb");
+    if (!file)
+        return false;
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    const char padding[SNAPSHOT_ALIGNMENT] = {};
+    uint64_t written = sizeof(header);
+    for (int s = 0; s < N_SNAPSHOT_SECTIONS && ok; s++) {
+        ok &= fwrite(padding, 1, header.offsets[s] - written, file) == header.offsets[s] - written;
+        ok &= sizes[s] == 0 || fwrite(arrays[s], 1, sizes[s], file) == sizes[s];
+        written = header.offsets[s] + sizes[s];
+    }
+    ok &= fclose(file) == 0;
+    return ok;
+}
+
+// Loads a snapshot saved by save_snapshot() in place of the state of the cloth,
+// the sources of its points and its settings. The file is mapped in memory and
+// each array copied at once, nothing is parsed. The topology and the pins count
+// as changed, so that the solvers rebuild their data. Returns false, leaving
+// everything as it is, if the file is missing, of another version, truncated, or
+// if its arrays don't fit together: a point index out of range, constraint types
+// overlapping, an order that isn't a permutation.
+bool load_snapshot(const char* path, Cloth* cloth, std::vector<int>* sources, SnapshotParameters* parameters) {
+    MappedFile file;
+    if (!file.open(path) || file.size < sizeof(SnapshotHeader))
+        return false;
+    SnapshotHeader header;
+    memcpy(&header, file.data, sizeof(header));
+    if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0 || header.version != SNAPSHOT_VERSION ||
+        header.n_points > INT32_MAX || header.n_constraints > INT32_MAX || header.n_triangle_indices > INT32_MAX ||
+        header.n_triangle_indices % 3 != 0 || (header.n_order != 0 && header.n_order != header.n_points))
+        return false;
+    const uint64_t points = header.n_points * sizeof(double);
+    const uint64_t sizes[N_SNAPSHOT_SECTIONS] = {
+        points, points, points, points, points, points, points,
+        header.n_constraints * sizeof(int), header.n_constraints * sizeof(int), header.n_constraints * sizeof(double),
+        header.n_triangle_indices * sizeof(int),
+        header.n_order * sizeof(int),
+        header.n_points * sizeof(int)
+    };
+    // Aligned, so that the indices can be read in place
+    for (int s = 0; s < N_SNAPSHOT_SECTIONS; s++)
+        if (header.sizes[s] != sizes[s] || header.offsets[s] % SNAPSHOT_ALIGNMENT != 0 ||
+            header.offsets[s] < sizeof(header) || header.offsets[s] > file.size || sizes[s] > file.size - header.offsets[s])
+            return false;
+    if (header.constraint_start[0] != 0 || header.constraint_start[N_CONSTRAINT_TYPES] != (int32_t)header.n_constraints)
+        return false;
+    for (int t = 0; t < N_CONSTRAINT_TYPES; t++)
+        if (header.constraint_start[t] > header.constraint_start[t + 1])
+            return false;
+    auto valid_points = [&](SnapshotSection section) {
+        const int32_t* indices = (const int32_t*)(file.data + header.offsets[section]);
+        for (uint64_t k = 0; k < sizes[section] / sizeof(int32_t); k++)
+            if (indices[k] < 0 || indices[k] >= (int64_t)header.n_points)
+                return false;
+        return true;
+    };
+    if (!valid_points(SNAPSHOT_CONSTRAINT_A) || !valid_points(SNAPSHOT_CONSTRAINT_B) ||
+        !valid_points(SNAPSHOT_TRIANGLES) || !valid_points(SNAPSHOT_ORDER) || !valid_points(SNAPSHOT_SOURCES))
+        return false;
+    // Each point at a single index
+    const int32_t* order = (const int32_t*)(file.data + header.offsets[SNAPSHOT_ORDER]);
+    std::vector<bool> placed(header.n_order);
+    for (uint32_t k = 0; k < header.n_order; k++) {
+        if (placed[order[k]])
+            return false;
+        placed[order[k]] = true;
+    }
+
+    auto copy = [&](SnapshotSection section, auto* array) {
+        array->resize(sizes[section] / sizeof((*array)[0]));
+        if (sizes[section] > 0)
+            memcpy(array->data(), file.data + header.offsets[section], sizes[section]);
+    };
+    copy(SNAPSHOT_X, &cloth->x);
+    copy(SNAPSHOT_Y, &cloth->y);
+    copy(SNAPSHOT_Z, &cloth->z);
+    copy(SNAPSHOT_OLD_X, &cloth->old_x);
+    copy(SNAPSHOT_OLD_Y, &cloth->old_y);
+    copy(SNAPSHOT_OLD_Z, &cloth->old_z);
+    copy(SNAPSHOT_INV_MASS, &cloth->inv_mass);
+    copy(SNAPSHOT_CONSTRAINT_A, &cloth->constraint_a);
+    copy(SNAPSHOT_CONSTRAINT_B, &cloth->constraint_b);
+    copy(SNAPSHOT_CONSTRAINT_REST, &cloth->constraint_rest);
+    copy(SNAPSHOT_TRIANGLES, &cloth->triangles);
+    copy(SNAPSHOT_ORDER, &cloth->order);
+    copy(SNAPSHOT_SOURCES, sources);
+    cloth->force_x.assign(header.n_points, 0);
+    cloth->force_y.assign(header.n_points, 0);
+    cloth->force_z.assign(header.n_points, 0);
+    for (int t = 0; t <= N_CONSTRAINT_TYPES; t++)
+        cloth->constraint_start[t] = header.constraint_start[t];
+    for (int t = 0; t < N_CONSTRAINT_TYPES; t++)
+        cloth->stiffness[t] = header.stiffness[t];
+    cloth->torn = header.torn;
+    *parameters = header.parameters;
+    cloth->topology_version++;
+    cloth->pin_version++;
+    return true;
+}
@@ -0,0 +1,235 @@
+#pragma once
+
+#include <cmath>
+#include <vector>
+
+#include "cloth.h"
+#include "colliders.h"
+#include "coloring.h"
+#include "forces.h"
+#include "parallel.h"
+
+const float SOFT_BODY_STIFFNESS = 0.8;          // Stiffness of the lattice edges
+const float SOFT_BODY_SHEAR_STIFFNESS = 0.5;    // Stiffness of the face diagonals of the lattice cells
+const float SOFT_BODY_VOLUME_STIFFNESS = 1;     // Stiffness of the volume of the tetrahedra
+
+// A volumetric soft body: a 3D lattice of points linked by distance constraints
+// along the edges and the face diagonals of its cells, which unlike the ones of
+// a cloth resist compression too (SOLID and SOLID_SHEAR), each
+// cell being split in 5 tetrahedra that keep their volume. The points and the
+// distance constraints are stored in a Cloth, so that it reuses its integration,
+// the force field, the colliders and the colored parallel solver, and its
+// triangles are the faces of the boundary of the lattice, the only ones rendered.
+// The volume constraints are colored the same way and solved after the distance
+// ones in each iteration.
+struct SoftBody {
+    Cloth points;
+    bool enabled = false;
+    float volume_stiffness = SOFT_BODY_VOLUME_STIFFNESS;
+
+    // Builds a lattice of nx * ny * nz points spaced by spacing, starting from origin along the axes
+    void build_lattice(int nx, int ny, int nz, double spacing, Vec3d origin) {
+        points = Cloth();
+        points.stiffness[SOLID] = SOFT_BODY_STIFFNESS;
+        points.stiffness[SOLID_SHEAR] = SOFT_BODY_SHEAR_STIFFNESS;
+        solver = ColoredSolver();
+        tetrahedra.clear();
+        rest_volumes.clear();
+        this->nx = nx;
+        auto index = [&](int i, int j, int k) { return (k * ny + j) * nx + i; };
+
+        for (int k = 0; k < nz; k++)
+            for (int j = 0; j < ny; j++)
+                for (int i = 0; i < nx; i++)
+                    points.add_point(origin.get_x() + i * spacing, origin.get_y() + j * spacing,
+                                     origin.get_z() + k * spacing, false);
+
+        // Edges along each axis, then the diagonals of the faces of each cell
+        for (int k = 0; k < nz; k++)
+            for (int j = 0; j < ny; j++)
+                for (int i = 0; i < nx; i++) {
+                    if (i > 0)
+                        points.add_constraint(index(i, j, k), index(i - 1, j, k), SOLID, spacing);
+                    if (j > 0)
+                        points.add_constraint(index(i, j, k), index(i, j - 1, k), SOLID, spacing);
+                    if (k > 0)
+                        points.add_constraint(index(i, j, k), index(i, j, k - 1), SOLID, spacing);
+                }
+        const double diagonal = spacing * M_SQRT2;
+        for (int k = 0; k < nz; k++)
+            for (int j = 0; j < ny; j++)
+                for (int i = 0; i < nx; i++) {
+                    if (i > 0 && j > 0) {
+                        points.add_constraint(index(i, j, k), index(i - 1, j - 1, k), SOLID_SHEAR, diagonal);
+                        points.add_constraint(index(i - 1, j, k), index(i, j - 1, k), SOLID_SHEAR, diagonal);
+                    }
+                    if (j > 0 && k > 0) {
+                        points.add_constraint(index(i, j, k), index(i, j - 1, k - 1), SOLID_SHEAR, diagonal);
+                        points.add_constraint(index(i, j - 1, k), index(i, j, k - 1), SOLID_SHEAR, diagonal);
+                    }
+                    if (i > 0 && k > 0) {
+                        points.add_constraint(index(i, j, k), index(i - 1, j, k - 1), SOLID_SHEAR, diagonal);
+                        points.add_constraint(index(i - 1, j, k), index(i, j, k - 1), SOLID_SHEAR, diagonal);
+                    }
+                }
+
+        // Five tetrahedra per cell, mirrored every other cell so that the faces of neighbouring cells match
+        // (corners are numbered by their offsets along the axes, x + 2y + 4z)
+        static const int EVEN_CELL[5][4] = { { 1, 2, 4, 7 }, { 0, 1, 2, 4 }, { 3, 1, 2, 7 }, { 5, 1, 4, 7 }, { 6, 2, 4, 7 } };
+        static const int ODD_CELL[5][4] = { { 0, 3, 5, 6 }, { 1, 0, 3, 5 }, { 2, 0, 3, 6 }, { 4, 0, 5, 6 }, { 7, 3, 5, 6 } };
+        for (int k = 0; k < nz - 1; k++)
+            for (int j = 0; j < ny - 1; j++)
+                for (int i = 0; i < nx - 1; i++) {
+                    const int (*cell)[4] = (i + j + k) % 2 == 0 ? EVEN_CELL : ODD_CELL;
+                    for (int t = 0; t < 5; t++) {
+                        for (int c = 0; c < 4; c++) {
+                            const int corner = cell[t][c];
+                            tetrahedra.push_back(index(i + (corner & 1), j + (corner >> 1 & 1), k + (corner >> 2 & 1)));
+                        }
+                        rest_volumes.push_back(get_volume(tetrahedra.size() / 4 - 1));
+                    }
+                }
+
+        // Boundary faces, two triangles per cell face on each of the six sides, facing outwards
+        for (int axis = 0; axis < 3; axis++) {
+            const int size[3] = { nx, ny, nz };
+            const int u = (axis + 1) % 3, v = (axis + 2) % 3;
+            for (int side = 0; side < 2; side++)
+                for (int a = 0; a < size[u] - 1; a++)
+                    for (int b = 0; b < size[v] - 1; b++) {
+                        int corner[4];
+                        for (int q = 0; q < 4; q++) {
+                            int position[3];
+                            position[axis] = side * (size[axis] - 1);
+                            position[u] = a + (q & 1);
+                            position[v] = b + (q >> 1);
+                            corner[q] = index(position[0], position[1], position[2]);
+                        }
+                        // Counterclockwise from the outside, the u, v, axis frame being right handed
+                        if (side == 1) {
+                            points.add_triangle(corner[0], corner[1], corner[2]);
+                            points.add_triangle(corner[1], corner[3], corner[2]);
+                        } else {
+                            points.add_triangle(corner[0], corner[2], corner[1]);
+                            points.add_triangle(corner[1], corner[2], corner[3]);
+                        }
+                    }
+        }
+        volume_version = -1;
+    }
+
+    int get_n_tetrahedra() const {
+        return rest_volumes.size();
+    }
+
+    // Returns the number of distance and volume constraints
+    int get_n_constraints() const {
+        return points.get_n_constraints() + get_n_tetrahedra();
+    }
+
+    // Runs the given number of iterations over the distance constraints, then the volume ones
+    void constrain(int iterations) {
+        if (volume_version != points.topology_version) {
+            color_items<4>(get_n_tetrahedra(), points.get_n_points(),
+                [&](int t, int* corners) {
+                    for (int c = 0; c < 4; c++)
+                        corners[c] = tetrahedra[4 * t + c];
+                }, &volume_colors, &volume_leftovers);
+            volume_version = points.topology_version;
+        }
+        for (int i = 0; i < iterations; i++) {
+            solver.constrain(&points, 1);
+            for (const std::vector<int>& color : volume_colors)
+                parallel_for(color.size(), [&](int begin, int end) {
+                    for (int t = begin; t < end; t++)
+                        keep_volume(color[t]);
+                });
+            for (int t : volume_leftovers)
+                keep_volume(t);
+        }
+    }
+
+    // Advances the soft body by one step of dt, in the same order as the
+    // verlet cloth solver. The wind is sampled along the rows of the lattice.
+    // colliders can be null, the soft body keeps its own collision state.
+    void simulate(ForceField* forces, const Colliders* colliders, int iterations, double dt, float time) {
+        if (colliders)
+            this->colliders.copy_colliders(*colliders);
+
+        constrain(iterations);
+        if (colliders)
+            this->colliders.project(&points, false);
+
+        forces->evaluate(&points, nx, dt, time);
+        points.integrate(dt);
+
+        if (colliders) {
+            this->colliders.cull(&points);
+            this->colliders.project(&points, true);
+            this->colliders.sweep(&points);
+        }
+    }
+
+    private:
+        int nx = 0;
+        // Four points per tetrahedron
+        std::vector<int> tetrahedra;
+        std::vector<double> rest_volumes;
+        ColoredSolver solver;
+        int volume_version = -1;
+        std::vector<std::vector<int>> volume_colors;
+        std::vector<int> volume_leftovers;
+        // Collision state of the soft body, with the colliders shared with the cloth copied in
+        Colliders colliders;
+
+        // Returns the signed volume of tetrahedron t
+        double get_volume(int t) const {
+            const int* p = &tetrahedra[4 * t];
+            double e[3][3];
+            for (int c = 0; c < 3; c++) {
+                e[c][0] = points.x[p[c + 1]] - points.x[p[0]];
+                e[c][1] = points.y[p[c + 1]] - points.y[p[0]];
+                e[c][2] = points.z[p[c + 1]] - points.z[p[0]];
+            }
+            return (e[0][0] * (e[1][1] * e[2][2] - e[1][2] * e[2][1]) +
+                    e[0][1] * (e[1][2] * e[2][0] - e[1][0] * e[2][2]) +
+                    e[0][2] * (e[1][0] * e[2][1] - e[1][1] * e[2][0])) / 6;
+        }
+
+        // Moves the points of tetrahedron t towards its resting volume, along the gradient of the volume
+        void keep_volume(int t) {
+            const int* p = &tetrahedra[4 * t];
+            double e[3][3];
+            for (int c = 0; c < 3; c++) {
+                e[c][0] = points.x[p[c + 1]] - points.x[p[0]];
+                e[c][1] = points.y[p[c + 1]] - points.y[p[0]];
+                e[c][2] = points.z[p[c + 1]] - points.z[p[0]];
+            }
+            // Gradient for each of the last three points, cross product of the edges to the other two
+            double gradient[4][3];
+            for (int c = 0; c < 3; c++) {
+                const double* a = e[(c + 1) % 3];
+                const double* b = e[(c + 2) % 3];
+                gradient[c + 1][0] = (a[1] * b[2] - a[2] * b[1]) / 6;
+                gradient[c + 1][1] = (a[2] * b[0] - a[0] * b[2]) / 6;
+                gradient[c + 1][2] = (a[0] * b[1] - a[1] * b[0]) / 6;
+            }
+            for (int a = 0; a < 3; a++)
+                gradient[0][a] = -(gradient[1][a] + gradient[2][a] + gradient[3][a]);
+
+            const double volume = (e[0][0] * gradient[1][0] + e[0][1] * gradient[1][1] + e[0][2] * gradient[1][2]);
+            double weight = 0;
+            for (int c = 0; c < 4; c++)
+                weight += points.inv_mass[p[c]] *
+                    (gradient[c][0] * gradient[c][0] + gradient[c][1] * gradient[c][1] + gradient[c][2] * gradient[c][2]);
+            if (weight < 1e-12)
+                return;
+            const double lambda = volume_stiffness * (rest_volumes[t] - volume) / weight;
+            for (int c = 0; c < 4; c++) {
+                const double w = lambda * points.inv_mass[p[c]];
+                points.x[p[c]] += w * gradient[c][0];
+                points.y[p[c]] += w * gradient[c][1];
+                points.z[p[c]] += w * gradient[c][2];
+            }
+        }
+};
@@ -0,0 +1,364 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "parallel.h"
+
+const int SUBDIVISION_MAX_LEVELS = 3;   // Each level splitting every triangle in four
+const int SUBDIVISION_ATTRIBUTES = 5;   // Position and texture coordinates, the attributes refined
+const int SUBDIVISION_CORNER_NEIGHBOURS = 3; // Boundary vertices with up to this many neighbours (two triangles) are corners, kept in place
+
+// Loop subdivision of a triangle mesh for rendering, so that a coarse cloth
+// can be simulated and a smooth surface drawn. It works on the vertex data
+// uploaded to the GPU (8 floats per vertex: position, normal, texture
+// coordinates), refining the positions and the texture coordinates, and the
+// refined vertices are then moved to the limit surface with the normals of the
+// limit surface. The stencils depend only on the triangles, they're built once
+// per topology, and each level is applied with fixed size stencils in parallel.
+// Boundary edges follow the boundary rules, so the borders and the tears stay
+// where they are, and the corners of the boundary (like the ones of a grid)
+// don't move at all; the normals of the vertices on them, having no limit
+// tangent plane of their own, are the sum of the normals of their triangles.
+struct LoopSubdivision {
+    // Refines the mesh made of the given triangles over the first n_vertices of vertices, writing the
+    // refined vertices and triangles. version identifies the topology of the mesh, the stencils being
+    // built again when it changes. Returns whether the refined triangles changed since the last call.
+    bool refine(const std::vector<int>& triangles, int n_vertices, const float* vertices, int n_levels, int version,
+                std::vector<float>* refined_vertices) {
+        bool changed = version != this->version || n_levels != (int)levels.size() - 1 ||
+                       n_vertices != levels[0].n_vertices || triangles.size() != levels[0].triangles.size();
+        if (changed)
+            build(triangles, n_vertices, n_levels, version);
+
+        // Attributes of the vertices of the first level
+        data[0].resize(SUBDIVISION_ATTRIBUTES * n_vertices);
+        for (int v = 0; v < n_vertices; v++) {
+            float* attributes = &data[0][SUBDIVISION_ATTRIBUTES * v];
+            attributes[0] = vertices[8 * v];
+            attributes[1] = vertices[8 * v + 1];
+            attributes[2] = vertices[8 * v + 2];
+            attributes[3] = vertices[8 * v + 6];
+            attributes[4] = vertices[8 * v + 7];
+        }
+        for (int l = 0; l < n_levels; l++)
+            split(levels[l], data[l], &data[l + 1]);
+        limit(levels[n_levels], data[n_levels], refined_vertices);
+        return changed;
+    }
+
+    // Returns the triangles of the refined mesh
+    const std::vector<int>& get_triangles() const {
+        return levels.back().triangles;
+    }
+
+    int get_n_vertices() const {
+        return levels.back().n_vertices;
+    }
+
+    private:
+        // Topology of the mesh at a level, and the stencils from it to the next one
+        struct Level {
+            int n_vertices = 0;
+            std::vector<int> triangles;
+            // Edges, each one becoming a vertex of the next level: its two points, then the
+            // third points of its two triangles (its own points on the boundary, weighing nothing)
+            std::vector<int> edge_points;
+            std::vector<float> edge_weights; // Of the two points of each edge, the third points taking the rest
+            // Neighbours of each vertex mixed into it, all of them inside and the two along the boundary,
+            // with the weights of the vertex and of each of them
+            std::vector<int> ring_start, ring;
+            std::vector<float> self_weights, ring_weights;
+            // Neighbours of each vertex, counterclockwise, and how they're laid out around it (last level)
+            std::vector<int> ordered_start, ordered;
+            std::vector<char> ring_types;
+        };
+
+        // All around the vertex, from a boundary neighbour to the other one, or not a single fan of triangles
+        enum RingType { RING_CLOSED, RING_OPEN, RING_BROKEN };
+
+        int version = -1;
+        std::vector<Level> levels = std::vector<Level>(1);
+        // Attributes of the vertices of each level
+        std::vector<float> data[SUBDIVISION_MAX_LEVELS + 1];
+
+        void build(const std::vector<int>& triangles, int n_vertices, int n_levels, int version) {
+            levels.assign(n_levels + 1, Level());
+            levels[0].n_vertices = n_vertices;
+            levels[0].triangles = triangles;
+            for (int l = 0; l < n_levels; l++)
+                build_stencils(&levels[l], &levels[l + 1]);
+            build_rings(&levels[n_levels]);
+            this->version = version;
+        }
+
+        // Builds the stencils of level and the triangles of the next one
+        static void build_stencils(Level* level, Level* next) {
+            const std::vector<int>& triangles = level->triangles;
+            const int n_triangles = triangles.size() / 3;
+            // Sides of the triangles, sorted so that the ones of an edge are together
+            struct Side {
+                int a, b, triangle, side;
+            };
+            std::vector<Side> sides(3 * n_triangles);
+            for (int t = 0; t < n_triangles; t++)
+                for (int s = 0; s < 3; s++) {
+                    const int a = triangles[3 * t + s], b = triangles[3 * t + (s + 1) % 3];
+                    sides[3 * t + s] = Side{ std::min(a, b), std::max(a, b), t, s };
+                }
+            std::sort(sides.begin(), sides.end(), [](const Side& s1, const Side& s2) {
+                return s1.a != s2.a ? s1.a < s2.a : s1.b < s2.b;
+            });
+
+            // Edge of each side of each triangle, and the number of triangles around each edge
+            std::vector<int> side_edges(3 * n_triangles);
+            std::vector<int> edge_triangles;
+            level->edge_points.clear();
+            for (size_t k = 0; k < sides.size(); k++) {
+                const Side& side = sides[k];
+                if (k == 0 || side.a != sides[k - 1].a || side.b != sides[k - 1].b) {
+                    level->edge_points.insert(level->edge_points.end(), { side.a, side.b, side.a, side.b });
+                    edge_triangles.push_back(0);
+                }
+                const int e = edge_triangles.size() - 1;
+                // Third point of the triangle, the first two triangles of the edge giving its wings
+                if (edge_triangles[e] < 2)
+                    level->edge_points[4 * e + 2 + edge_triangles[e]] = triangles[3 * side.triangle + (side.side + 2) % 3];
+                edge_triangles[e]++;
+                side_edges[3 * side.triangle + side.side] = e;
+            }
+            const int n_edges = edge_triangles.size();
+            level->edge_weights.resize(n_edges);
+            for (int e = 0; e < n_edges; e++) {
+                if (edge_triangles[e] == 2)
+                    level->edge_weights[e] = 3.0f / 8;
+                else {
+                    // Boundary (or shared by more than two triangles), the midpoint
+                    level->edge_weights[e] = 0.5f;
+                    level->edge_points[4 * e + 2] = level->edge_points[4 * e];
+                    level->edge_points[4 * e + 3] = level->edge_points[4 * e + 1];
+                }
+            }
+
+            // Neighbours of each vertex, and the boundary ones
+            const int n = level->n_vertices;
+            std::vector<int> n_neighbours(n, 0), n_boundary(n, 0);
+            for (int e = 0; e < n_edges; e++)
+                for (int p = 0; p < 2; p++) {
+                    n_neighbours[level->edge_points[4 * e + p]]++;
+                    n_boundary[level->edge_points[4 * e + p]] += edge_triangles[e] != 2;
+                }
+            level->ring_start.assign(n + 1, 0);
+            for (int v = 0; v < n; v++)
+                level->ring_start[v + 1] = level->ring_start[v] + (n_boundary[v] > 0 ? 2 : n_neighbours[v]);
+            level->ring.resize(level->ring_start[n]);
+            std::vector<int> filled(n, 0);
+            for (int e = 0; e < n_edges; e++)
+                for (int p = 0; p < 2; p++) {
+                    const int v = level->edge_points[4 * e + p];
+                    const bool boundary = edge_triangles[e] != 2;
+                    // Inside all the neighbours, on the boundary the ones along it
+                    if ((n_boundary[v] == 0 || boundary) && filled[v] < level->ring_start[v + 1] - level->ring_start[v])
+                        level->ring[level->ring_start[v] + filled[v]++] = level->edge_points[4 * e + 1 - p];
+                }
+            level->self_weights.resize(n);
+            level->ring_weights.resize(n);
+            for (int v = 0; v < n; v++) {
+                const int k = n_neighbours[v];
+                if (n_boundary[v] == 2 && k > SUBDIVISION_CORNER_NEIGHBOURS) {
+                    level->self_weights[v] = 3.0f / 4;
+                    level->ring_weights[v] = 1.0f / 8;
+                } else if (n_boundary[v] > 0 || k < 3) {
+                    // Corners of the boundary and vertices shared by separate pieces of surface stay
+                    level->self_weights[v] = 1;
+                    level->ring_weights[v] = 0;
+                } else {
+                    // Warren's weights
+                    const float beta = k == 3 ? 3.0f / 16 : 3.0f / (8 * k);
+                    level->self_weights[v] = 1 - k * beta;
+                    level->ring_weights[v] = beta;
+                }
+                // Unused slots of the ring weighing nothing
+                for (int r = filled[v]; r < level->ring_start[v + 1] - level->ring_start[v]; r++)
+                    level->ring[level->ring_start[v] + r] = v;
+            }
+
+            // Each triangle split in four by the vertices of its edges, keeping its orientation
+            next->n_vertices = n + n_edges;
+            next->triangles.resize(4 * triangles.size());
+            for (int t = 0; t < n_triangles; t++) {
+                const int* p = &triangles[3 * t];
+                const int e0 = n + side_edges[3 * t], e1 = n + side_edges[3 * t + 1], e2 = n + side_edges[3 * t + 2];
+                const int split[12] = { p[0], e0, e2, e0, p[1], e1, e2, e1, p[2], e0, e1, e2 };
+                std::copy(split, split + 12, &next->triangles[12 * t]);
+            }
+        }
+
+        // Orders the neighbours of each vertex of the last level counterclockwise, from its triangles
+        static void build_rings(Level* level) {
+            const int n = level->n_vertices;
+            const int n_triangles = level->triangles.size() / 3;
+            // Triangles around each vertex, as the pairs of their other points in order
+            std::vector<int> start(n + 1, 0);
+            for (int p : level->triangles)
+                start[p + 1]++;
+            for (int v = 0; v < n; v++)
+                start[v + 1] += start[v];
+            std::vector<int> pairs(2 * start[n]);
+            std::vector<int> filled(start.begin(), start.end() - 1);
+            for (int t = 0; t < n_triangles; t++)
+                for (int s = 0; s < 3; s++) {
+                    const int v = level->triangles[3 * t + s];
+                    pairs[2 * filled[v]] = level->triangles[3 * t + (s + 1) % 3];
+                    pairs[2 * filled[v] + 1] = level->triangles[3 * t + (s + 2) % 3];
+                    filled[v]++;
+                }
+
+            level->ordered_start.assign(n + 1, 0);
+            level->ordered.clear();
+            level->ring_types.assign(n, RING_OPEN);
+            for (int v = 0; v < n; v++) {
+                const int first = start[v], count = start[v + 1] - start[v];
+                // Starting from the pair whose first point follows no other one, if any
+                int current = first;
+                for (int k = first; k < first + count; k++) {
+                    bool followed = false;
+                    for (int q = first; q < first + count; q++)
+                        followed |= pairs[2 * q + 1] == pairs[2 * k];
+                    if (!followed) {
+                        current = k;
+                        break;
+                    }
+                }
+                const size_t ring_first = level->ordered.size();
+                if (count > 0)
+                    level->ordered.push_back(pairs[2 * current]);
+                int walked = 0;
+                while (walked < count) {
+                    const int b = pairs[2 * current + 1];
+                    walked++;
+                    if (b == level->ordered[ring_first]) {
+                        level->ring_types[v] = RING_CLOSED;
+                        break;
+                    }
+                    level->ordered.push_back(b);
+                    // Next triangle, the one starting where this one ends
+                    int next = -1;
+                    for (int q = first; q < first + count; q++)
+                        if (pairs[2 * q] == b)
+                            next = q;
+                    if (next < 0)
+                        break;
+                    current = next;
+                }
+                // Walked around the vertex without using all its triangles, it's not a manifold one
+                if (walked != count)
+                    level->ring_types[v] = RING_BROKEN;
+                level->ordered_start[v + 1] = level->ordered.size();
+            }
+        }
+
+        // Applies the stencils of level to the attributes of its vertices
+        static void split(const Level& level, const std::vector<float>& from, std::vector<float>* to) {
+            const int n = level.n_vertices;
+            const int n_edges = level.edge_weights.size();
+            to->resize(SUBDIVISION_ATTRIBUTES * (n + n_edges));
+            float* out = to->data();
+            const float* in = from.data();
+            parallel_for(n, [&](int begin, int end) {
+                for (int v = begin; v < end; v++) {
+                    float sum[SUBDIVISION_ATTRIBUTES] = {};
+                    for (int r = level.ring_start[v]; r < level.ring_start[v + 1]; r++)
+                        for (int a = 0; a < SUBDIVISION_ATTRIBUTES; a++)
+                            sum[a] += in[SUBDIVISION_ATTRIBUTES * level.ring[r] + a];
+                    for (int a = 0; a < SUBDIVISION_ATTRIBUTES; a++)
+                        out[SUBDIVISION_ATTRIBUTES * v + a] =
+                            level.self_weights[v] * in[SUBDIVISION_ATTRIBUTES * v + a] + level.ring_weights[v] * sum[a];
+                }
+            });
+            parallel_for(n_edges, [&](int begin, int end) {
+                for (int e = begin; e < end; e++) {
+                    const int* p = &level.edge_points[4 * e];
+                    const float w = level.edge_weights[e];
+                    const float wings = 0.5f - w;
+#pragma omp simd
+                    for (int a = 0; a < SUBDIVISION_ATTRIBUTES; a++)
+                        out[SUBDIVISION_ATTRIBUTES * (n + e) + a] =
+                            w * (in[SUBDIVISION_ATTRIBUTES * p[0] + a] + in[SUBDIVISION_ATTRIBUTES * p[1] + a]) +
+                            wings * (in[SUBDIVISION_ATTRIBUTES * p[2] + a] + in[SUBDIVISION_ATTRIBUTES * p[3] + a]);
+                }
+            });
+        }
+
+        // Writes the vertices of the last level on the limit surface, with its normals, as 8 floats each
+        static void limit(const Level& level, const std::vector<float>& from, std::vector<float>* vertices) {
+            const int n = level.n_vertices;
+            vertices->resize(8 * n);
+            float* out = vertices->data();
+            const float* in = from.data();
+            parallel_for(n, [&](int begin, int end) {
+                for (int v = begin; v < end; v++) {
+                    const int first = level.ordered_start[v];
+                    const int k = level.ordered_start[v + 1] - first;
+                    const float* self = &in[SUBDIVISION_ATTRIBUTES * v];
+                    float position[SUBDIVISION_ATTRIBUTES];
+                    float normal[3] = {};
+                    if (level.ring_types[v] == RING_CLOSED && k >= 3) {
+                        // Limit masks of an interior vertex, the weight of its neighbours and two tangents
+                        const float beta = k == 3 ? 3.0f / 16 : 3.0f / (8 * k);
+                        const float chi = 1 / (k + 3 / (8 * beta));
+                        float sum[SUBDIVISION_ATTRIBUTES] = {}, tangent1[3] = {}, tangent2[3] = {};
+                        for (int r = 0; r < k; r++) {
+                            const float* p = &in[SUBDIVISION_ATTRIBUTES * level.ordered[first + r]];
+                            const float c = cos(2 * M_PI * r / k), s = sin(2 * M_PI * r / k);
+                            for (int a = 0; a < SUBDIVISION_ATTRIBUTES; a++)
+                                sum[a] += p[a];
+                            for (int a = 0; a < 3; a++) {
+                                tangent1[a] += c * p[a];
+                                tangent2[a] += s * p[a];
+                            }
+                        }
+                        for (int a = 0; a < SUBDIVISION_ATTRIBUTES; a++)
+                            position[a] = (1 - k * chi) * self[a] + chi * sum[a];
+                        cross(tangent1, tangent2, normal);
+                    } else {
+                        // On the boundary, between its two neighbours along it, the corners
+                        // staying where they are as in the splits
+                        for (int a = 0; a < SUBDIVISION_ATTRIBUTES; a++)
+                            position[a] = self[a];
+                        if (level.ring_types[v] == RING_OPEN && k > SUBDIVISION_CORNER_NEIGHBOURS)
+                            for (int a = 0; a < SUBDIVISION_ATTRIBUTES; a++)
+                                position[a] = 2.0f / 3 * self[a] + (in[SUBDIVISION_ATTRIBUTES * level.ordered[first] + a] +
+                                              in[SUBDIVISION_ATTRIBUTES * level.ordered[first + k - 1] + a]) / 6;
+                        // Normals of the triangles between consecutive neighbours
+                        for (int r = 0; r + 1 < k; r++) {
+                            const float* p = &in[SUBDIVISION_ATTRIBUTES * level.ordered[first + r]];
+                            const float* q = &in[SUBDIVISION_ATTRIBUTES * level.ordered[first + r + 1]];
+                            const float e1[3] = { p[0] - self[0], p[1] - self[1], p[2] - self[2] };
+                            const float e2[3] = { q[0] - self[0], q[1] - self[1], q[2] - self[2] };
+                            float triangle_normal[3];
+                            cross(e1, e2, triangle_normal);
+                            for (int a = 0; a < 3; a++)
+                                normal[a] += triangle_normal[a];
+                        }
+                    }
+                    float* vertex = &out[8 * v];
+                    vertex[0] = position[0];
+                    vertex[1] = position[1];
+                    vertex[2] = position[2];
+                    vertex[3] = normal[0];
+                    vertex[4] = normal[1];
+                    vertex[5] = normal[2];
+                    vertex[6] = position[3];
+                    vertex[7] = position[4];
+                }
+            });
+        }
+
+        static void cross(const float* a, const float* b, float* result) {
+            result[0] = a[1] * b[2] - a[2] * b[1];
+            result[1] = a[2] * b[0] - a[0] * b[2];
+            result[2] = a[0] * b[1] - a[1] * b[0];
+        }
+};
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "cloth.h"
+
+const double SUBSTEP_REFERENCE_DT = 1.0 / 180;   // Step the stiffnesses, the damping and the forces are tuned for, the one of the verlet steps of main()
+
+// Small steps solver: instead of few steps with many constraint iterations
+// each, the frame is split in many substeps running a single constraint
+// sweep. Integration and projection are fused in one pass over the points:
+// each point is integrated right before projecting the constraints whose
+// other end has already been integrated, so every point is loaded once per
+// substep and its constraints are solved while it is still in cache.
+// So that the cloth behaves the same however the frame is split, each
+// substep moves the points as SUBSTEP_REFERENCE_DT does scaled to its length
+// (forces over dt squared, damping compounded) and the stiffnesses are turned
+// into compliances: a stiffness k is what a single sweep corrects at the
+// reference step, the compliance it stands for being scaled by dt squared,
+// which keeps the stretch under a given load independent of dt.
+struct SubstepSolver {
+    // Advances the cloth by one substep of dt, the forces must already be evaluated
+    void step(Cloth* cloth, double dt) {
+        if (topology_version != cloth->topology_version)
+            build_sweep(cloth);
+
+        const int n = cloth->get_n_points();
+        double* __restrict px = cloth->x.data();
+        double* __restrict py = cloth->y.data();
+        double* __restrict pz = cloth->z.data();
+        double* __restrict ox = cloth->old_x.data();
+        double* __restrict oy = cloth->old_y.data();
+        double* __restrict oz = cloth->old_z.data();
+        const double* __restrict w = cloth->inv_mass.data();
+
+        // Length of the substep relative to the reference step
+        const double h = dt / SUBSTEP_REFERENCE_DT;
+        const double damping = pow(1 - DAMPING, h);
+        const double force_dt = dt * h;
+        // Fraction of the error corrected per projection, k h^2 / (k h^2 + 1 - k)
+        // from the compliance (1 - k) / k of the reference step divided by h^2
+        double stiffness[N_CONSTRAINT_TYPES];
+        for (int type = 0; type < N_CONSTRAINT_TYPES; type++) {
+            const double k = cloth->stiffness[type];
+            stiffness[type] = k * h * h / (k * h * h + 1 - k);
+        }
+
+        for (int i = 0; i < n; i++) {
+            double vx = px[i] - ox[i];
+            double vy = py[i] - oy[i];
+            double vz = pz[i] - oz[i];
+            ox[i] = px[i];
+            oy[i] = py[i];
+            oz[i] = pz[i];
+            px[i] += (vx * damping + cloth->force_x[i] * force_dt) * w[i];
+            py[i] += (vy * damping + cloth->force_y[i] * force_dt) * w[i];
+            pz[i] += (vz * damping + cloth->force_z[i] * force_dt) * w[i];
+
+            for (int e = sweep_start[i]; e < sweep_start[i + 1]; e++) {
+                int type = sweep_type[e];
+                cloth->project(sweep_constraint[e], stiffness[type], is_tension_only(type));
+            }
+        }
+    }
+
+    private:
+        int topology_version = -1;
+        // Constraints grouped by their highest point index, in their original order (CSR)
+        std::vector<int> sweep_start, sweep_constraint, sweep_type;
+
+        void build_sweep(Cloth* cloth) {
+            const int n = cloth->get_n_points();
+            const int m = cloth->get_n_constraints();
+            sweep_start.assign(n + 1, 0);
+            for (int c = 0; c < m; c++)
+                sweep_start[std::max(cloth->constraint_a[c], cloth->constraint_b[c]) + 1]++;
+            for (int i = 0; i < n; i++)
+                sweep_start[i + 1] += sweep_start[i];
+
+            std::vector<int> fill(sweep_start.begin(), sweep_start.end() - 1);
+            sweep_constraint.resize(m);
+            sweep_type.resize(m);
+            for (int c = 0; c < m; c++) {
+                int e = fill[std::max(cloth->constraint_a[c], cloth->constraint_b[c])]++;
+                sweep_constraint[e] = c;
+                sweep_type[e] = cloth->get_constraint_type(c);
+            }
+            topology_version = cloth->topology_version;
+        }
+};
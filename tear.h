@@ -0,0 +1,306 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "cloth.h"
+#include "parallel.h"
+
+const float TEAR_STRETCH = 2;             // Length over resting distance beyond which a constraint breaks
+const float TEAR_SPLIT_CAPACITY = 0.5;    // Points the tears can add, as a fraction of the cloth points, reserved up front
+const int TEAR_MAX_TRIANGLES = 16;        // Triangles around a point that its tears can follow
+const int TEAR_MAX_CONSTRAINTS = 32;      // Constraints of a point that its tears can follow
+
+// Breaks the constraints stretched too much and opens the surface where they
+// broke: a point whose triangles are no longer all linked to each other
+// through constraints is split, each group of triangles getting its own copy.
+// Broken constraints are found by a parallel pass that only reads the cloth,
+// the topology is then changed by a serial pass, outside of any solver sweep.
+// The per point lists and the room for the new points are allocated once
+// when the cloth changes from outside, so tearing doesn't allocate per step.
+struct Tearing {
+    bool enabled = false;
+    float max_stretch = TEAR_STRETCH;
+
+    // Breaks the overstretched constraints and splits the points where the surface opened
+    void tear(Cloth* cloth) {
+        if (topology_version != cloth->topology_version)
+            build(cloth);
+        if (cloth->get_n_points() >= capacity)
+            return;
+
+        // Finding the broken constraints, each chunk in its own list
+        const int m = cloth->get_n_constraints();
+        const int n_chunks = get_n_chunks(m);
+        if ((int)chunk_broken.size() < n_chunks)
+            chunk_broken.resize(n_chunks);
+        const double limit = max_stretch * max_stretch;
+        parallel_for(m, [&](int begin, int end) {
+            std::vector<int>& broken = chunk_broken[begin / PARALLEL_GRAIN];
+            broken.clear();
+            for (int c = begin; c < end; c++) {
+                int a = cloth->constraint_a[c], b = cloth->constraint_b[c];
+                double dx = cloth->x[a] - cloth->x[b];
+                double dy = cloth->y[a] - cloth->y[b];
+                double dz = cloth->z[a] - cloth->z[b];
+                double rest = cloth->constraint_rest[c];
+                if (dx * dx + dy * dy + dz * dz > limit * rest * rest && tracked[a] && tracked[b])
+                    broken.push_back(c);
+            }
+        });
+
+        // Removing them from the last one, the constraints moved to fill the
+        // holes then all come from after the ones still to remove
+        touched.clear();
+        for (int chunk = n_chunks - 1; chunk >= 0; chunk--)
+            for (int k = chunk_broken[chunk].size() - 1; k >= 0; k--) {
+                const int c = chunk_broken[chunk][k];
+                const int a = cloth->constraint_a[c], b = cloth->constraint_b[c];
+                unlink(a, c);
+                unlink(b, c);
+                cloth->remove_constraint(c, [&](int from, int to) {
+                    replace(cloth->constraint_a[to], from, to);
+                    replace(cloth->constraint_b[to], from, to);
+                });
+                touched.push_back(a);
+                touched.push_back(b);
+            }
+        if (touched.empty())
+            return;
+
+        std::sort(touched.begin(), touched.end());
+        touched.erase(std::unique(touched.begin(), touched.end()), touched.end());
+        for (int i : touched)
+            split(cloth, i);
+        topology_version = cloth->topology_version;
+    }
+
+    // Returns the point of the cloth as it was built that point i was split from, i itself if it wasn't
+    int get_source(int i) const {
+        return source[i];
+    }
+
+    // Returns the source of each of the n first points, to save along with the cloth
+    std::vector<int> get_sources(int n) const {
+        std::vector<int> sources(n);
+        for (int i = 0; i < n; i++)
+            sources[i] = i < (int)source.size() ? source[i] : i;
+        return sources;
+    }
+
+    // Restores the sources of the points of a cloth saved with get_sources(), before it's torn
+    // any further. The room for new points is counted from the points the cloth was built with,
+    // the ones that are their own source ahead of the ones split from them
+    void set_sources(const std::vector<int>& sources) {
+        int n_built = 0;
+        while (n_built < (int)sources.size() && sources[n_built] == n_built)
+            n_built++;
+        capacity = std::max(capacity, n_built + (int)(n_built * TEAR_SPLIT_CAPACITY));
+        source = sources;
+        topology_version = -1;
+    }
+
+    // Calls upload(first, count) for each run of consecutive triangles whose
+    // points changed since the last call, to update them on the GPU
+    template <typename Upload>
+    void flush_changed_triangles(Upload upload) {
+        std::sort(changed_triangles.begin(), changed_triangles.end());
+        changed_triangles.erase(std::unique(changed_triangles.begin(), changed_triangles.end()), changed_triangles.end());
+        for (size_t first = 0; first < changed_triangles.size();) {
+            size_t last = first;
+            while (last + 1 < changed_triangles.size() && changed_triangles[last + 1] == changed_triangles[last] + 1)
+                last++;
+            upload(changed_triangles[first], (int)(last - first + 1));
+            first = last + 1;
+        }
+        changed_triangles.clear();
+    }
+
+    private:
+        int topology_version = -1;
+        // Number of points the lists have room for
+        int capacity = 0;
+        // Triangles and constraints of each point, in slots of TEAR_MAX_TRIANGLES and TEAR_MAX_CONSTRAINTS
+        std::vector<int> point_triangles, point_constraints;
+        std::vector<int> n_triangles, n_constraints;
+        // Points whose lists fit in their slots, only their constraints break
+        std::vector<char> tracked;
+        std::vector<int> source;
+        std::vector<std::vector<int>> chunk_broken;
+        // Points that lost constraints during the current step
+        std::vector<int> touched;
+        std::vector<int> changed_triangles;
+
+        void build(Cloth* cloth) {
+            const int n = cloth->get_n_points();
+            // The room is kept across rebuilds, the renderer sized its buffers after it
+            if (capacity < n)
+                capacity = n + (int)(n * TEAR_SPLIT_CAPACITY);
+            point_triangles.assign(capacity * TEAR_MAX_TRIANGLES, 0);
+            point_constraints.assign(capacity * TEAR_MAX_CONSTRAINTS, 0);
+            n_triangles.assign(capacity, 0);
+            n_constraints.assign(capacity, 0);
+            tracked.assign(capacity, 1);
+            // The points split before keep their source
+            const int n_sources = std::min((int)source.size(), n);
+            source.resize(capacity);
+            for (int i = n_sources; i < capacity; i++)
+                source[i] = i;
+            for (int t = 0; t < cloth->get_n_triangles(); t++)
+                for (int k = 0; k < 3; k++) {
+                    int i = cloth->triangles[3 * t + k];
+                    if (n_triangles[i] < TEAR_MAX_TRIANGLES)
+                        point_triangles[i * TEAR_MAX_TRIANGLES + n_triangles[i]++] = t;
+                    else
+                        tracked[i] = 0;
+                }
+            for (int c = 0; c < cloth->get_n_constraints(); c++)
+                for (int i : { cloth->constraint_a[c], cloth->constraint_b[c] }) {
+                    if (n_constraints[i] < TEAR_MAX_CONSTRAINTS)
+                        point_constraints[i * TEAR_MAX_CONSTRAINTS + n_constraints[i]++] = c;
+                    else
+                        tracked[i] = 0;
+                }
+            cloth->reserve_points(capacity);
+            touched.reserve(n);
+            changed_triangles.reserve(cloth->get_n_triangles());
+            topology_version = cloth->topology_version;
+        }
+
+        // Removes constraint c from the list of point i
+        void unlink(int i, int c) {
+            int* constraints = &point_constraints[i * TEAR_MAX_CONSTRAINTS];
+            int* last = constraints + n_constraints[i];
+            *std::find(constraints, last, c) = *(last - 1);
+            n_constraints[i]--;
+        }
+
+        // Renames constraint from as to in the list of point i, if there (untracked points miss some)
+        void replace(int i, int from, int to) {
+            int* constraints = &point_constraints[i * TEAR_MAX_CONSTRAINTS];
+            int* found = std::find(constraints, constraints + n_constraints[i], from);
+            if (found != constraints + n_constraints[i])
+                *found = to;
+        }
+
+        // Whether a constraint still links point i to point j
+        bool is_linked(const Cloth* cloth, int i, int j) const {
+            const int* constraints = &point_constraints[i * TEAR_MAX_CONSTRAINTS];
+            for (int k = 0; k < n_constraints[i]; k++) {
+                int c = constraints[k];
+                if (cloth->constraint_a[c] + cloth->constraint_b[c] - i == j)
+                    return true;
+            }
+            return false;
+        }
+
+        // Groups the triangles around point i, two triangles sharing an edge being in the
+        // same group while a constraint still links the points of the edge, and gives each
+        // group but the first a new copy of the point
+        void split(Cloth* cloth, int i) {
+            const int count = n_triangles[i];
+            int* triangles = &point_triangles[i * TEAR_MAX_TRIANGLES];
+            int group[TEAR_MAX_TRIANGLES];
+            for (int k = 0; k < count; k++)
+                group[k] = k;
+            // Merging the groups of the triangles sharing a linked edge, by relabeling
+            for (int k = 0; k < count; k++)
+                for (int l = k + 1; l < count; l++) {
+                    int shared = get_shared_point(cloth, triangles[k], triangles[l], i);
+                    if (shared < 0 || group[k] == group[l] || !is_linked(cloth, i, shared))
+                        continue;
+                    int from = group[l], to = group[k];
+                    for (int g = 0; g < count; g++)
+                        if (group[g] == from)
+                            group[g] = to;
+                }
+
+            // Directions from the point to each group, for the constraints not on its triangles
+            double direction[TEAR_MAX_TRIANGLES][3] = {};
+            for (int k = 0; k < count; k++) {
+                const int* v = &cloth->triangles[3 * triangles[k]];
+                direction[group[k]][0] += cloth->x[v[0]] + cloth->x[v[1]] + cloth->x[v[2]] - 3 * cloth->x[i];
+                direction[group[k]][1] += cloth->y[v[0]] + cloth->y[v[1]] + cloth->y[v[2]] - 3 * cloth->y[i];
+                direction[group[k]][2] += cloth->z[v[0]] + cloth->z[v[1]] + cloth->z[v[2]] - 3 * cloth->z[i];
+            }
+
+            const int kept = group[0];
+            for (int label = 0; label < count; label++) {
+                if (label == kept || std::find(group, group + n_triangles[i], label) == group + n_triangles[i] ||
+                    cloth->get_n_points() >= capacity)
+                    continue;
+                const int copy = cloth->split_point(i);
+                source[copy] = source[i];
+                tracked[copy] = 1;
+                n_triangles[copy] = 0;
+                n_constraints[copy] = 0;
+
+                // Moving the constraints on the side of the group, while its triangles are still around the point
+                int* constraints = &point_constraints[i * TEAR_MAX_CONSTRAINTS];
+                for (int k = 0; k < n_constraints[i];) {
+                    const int c = constraints[k];
+                    const int other = cloth->constraint_a[c] + cloth->constraint_b[c] - i;
+                    if (get_side(cloth, i, other, group, direction) != label) {
+                        k++;
+                        continue;
+                    }
+                    (cloth->constraint_a[c] == i ? cloth->constraint_a[c] : cloth->constraint_b[c]) = copy;
+                    point_constraints[copy * TEAR_MAX_CONSTRAINTS + n_constraints[copy]++] = c;
+                    constraints[k] = constraints[--n_constraints[i]];
+                }
+
+                // Moving the triangles of the group, keeping the labels in step with them
+                for (int k = 0; k < n_triangles[i];) {
+                    const int t = triangles[k];
+                    if (group[k] != label) {
+                        k++;
+                        continue;
+                    }
+                    int* v = &cloth->triangles[3 * t];
+                    *std::find(v, v + 3, i) = copy;
+                    changed_triangles.push_back(t);
+                    point_triangles[copy * TEAR_MAX_TRIANGLES + n_triangles[copy]++] = t;
+                    n_triangles[i]--;
+                    triangles[k] = triangles[n_triangles[i]];
+                    group[k] = group[n_triangles[i]];
+                }
+                cloth->topology_version++;
+            }
+        }
+
+        // Returns the group of the triangles of point i a constraint to point other belongs to:
+        // the group of a triangle having other as a point if any, else the group in its direction
+        int get_side(const Cloth* cloth, int i, int other, const int* group, const double (*direction)[3]) const {
+            const int* triangles = &point_triangles[i * TEAR_MAX_TRIANGLES];
+            for (int k = 0; k < n_triangles[i]; k++) {
+                const int* v = &cloth->triangles[3 * triangles[k]];
+                if (v[0] == other || v[1] == other || v[2] == other)
+                    return group[k];
+            }
+            const double dx = cloth->x[other] - cloth->x[i];
+            const double dy = cloth->y[other] - cloth->y[i];
+            const double dz = cloth->z[other] - cloth->z[i];
+            int best = -1;
+            double best_alignment = -INFINITY;
+            for (int k = 0; k < n_triangles[i]; k++) {
+                const double* d = direction[group[k]];
+                double alignment = (dx * d[0] + dy * d[1] + dz * d[2]) / (sqrt(d[0] * d[0] + d[1] * d[1] + d[2] * d[2]) + 0.00001);
+                if (alignment > best_alignment) {
+                    best_alignment = alignment;
+                    best = group[k];
+                }
+            }
+            return best;
+        }
+
+        // Returns the point other than i shared by two triangles, -1 if they share no edge through i
+        static int get_shared_point(const Cloth* cloth, int t1, int t2, int i) {
+            const int* v1 = &cloth->triangles[3 * t1];
+            const int* v2 = &cloth->triangles[3 * t2];
+            for (int k = 0; k < 3; k++)
+                if (v1[k] != i && (v2[0] == v1[k] || v2[1] == v1[k] || v2[2] == v1[k]))
+                    return v1[k];
+            return -1;
+        }
+};
@@ -0,0 +1,243 @@
+#pragma once
+
+#include <queue>
+#include <vector>
+
+#include "cloth.h"
+#include "parallel.h"
+
+const int TETHER_ANCHORS = 4; // Nearest pinned points each free point is tethered to
+
+// Long range attachments: each free point is tethered to its TETHER_ANCHORS
+// nearest pinned points, and kept within its geodesic distance from each, the
+// length of the shortest path through the structural constraints at their
+// resting distance. Only those give the length of the cloth: bending
+// constraints would be shortcuts wherever they rest shorter than the
+// structural ones they span. A single anchor only bounds the distance along
+// the direction of the nearest pinned point, the other ones also keep the
+// point from swinging sideways beyond what the cloth allows.
+// A single projection per step stops the cloth from stretching, where the
+// distance constraints alone only spread corrections one constraint per sweep.
+// Tethers are updated incrementally, only around the points that were
+// pinned or unpinned since the last update.
+struct Tethers {
+    bool enabled = false;
+
+    // Brings the tethers up to date with the cloth constraints and pinned points
+    void update(const Cloth* cloth) {
+        if (topology_version != cloth->topology_version)
+            rebuild(cloth);
+        else if (pin_version != cloth->pin_version)
+            repin(cloth);
+        else
+            return;
+        pin_version = cloth->pin_version;
+        compact(cloth);
+    }
+
+    // Moves each free point back within the length of its tethers
+    void constrain(Cloth* cloth) {
+        update(cloth);
+        double* __restrict x = cloth->x.data();
+        double* __restrict y = cloth->y.data();
+        double* __restrict z = cloth->z.data();
+        const int* __restrict point = tether_point.data();
+        const int* __restrict anchor = tether_anchor.data();
+        const double* __restrict length = tether_length.data();
+
+        // Anchors are pinned and never written, so the points are independent.
+        // Missing anchors are the point itself, at an infinite length
+        parallel_for(tether_point.size(), [&](int begin, int end) {
+#pragma omp simd
+            for (int t = begin; t < end; t++) {
+                int i = point[t];
+                for (int k = 0; k < TETHER_ANCHORS; k++) {
+                    int a = anchor[TETHER_ANCHORS * t + k];
+                    double dx = x[i] - x[a];
+                    double dy = y[i] - y[a];
+                    double dz = z[i] - z[a];
+                    double d = sqrt(dx * dx + dy * dy + dz * dz) + 0.00001;
+                    double excess = d - length[TETHER_ANCHORS * t + k];
+                    double scale = (excess > 0 ? excess : 0) / d;
+                    x[i] -= dx * scale;
+                    y[i] -= dy * scale;
+                    z[i] -= dz * scale;
+                }
+            }
+        });
+    }
+
+    // Returns the number of tethered points
+    int get_n_tethers() const {
+        return tether_point.size();
+    }
+
+    private:
+        int topology_version = -1;
+        int pin_version = -1;
+        Adjacency adjacency;
+        // Per point geodesic distances to its nearest pinned points and their indices,
+        // TETHER_ANCHORS slots each sorted by distance (-1 past the reachable ones)
+        std::vector<double> distance;
+        std::vector<int> nearest;
+        // Resting distance of each constraint, infinite for the ones that aren't structural
+        std::vector<double> rest;
+        // Per point pinned state at the last update
+        std::vector<bool> pinned;
+        // Tethers of the free points, as flat arrays of TETHER_ANCHORS slots per point
+        std::vector<int> tether_point, tether_anchor;
+        std::vector<double> tether_length;
+        // Distance from an anchor reached by a point
+        struct QueueEntry {
+            double distance;
+            int point, anchor;
+            bool operator>(const QueueEntry& other) const {
+                return distance > other.distance;
+            }
+        };
+        std::priority_queue<QueueEntry, std::vector<QueueEntry>, std::greater<QueueEntry>> queue;
+
+        void rebuild(const Cloth* cloth) {
+            const int n = cloth->get_n_points();
+            adjacency.build(cloth);
+            rest.assign(cloth->get_n_constraints(), INFINITY);
+            std::copy(cloth->constraint_rest.begin() + cloth->constraint_start[STRUCTURAL],
+                      cloth->constraint_rest.begin() + cloth->constraint_start[STRUCTURAL + 1],
+                      rest.begin() + cloth->constraint_start[STRUCTURAL]);
+            distance.assign(TETHER_ANCHORS * n, INFINITY);
+            nearest.assign(TETHER_ANCHORS * n, -1);
+            pinned.assign(n, false);
+            for (int i = 0; i < n; i++)
+                if (cloth->is_fixed(i)) {
+                    pinned[i] = true;
+                    set_source(i);
+                }
+            propagate();
+            topology_version = cloth->topology_version;
+        }
+
+        // Updates the distances around the points whose pinned state changed
+        void repin(const Cloth* cloth) {
+            const int n = cloth->get_n_points();
+            // Newly pinned points are new sources, their region can only shrink the distances
+            std::vector<bool> unpinned(n, false);
+            bool any_unpinned = false;
+            for (int i = 0; i < n; i++) {
+                if (pinned[i] == cloth->is_fixed(i))
+                    continue;
+                pinned[i] = cloth->is_fixed(i);
+                if (pinned[i])
+                    set_source(i);
+                else
+                    unpinned[i] = any_unpinned = true;
+            }
+
+            // The anchors that were unpinned are removed, then the points that lost some are
+            // reached again from their neighbours, the anchors they had pushed out coming back
+            if (any_unpinned) {
+                std::vector<int> orphans;
+                for (int i = 0; i < n; i++) {
+                    bool orphan = false;
+                    for (int k = 0; k < TETHER_ANCHORS; k++) {
+                        int a = nearest[TETHER_ANCHORS * i + k];
+                        if (a >= 0 && unpinned[a]) {
+                            remove_anchor(i, k--);
+                            orphan = true;
+                        }
+                    }
+                    if (orphan)
+                        orphans.push_back(i);
+                }
+                for (int i : orphans)
+                    for (int e = adjacency.row_start[i]; e < adjacency.row_start[i + 1]; e++) {
+                        int j = adjacency.row_other[e];
+                        for (int k = 0; k < TETHER_ANCHORS && nearest[TETHER_ANCHORS * j + k] >= 0; k++)
+                            queue.push({ distance[TETHER_ANCHORS * j + k], j, nearest[TETHER_ANCHORS * j + k] });
+                    }
+            }
+            propagate();
+        }
+
+        void set_source(int i) {
+            if (insert_anchor(i, i, 0))
+                queue.push({ 0, i, i });
+        }
+
+        // Gives point i the anchor a at distance d if it is among its nearest ones, returns whether it is.
+        // Anchors as far are ordered by index, so that the nearest ones don't depend on the update order
+        bool insert_anchor(int i, int a, double d) {
+            double* slot_distance = &distance[TETHER_ANCHORS * i];
+            int* slot_anchor = &nearest[TETHER_ANCHORS * i];
+            int k = 0;
+            while (k < TETHER_ANCHORS - 1 && slot_anchor[k] >= 0 && slot_anchor[k] != a)
+                k++;
+            auto closer = [&](int k) {
+                return d < slot_distance[k] || (d == slot_distance[k] && a < slot_anchor[k]);
+            };
+            // Already there as near, or farther than all the anchors of a full point
+            if (slot_anchor[k] == a ? d >= slot_distance[k] : slot_anchor[k] >= 0 && !closer(k))
+                return false;
+            // Taking the slot of a or the last one, then moving it up to its place
+            for (; k > 0 && closer(k - 1); k--) {
+                slot_distance[k] = slot_distance[k - 1];
+                slot_anchor[k] = slot_anchor[k - 1];
+            }
+            slot_distance[k] = d;
+            slot_anchor[k] = a;
+            return true;
+        }
+
+        // Removes the k-th anchor of point i, moving the farther ones down
+        void remove_anchor(int i, int k) {
+            double* slot_distance = &distance[TETHER_ANCHORS * i];
+            int* slot_anchor = &nearest[TETHER_ANCHORS * i];
+            for (; k < TETHER_ANCHORS - 1; k++) {
+                slot_distance[k] = slot_distance[k + 1];
+                slot_anchor[k] = slot_anchor[k + 1];
+            }
+            slot_distance[TETHER_ANCHORS - 1] = INFINITY;
+            slot_anchor[TETHER_ANCHORS - 1] = -1;
+        }
+
+        // Returns the distance of point i from anchor a, infinite if it isn't among its nearest ones
+        double get_distance(int i, int a) const {
+            for (int k = 0; k < TETHER_ANCHORS; k++)
+                if (nearest[TETHER_ANCHORS * i + k] == a)
+                    return distance[TETHER_ANCHORS * i + k];
+            return INFINITY;
+        }
+
+        // Dijkstra from the queued points, constraints being as long as their resting distance.
+        // Each point keeps the nearest anchors reaching it, each anchor spreading on its own
+        void propagate() {
+            while (!queue.empty()) {
+                QueueEntry entry = queue.top();
+                queue.pop();
+                int i = entry.point;
+                if (entry.distance > get_distance(i, entry.anchor))
+                    continue;
+                for (int e = adjacency.row_start[i]; e < adjacency.row_start[i + 1]; e++) {
+                    int j = adjacency.row_other[e];
+                    double d = entry.distance + rest[adjacency.row_constraint[e]];
+                    if (d < INFINITY && insert_anchor(j, entry.anchor, d))
+                        queue.push({ d, j, entry.anchor });
+                }
+            }
+        }
+
+        // Gathers the tethers of the free points reachable from a pinned one
+        void compact(const Cloth* cloth) {
+            tether_point.clear();
+            tether_anchor.clear();
+            tether_length.clear();
+            for (int i = 0; i < cloth->get_n_points(); i++)
+                if (!pinned[i] && nearest[TETHER_ANCHORS * i] >= 0) {
+                    tether_point.push_back(i);
+                    for (int k = 0; k < TETHER_ANCHORS; k++) {
+                        const int a = nearest[TETHER_ANCHORS * i + k];
+                        tether_anchor.push_back(a >= 0 ? a : i);
+                        tether_length.push_back(a >= 0 ? distance[TETHER_ANCHORS * i + k] : INFINITY);
+                    }
+                }
+        }
+};
@@ -0,0 +1,127 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "cloth.h"
+#include "grid.h"
+#include "parallel.h"
+
+const int TILE_CACHE_BYTES = 256 * 1024; // Size of the working set of a tile, about a core private cache
+const int TILE_MIN_SIZE = 8;             // Minimum tile side, in points
+const int TILE_ITERATIONS = 5;           // Constraint sweeps run on a tile before moving on
+const int TILE_HALO = 2;                 // Points read around each tile, the reach of the bending stencil
+
+// Cache blocked version of the grid solver. The grid is split in square
+// tiles small enough for a tile and its halo to stay in cache, and each tile
+// runs several sweeps on a local copy before writing it back. Halo points
+// are copied from the neighbouring tiles and kept still (as if pinned)
+// during the local sweeps. Tiles are the unit of parallel work, scheduled in
+// four checkerboard colors so that the halo a tile reads is never being
+// written by another one. Grids too small to give each thread of the pool a
+// tile of each color that way are split in smaller tiles, down to
+// TILE_MIN_SIZE, when the pool has several threads.
+struct TiledGridSolver {
+    // Runs the given number of constraint sweeps, in passes of TILE_ITERATIONS local ones
+    void constrain(Cloth* cloth, int cols, int iterations) {
+        const int rows = cloth->get_n_points() / cols;
+        if (rows != n_rows || cols != n_cols || get_thread_pool().get_n_threads() != n_threads)
+            build_tiles(rows, cols);
+        const GridView<double> grid = get_grid_view(cloth, cols);
+        spacing_x = grid.spacing_x;
+        spacing_y = grid.spacing_y;
+
+        for (int done = 0; done < iterations; done += TILE_ITERATIONS) {
+            int local_iterations = std::min(TILE_ITERATIONS, iterations - done);
+            for (const std::vector<int>& color : colors)
+                get_thread_pool().run(color.size(), [&](int t) {
+                    solve_tile(tiles[color[t]], cloth, local_iterations);
+                });
+        }
+    }
+
+    // Returns the number of tiles the grid was split in at the last sweeps
+    int get_n_tiles() const {
+        return tiles.size();
+    }
+
+    private:
+        // A block of points, with its local copy including the halo
+        struct Tile {
+            // Points owned by the tile
+            int first_row, end_row, first_col, end_col;
+            // Points copied locally
+            int first_halo_row, end_halo_row, first_halo_col, end_halo_col;
+            std::vector<double> x, y, z, inv_mass;
+        };
+        std::vector<Tile> tiles;
+        // Indices of the tiles of each checkerboard color
+        std::vector<int> colors[4];
+        int n_rows = 0, n_cols = 0, n_threads = 0;
+        double spacing_x, spacing_y;
+
+        void build_tiles(int rows, int cols) {
+            n_threads = get_thread_pool().get_n_threads();
+            const int cache_side = (int)std::sqrt(TILE_CACHE_BYTES / (4 * sizeof(double))) - 2 * TILE_HALO;
+            // Splitting without threads to share the tiles would only add halos
+            const int parallel_side = n_threads > 1 ? (int)std::sqrt((double)rows * cols / (4 * n_threads)) : cache_side;
+            const int side = std::max(TILE_MIN_SIZE, std::min(cache_side, parallel_side));
+            tiles.clear();
+            for (std::vector<int>& color : colors)
+                color.clear();
+            for (int first_row = 0, tile_i = 0; first_row < rows; first_row += side, tile_i++)
+                for (int first_col = 0, tile_j = 0; first_col < cols; first_col += side, tile_j++) {
+                    Tile tile;
+                    tile.first_row = first_row;
+                    tile.end_row = std::min(rows, first_row + side);
+                    tile.first_col = first_col;
+                    tile.end_col = std::min(cols, first_col + side);
+                    tile.first_halo_row = std::max(0, tile.first_row - TILE_HALO);
+                    tile.end_halo_row = std::min(rows, tile.end_row + TILE_HALO);
+                    tile.first_halo_col = std::max(0, tile.first_col - TILE_HALO);
+                    tile.end_halo_col = std::min(cols, tile.end_col + TILE_HALO);
+                    const int size = (tile.end_halo_row - tile.first_halo_row) * (tile.end_halo_col - tile.first_halo_col);
+                    for (std::vector<double>* array : { &tile.x, &tile.y, &tile.z, &tile.inv_mass })
+                        array->resize(size);
+                    colors[(tile_i % 2) * 2 + tile_j % 2].push_back(tiles.size());
+                    tiles.push_back(tile);
+                }
+            n_rows = rows;
+            n_cols = cols;
+        }
+
+        void solve_tile(Tile& tile, Cloth* cloth, int iterations) {
+            const int local_cols = tile.end_halo_col - tile.first_halo_col;
+
+            // Gathering the tile, halo points don't move
+            for (int i = tile.first_halo_row; i < tile.end_halo_row; i++) {
+                const int global = i * n_cols + tile.first_halo_col;
+                const int local = (i - tile.first_halo_row) * local_cols;
+                const bool owned_row = i >= tile.first_row && i < tile.end_row;
+                for (int j = 0; j < local_cols; j++) {
+                    const int col = tile.first_halo_col + j;
+                    const bool owned = owned_row && col >= tile.first_col && col < tile.end_col;
+                    tile.x[local + j] = cloth->x[global + j];
+                    tile.y[local + j] = cloth->y[global + j];
+                    tile.z[local + j] = cloth->z[global + j];
+                    tile.inv_mass[local + j] = owned ? cloth->inv_mass[global + j] : 0;
+                }
+            }
+
+            GridView<double> grid{ tile.x.data(), tile.y.data(), tile.z.data(), tile.inv_mass.data(),
+                                   tile.end_halo_row - tile.first_halo_row, local_cols, spacing_x, spacing_y };
+            for (int i = 0; i < iterations; i++)
+                ClothGridSolver::constrain(grid, cloth->stiffness);
+
+            // Scattering back the owned points only
+            for (int i = tile.first_row; i < tile.end_row; i++) {
+                const int global = i * n_cols + tile.first_col;
+                const int local = (i - tile.first_halo_row) * local_cols + tile.first_col - tile.first_halo_col;
+                const int n = tile.end_col - tile.first_col;
+                std::copy_n(&tile.x[local], n, &cloth->x[global]);
+                std::copy_n(&tile.y[local], n, &cloth->y[global]);
+                std::copy_n(&tile.z[local], n, &cloth->z[global]);
+            }
+        }
+};
@@ -1,3 +1,5 @@
+#pragma once
+
 #include <stdexcept>
 
 #include <glm/glm.hpp>